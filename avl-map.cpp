@@ -1,8 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <thread>
+#include <type_traits>
 #include <utility>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #ifndef AVLMAP_H
 #include "avl-map.h"
 #endif
@@ -15,65 +32,73 @@
 namespace CS280 {
 
   // static data members
-  template<typename K, typename V>
-  const typename AVLmap<K, V>::iterator AVLmap<K, V>::end_it{
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  const typename AVLmap<K, V, A, B, N, S, O>::iterator AVLmap<K, V, A, B, N, S, O>::end_it{
     nullptr,
   };
 
-  template<typename K, typename V>
-  const typename AVLmap<K, V>::const_iterator AVLmap<K, V>::const_end_it{
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  const typename AVLmap<K, V, A, B, N, S, O>::const_iterator AVLmap<K, V, A, B, N, S, O>::const_end_it{
     nullptr,
   };
 
-  template<typename K, typename V>
-  AVLmap<K, V>::Node::Node(
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::KeyValue::KeyValue(K key, Stored value):
+      key{std::move(key)}, //
+      stored{std::move(value)} {}
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::KeyValue::Key() const -> const K& {
+    return key;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::KeyValue::Value() -> V& {
+    return payload();
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::KeyValue::Value() const -> const V& {
+    return payload();
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::KeyValue::payload() -> V& {
+    if constexpr (slab_values) {
+      return *stored;
+    } else {
+      return stored;
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::KeyValue::payload() const -> const V& {
+    if constexpr (slab_values) {
+      return *stored;
+    } else {
+      return stored;
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::Node::Node(
     K key,
-    V value,
+    Stored value,
     Node* parent,
-    usize height,
+    usize rank,
     i32 balance,
     Node* left,
     Node* right
   ):
-      key{key}, //
-      value{value},
+      KeyValue{std::move(key), std::move(value)},
       parent{parent},
-      height{height},
+      rank{rank},
       balance{balance},
       left{left},
       right{right} {}
 
-  template<typename K, typename V>
-  AVLmap<K, V>::Node::~Node() {
-    delete left;
-    delete right;
-  }
-
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::clone() const -> Node* {
-    return new Node{
-      key,
-      value,
-      parent,
-      height,
-      balance,
-      left ? left->clone() : left,
-      right ? right->clone() : right
-    };
-  }
-
-  template<typename K, typename V>
-  const K& AVLmap<K, V>::Node::Key() const {
-    return key;
-  }
-
-  template<typename K, typename V>
-  V& AVLmap<K, V>::Node::Value() {
-    return value;
-  }
-
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::first() -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::first() -> Node* {
     Node* node = this;
 
     while (node->left) {
@@ -83,8 +108,8 @@ namespace CS280 {
     return node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::last() -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::last() -> Node* {
     Node* node = this;
 
     while (node->right) {
@@ -94,8 +119,8 @@ namespace CS280 {
     return node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::successor() -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::successor() -> Node* {
     if (right) {
       return right->first();
     }
@@ -111,8 +136,8 @@ namespace CS280 {
     return prev;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::decrement() -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::decrement() -> Node* {
     if (left) {
       return left->last();
     }
@@ -127,20 +152,18 @@ namespace CS280 {
     return (predecessor and predecessor->key == key) ? nullptr : predecessor;
   }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::Node::Node(Node&& from):
-      key{std::move(from.key)},
-      value{std::move(from.value)},
-      height{std::exchange(from.height, 0)},
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::Node::Node(Node&& from):
+      KeyValue{std::move(from)},
+      rank{std::exchange(from.rank, 0)},
       balance{std::exchange(from.balance, 0)},
       left{std::exchange(from.left, nullptr)},
       right{std::exchange(from.right, nullptr)} {}
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::operator=(Node&& from) -> Node& {
-    key = std::move(from.key);
-    value = std::move(from.value);
-    height = std::exchange(from.height, 0);
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::operator=(Node&& from) -> Node& {
+    KeyValue::operator=(std::move(from));
+    rank = std::exchange(from.rank, 0);
     balance = std::exchange(from.balance, 0);
     left = std::exchange(from.left, nullptr);
     right = std::exchange(from.right, nullptr);
@@ -148,237 +171,356 @@ namespace CS280 {
     return *this;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::refresh_balance_and_height() -> void {
-    height = 0;
-    balance = 0;
-
-    if (left) {
-      height = left->height + 1;
-      balance = left->balance;
-    }
-
-    if (right) {
-      height = std::max(height, right->height + 1);
-      balance -= right->balance;
-    }
-
-    if (parent) {
-      parent->refresh_balance_and_height();
-    }
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::Node::print(std::ostream& os) const -> void {
+    os << payload();
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::add_child(K key, V value) -> Node& {
-    Node* node = new Node{
-      std::move(key),
-      std::move(value),
-      this, // parent
-      0,
-      0,
-      nullptr, // left
-      nullptr, // right
-    };
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::iterator::iterator(Entry* node): node{node} {}
 
-    if (key < this->key) {
-      left = node;
-    } else {
-      right = node;
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::iterator::iterator(Entry* node, Entry* last):
+      node{node} {
+    if constexpr (inline_entries) {
+      bound.last = last;
     }
 
-    node->refresh_balance_and_height();
-
-    return *node;
-  }
-
-  template<typename K, typename V>
-  auto AVLmap<K, V>::Node::print(std::ostream& os) const -> void {
-    os << value;
+    static_cast<void>(last);
   }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::iterator::iterator(Node* node): node{node} {}
-
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator++() -> iterator& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator++() -> iterator& {
     if (node == nullptr) {
       return *this;
     }
 
-    node = node->successor();
+    if constexpr (inline_entries) {
+      if (bound.last) {
+        node = node + 1 == bound.last ? nullptr : node + 1;
+        return *this;
+      }
+    }
+
+    node = node_of(node)->successor();
 
     return *this;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator++(int) -> iterator {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator++(int) -> iterator {
     iterator iter{*this};
     operator++();
     return iter;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator*() const -> Node& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator*() const -> Entry& {
     return *node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator->() const -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator->() const -> Entry* {
     return node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator!=(const iterator& rhs) const -> bool {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator!=(const iterator& rhs) const -> bool {
     return node != rhs.node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::iterator::operator==(const iterator& rhs) const -> bool {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::iterator::operator==(const iterator& rhs) const -> bool {
     return node == rhs.node;
   }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::const_iterator::const_iterator(Node* p): node{p} {}
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::const_iterator::const_iterator(Entry* p): node{p} {}
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator++() -> const_iterator& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::const_iterator::const_iterator(
+    Entry* p,
+    Entry* last
+  ):
+      node{p} {
+    if constexpr (inline_entries) {
+      bound.last = last;
+    }
+
+    static_cast<void>(last);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator++() -> const_iterator& {
     if (node == nullptr) {
       return *this;
     }
 
-    node = node->successor();
+    if constexpr (inline_entries) {
+      if (bound.last) {
+        node = node + 1 == bound.last ? nullptr : node + 1;
+        return *this;
+      }
+    }
+
+    node = node_of(node)->successor();
 
     return *this;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator++(int) -> const_iterator {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator++(int) -> const_iterator {
     const_iterator iter{*this};
     operator++();
     return iter;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator*() const -> const Node& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator*() const -> const Entry& {
     return *node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator->() const -> const Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator->() const -> const Entry* {
     return node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator!=( //
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator!=( //
     const const_iterator& rhs
   ) const -> bool {
     return node != rhs.node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::const_iterator::operator==( //
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::const_iterator::operator==( //
     const const_iterator& rhs
   ) const -> bool {
     return node == rhs.node;
   }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::AVLmap(): root{nullptr}, count{0} {}
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::node_type::node_type(): node{nullptr} {}
 
-  template<typename K, typename V>
-  AVLmap<K, V>& AVLmap<K, V>::operator=(const AVLmap& rhs) {
-    if (&rhs == this) {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::node_type::node_type(Node* node): node{node} {}
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::node_type::node_type(node_type&& from):
+      node{std::exchange(from.node, nullptr)} {}
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::node_type::operator=(node_type&& from) -> node_type& {
+    if (&from == this) {
       return *this;
     }
 
-    delete root;
+    free_handle(node);
+    node = std::exchange(from.node, nullptr);
+
+    return *this;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::node_type::~node_type() {
+    free_handle(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::node_type::empty() const -> bool {
+    return node == nullptr;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::node_type::operator bool() const {
+    return node != nullptr;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::node_type::key() const -> K& {
+    return node->key;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::node_type::mapped() const -> V& {
+    return node->payload();
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::AVLmap(): root{nullptr}, count{0} {}
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>& AVLmap<K, V, A, B, N, S, O>::operator=(const AVLmap& rhs) {
+    if (&rhs == this) {
+      return *this;
+    }
 
+    AVLMAP_PROBE(clone_begin, rhs.count);
+    if constexpr (tunable) {
+      options.cache.assign(rhs.options.cache.size(), CacheSlot{0, nullptr});
+    }
+    pending = {};
+    if (count == 0 or rhs.count == 0 or small() or rhs.small()) {
+      discard();
+      root = clone_tree(rhs);
+    } else {
+      recycle(rhs);
+    }
     count = rhs.count;
-    root = rhs.root ? rhs.root->clone() : rhs.root;
+    settle_copy(rhs);
+    if constexpr (tunable) {
+      options.filter = rhs.options.filter;
+    }
+    shared = rhs.shared;
+    AVLMAP_PROBE(clone_end, count);
 
     return *this;
   }
 
-  template<typename K, typename V>
-  AVLmap<K, V>& AVLmap<K, V>::operator=(AVLmap&& from) {
-    delete root;
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>& AVLmap<K, V, A, B, N, S, O>::operator=(AVLmap&& from) {
+    discard();
+    // the pending write stays behind in from, its path moves here
+    from.settle();
 
     count = std::exchange(from.count, 0);
     root = std::exchange(from.root, nullptr);
+    take_options(from);
+    shared = std::move(from.shared);
+    values = std::move(from.values);
+    take_entries(from);
 
     return *this;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::size() -> usize {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::take_options(AVLmap& from) -> void {
+    if constexpr (tunable) {
+      options.cache = std::move(from.options.cache);
+      from.options.cache.clear();
+      options.filter = std::exchange(from.options.filter, CountingBloomFilter{});
+      options.block = std::exchange(from.options.block, NodeBlock<Node>{});
+      options.deferred_frees = from.options.deferred_frees;
+      options.copy_threads = from.options.copy_threads;
+    }
+
+    static_cast<void>(from);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::size() const -> usize {
     return count;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::empty() -> bool {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::empty() const -> bool {
     return count == 0;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::operator[](const K& key) -> V& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::operator[](const K& key) -> V& {
+    AVLMAP_TIME(insert);
+
+    const u64 hash = hash_of(key);
+
+    if (Node* const hit = cached(key, hash)) {
+      accessed(hit);
+      return lend(hit)->payload();
+    }
+
+    if constexpr (inline_entries) {
+      if (small()) {
+        const usize i = entry_rank(key);
+
+        if (i < count and entry(i)->key == key) {
+          return entry(i)->payload();
+        }
+
+        if (count < N) {
+          KeyValue* const created = emplace_entry(i, key, store(V{}));
+          added(nullptr, hash);
+          return created->payload();
+        }
+
+        promote();
+      }
+    }
+
     if (empty()) {
-      root = new Node{
-        key,     // key
-        V{},     // default value
-        nullptr, // parent
-        0,       // height
-        0,       // balance
-        nullptr, // left
-        nullptr, // right
-      };
+      root = make_node(key, store(V{}), nullptr);
       count++;
-      return root->value;
+      AVLMAP_PROBE(node_alloc, root, 0);
+      linked(root);
+      added(root, hash);
+      return lend(root)->payload();
     }
 
     Node* node = index(root, key);
 
     // proper node found
     if (node->key == key) {
-      return node->value;
+      remember(node, hash);
+      accessed(node);
+      return lend(node)->payload();
     }
 
     count++;
-    return node->add_child(std::move(key), V{}).value;
+
+    Node* const child = make_node(key, store(V{}), nullptr);
+    attach(node, child);
+    AVLMAP_PROBE(
+      node_alloc,
+      child,
+      AVLMAP_PROBE_ENABLED(node_alloc) ? getdepth(*child) : 0
+    );
+    linked(child);
+    added(child, hash);
+
+    return lend(child)->payload();
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::index(Node* node, const K& key) const -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::index(Node* node, const K& key) const -> Node* {
     if (node == nullptr) {
       return nullptr;
     }
 
-    if (node->key == key) {
-      return node;
-    }
+    AVLMAP_STAT(counters.lookups += node == root);
 
-    // if on left
-    if (key < node->key) {
+    // windows only order keys that start with the shared prefix
+    const bool by_window = windowed and shares_prefix(key);
+    const u64 window = by_window ? window_of(key) : 0;
 
-      // if no left, return parent
-      if (node->left == nullptr) {
-        return node;
-      }
+    for (;;) {
+      AVLMAP_STAT(counters.nodes_visited++);
 
-      return index(node->left, key);
-    }
+      Node* next;
 
-    // if on right
+      // differing windows decide, equal ones leave it to the full keys
+      if (by_window and window != node->window) {
+        next = window < node->window ? node->left : node->right;
+      } else {
+        AVLMAP_STAT(counters.comparisons++);
 
-    // if right is none, reutnr parent
-    if (node->right == nullptr) {
-      return node;
-    }
+        if (node->key == key) {
+          return node;
+        }
+
+        AVLMAP_STAT(counters.comparisons++);
+        next = key < node->key ? node->left : node->right;
+      }
+
+      // no child on that side, node is the parent
+      if (next == nullptr) {
+        return node;
+      }
 
-    return index(node->right, key);
+      node = next;
+    }
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::balanced_index(Node* node, const K& key) const -> Node* {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::balanced_index(Node* node, const K& key) const -> Node* {
     if (node == nullptr) {
       return nullptr;
     }
@@ -408,186 +550,2519 @@ namespace CS280 {
     return node;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::end() -> iterator {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::end() -> iterator {
     return end_it;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::find(const K& key) -> iterator {
-    Node* node = index(root, key);
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::find(const K& key) -> iterator {
+    AVLMAP_TIME(find);
 
-    return (node and node->key == key) ? iterator{node} : end();
-  }
+    const u64 hash = hash_of(key);
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::erase(iterator it) -> void {
-    if (it == end()) {
-      return;
+    if (filtered_out(hash)) {
+      return end();
     }
 
-    count--;
-
-    Node* const to_erase = it.node;
-
-    Node* const parent = to_erase->parent;
-
-    Node* left = std::exchange(to_erase->left, nullptr);
-    Node* right = std::exchange(to_erase->right, nullptr);
-
-    if (not parent and not left and not right) {
-      root = nullptr;
-      delete to_erase;
-      return;
+    if constexpr (inline_entries) {
+      if (small()) {
+        const usize i = entry_rank(key);
+        return i < count and entry(i)->key == key
+               ? iterator{entry(i), entry(count)}
+               : end();
+      }
     }
 
-    if (parent == nullptr) {
-      delete to_erase;
-      Node* other = nullptr;
+    Node* node = cached(key, hash);
 
-      if (left) {
-        root = left;
-        other = right;
-      } else {
-        root = right;
-        other = left;
-      }
-      root->parent = nullptr;
+    if (node == nullptr) {
+      node = index(root, key);
 
-      if (other == nullptr) {
-        return;
+      if (node == nullptr or not(node->key == key)) {
+        AVLMAP_STAT(counters.filter_false_positives += filtering());
+        return end();
       }
 
-      Node* other_parent = index(root, other->key);
+      remember(node, hash);
+    }
 
-      other->parent = other_parent;
-      if (other_parent->key > other->key) {
-        other_parent->left = other;
-      } else {
-        other_parent->right = other;
-      }
-      other->refresh_balance_and_height();
+    accessed(node);
+    return iterator{lend(node)};
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::erase(iterator it) -> void {
+    AVLMAP_TIME(erase);
 
+    if (it == end()) {
       return;
     }
 
-    // erase node from parent's
-    if (parent->left == to_erase) {
-      parent->left = nullptr;
-    } else {
-      parent->right = nullptr;
+    if constexpr (inline_entries) {
+      if (small()) {
+        forget(nullptr, hash_of(it.node->key));
+        if constexpr (slab_values) {
+          values.free(it.node->stored);
+        }
+        remove_entry(static_cast<usize>(it.node - entry(0)));
+        return;
+      }
     }
 
-    delete to_erase;
+    Node* const erased = detach(node_of(it.node));
+    AVLMAP_PROBE(node_free, erased, count);
+    free_node(erased);
+  }
 
-    if (left == nullptr and right == nullptr) {
-      parent->refresh_balance_and_height();
-      return;
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::extract(iterator it) -> node_type {
+    if (it == end()) {
+      return node_type{};
     }
 
-    if (left) {
-      Node* left_parent = index(parent, left->key);
-      left->parent = left_parent;
-      if (left_parent->key > left->key) {
-        left_parent->left = left;
-      } else {
-        left_parent->right = left;
+    // a handle may outlive the map, it cannot own a slot of the compacted
+    // block or a value in the slab. An inline entry gets a node of its own
+    if constexpr (inline_entries) {
+      if (small()) {
+        KeyValue* const taken = it.node;
+        forget(nullptr, hash_of(taken->key));
+        if constexpr (slab_values) {
+          V* const value = new V(std::move(*taken->stored));
+          values.free(std::exchange(taken->stored, value));
+        }
+
+        Node* const node = new Node{
+          std::move(taken->key),
+          std::move(taken->stored),
+          nullptr,
+          0,
+          0,
+          nullptr,
+          nullptr,
+        };
+        AVLMAP_STAT(counters.allocations++);
+        remove_entry(static_cast<usize>(taken - entry(0)));
+        return node_type{node};
       }
-      left->refresh_balance_and_height();
     }
 
-    if (right) {
-      Node* right_parent = index(parent, right->key);
-      right->parent = right_parent;
-      if (right_parent->key > right->key) {
-        right_parent->left = right;
-      } else {
-        right_parent->right = right;
-      }
+    Node* node = detach(node_of(it.node));
 
-      right->refresh_balance_and_height();
+    if constexpr (slab_values) {
+      V* const value = new V(std::move(*node->stored));
+      values.free(std::exchange(node->stored, value));
     }
-  }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::begin() const -> const_iterator {
-    return root ? const_iterator{root->first()} : end();
-  }
+    if (in_block(node)) {
+      Node* const moved = new Node{
+        std::move(node->key),
+        std::move(node->stored),
+        nullptr,
+        0,
+        0,
+        nullptr,
+        nullptr,
+      };
+      AVLMAP_STAT(counters.allocations++);
+      release(node);
+      node = moved;
+    }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::end() const -> const_iterator {
-    return end_it;
+    return node_type{node};
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::find(const K& key) const -> const_iterator {
-    Node* node = index(root, key);
-    return (node and node->key == key) ? iterator{node} : end();
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::extract(const K& key) -> node_type {
+    return extract(find(key));
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::sanityCheck() -> bool {
-    return true;
-  }
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::insert(node_type&& handle) -> insert_return_type {
+    if (handle.empty()) {
+      return {end(), false, node_type{}};
+    }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::rotate_left(Node* node) -> Node* {
-    Node*& tree = node_ref(*node);
-    Node* const temp = tree;
-    tree = tree->right;
-    temp->right = tree->left;
-    tree->left = temp;
-  }
+    Node* const node = handle.node;
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::rotate_right(Node* node) -> Node* {
-    Node*& tree = node_ref(*node);
-    Node* const temp = tree;
-    tree = tree->left;
-    temp->left = tree->right;
-    tree->right = temp;
-  }
+    const u64 hash = hash_of(node->key);
 
-  template<typename K, typename V>
-  [[nodiscard]] auto AVLmap<K, V>::node_ref(Node& node) -> Node*& {
-    Node* parent = node.parent;
+    // an inline entry takes the key and value, the node goes
+    if constexpr (inline_entries) {
+      if (small()) {
+        const usize i = entry_rank(node->key);
 
-    if (parent == nullptr) {
-      return root;
+        if (i < count and entry(i)->key == node->key) {
+          return {iterator{entry(i), entry(count)}, false, std::move(handle)};
+        }
+
+        if (count < N) {
+          take_value(node);
+          emplace_entry(i, std::move(node->key), std::move(node->stored));
+          AVLMAP_STAT(counters.frees++);
+          delete std::exchange(handle.node, nullptr);
+          added(nullptr, hash);
+          return {iterator{entry(i), entry(count)}, true, node_type{}};
+        }
+
+        promote();
+      }
     }
 
-    return (parent->left == &node) ? parent->left : parent->right;
-  }
+    if (empty()) {
+      root = std::exchange(handle.node, nullptr);
+      take_value(root);
+      count++;
+      linked(root);
+      added(root, hash);
+      return {iterator{lend(root)}, true, node_type{}};
+    }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::AVLmap(const AVLmap& rhs):
-      root{
-        rhs.root ? rhs.root->clone() : nullptr,
-      },
-      count{rhs.count} {}
+    Node* parent = index(root, node->key);
 
-  template<typename K, typename V>
-  AVLmap<K, V>::AVLmap(AVLmap&& from):
-      root{std::exchange(from.root, nullptr)},
-      count{std::exchange(from.count, 0)} {}
+    // key already present, the handle keeps its node
+    if (parent->key == node->key) {
+      return {iterator{lend(parent)}, false, std::move(handle)};
+    }
 
-  template<typename K, typename V>
-  AVLmap<K, V>::~AVLmap() {
-    delete root;
-  }
+    handle.node = nullptr;
+    take_value(node);
+    attach(parent, node);
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::begin() -> iterator {
-    return root ? iterator{root->first()} : end();
+    count++;
+    linked(node);
+    added(node, hash);
+
+    return {iterator{lend(node)}, true, node_type{}};
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::detach(Node* const to_erase) -> Node* {
+    settle();
+    count--;
+    forget(to_erase, hash_of(to_erase->key));
+
+    // where the tree lost a node, the policy rebalances from there
+    Node* parent = nullptr;
+    bool left = false;
+
+    if (to_erase->left == nullptr or to_erase->right == nullptr) {
+      Node* const child = to_erase->left ? to_erase->left : to_erase->right;
+
+      parent = to_erase->parent;
+      left = parent and parent->left == to_erase;
+
+      node_ref(*to_erase) = child;
+      if (child) {
+        child->parent = parent;
+      }
+    } else {
+      // the successor takes the place (and balancing data) of the erased
+      // node, its own position is the one removed
+      Node* const successor = to_erase->right->first();
+
+      std::swap(successor->rank, to_erase->rank);
+      std::swap(successor->balance, to_erase->balance);
+
+      if (successor->parent == to_erase) {
+        parent = successor;
+        left = false;
+      } else {
+        parent = successor->parent;
+        left = true;
+
+        parent->left = successor->right;
+        if (successor->right) {
+          successor->right->parent = parent;
+        }
+
+        successor->right = to_erase->right;
+        successor->right->parent = successor;
+      }
+
+      node_ref(*to_erase) = successor;
+      successor->parent = to_erase->parent;
+      successor->left = to_erase->left;
+      successor->left->parent = successor;
+    }
+
+    // the successor, if it moved, is above parent
+    recombine_path(parent);
+
+    to_erase->parent = nullptr;
+    to_erase->left = nullptr;
+    to_erase->right = nullptr;
+
+    const usize steps = B::unlinked(*this, parent, left, *to_erase);
+    AVLMAP_PROBE(
+      retrace,
+      parent,
+      steps,
+      AVLMAP_PROBE_ENABLED(retrace) ? probe_height(root) : 0
+    );
+
+    AVLMAP_STAT(counters.retraces++);
+    AVLMAP_STAT(counters.retrace_steps += steps);
+
+    static_cast<void>(steps);
+
+    return to_erase;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::begin() const -> const_iterator {
+    if constexpr (inline_entries) {
+      if (small()) {
+        return count ? const_iterator{entry(0), entry(count)} : end();
+      }
+    }
+
+    return root ? const_iterator{root->first()} : end();
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::end() const -> const_iterator {
+    return const_end_it;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::find(const K& key) const -> const_iterator {
+    AVLMAP_TIME_CONST(find);
+
+    const u64 hash = hash_of(key);
+
+    if (filtered_out(hash)) {
+      return end();
+    }
+
+    if constexpr (inline_entries) {
+      if (small()) {
+        const usize i = entry_rank(key);
+        return i < count and entry(i)->key == key
+               ? const_iterator{entry(i), entry(count)}
+               : end();
+      }
+    }
+
+    if (Node* const hit = cached(key, hash)) {
+      return const_iterator{hit};
+    }
+
+    Node* node = index(root, key);
+
+    if (node == nullptr or not(node->key == key)) {
+      AVLMAP_STAT(counters.filter_false_positives += filtering());
+      return end();
+    }
+
+    return const_iterator{node};
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::save(const char* path) const -> bool {
+    static_assert(
+      std::is_trivially_copyable<K>::value
+        and std::is_trivially_copyable<V>::value,
+      "Snapshots store raw key and value bytes"
+    );
+
+    SnapshotHeader header{};
+    header.magic = SnapshotHeader::MAGIC;
+    header.version = SnapshotHeader::VERSION;
+    header.key_size = sizeof(K);
+    header.value_size = sizeof(V);
+    header.count = count;
+    header.key_offset = sizeof(SnapshotHeader);
+    header.key_offset += (alignof(K) - header.key_offset % alignof(K))
+                       % alignof(K);
+    header.value_offset = header.key_offset + count * sizeof(K);
+    header.value_offset += (alignof(V) - header.value_offset % alignof(V))
+                         % alignof(V);
+
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr) {
+      return false;
+    }
+
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // zero bytes up to the next offset, however big the alignment
+    auto pad = [&](usize bytes) {
+      for (usize i = 0; written and i < bytes; i++) {
+        written = std::fputc(0, file) != EOF;
+      }
+    };
+
+    pad(header.key_offset - sizeof(header));
+
+    for (const_iterator it = begin(); written and it != end(); ++it) {
+      written = std::fwrite(&it.node->key, sizeof(K), 1, file) == 1;
+    }
+
+    pad(header.value_offset - header.key_offset - count * sizeof(K));
+
+    for (const_iterator it = begin(); written and it != end(); ++it) {
+      written = std::fwrite(&it.node->payload(), sizeof(V), 1, file) == 1;
+    }
+
+    return (std::fclose(file) == 0) and written;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::load_mmap(const char* path, bool* ok) -> AVLmap {
+    static_assert(
+      std::is_trivially_copyable<K>::value
+        and std::is_trivially_copyable<V>::value,
+      "Snapshots store raw key and value bytes"
+    );
+
+    AVLmap map{};
+
+    if (ok) {
+      *ok = false;
+    }
+
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return map;
+    }
+
+    struct stat info{};
+    if (::fstat(fd, &info) != 0
+        or static_cast<usize>(info.st_size) < sizeof(SnapshotHeader)) {
+      ::close(fd);
+      return map;
+    }
+
+    const usize length = static_cast<usize>(info.st_size);
+    void* const mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapped == MAP_FAILED) {
+      return map;
+    }
+
+    ::madvise(mapped, length, MADV_SEQUENTIAL);
+
+    const char* const bytes = static_cast<const char*>(mapped);
+
+    SnapshotHeader header{};
+    std::memcpy(&header, bytes, sizeof(header));
+
+    const bool valid = header.magic == SnapshotHeader::MAGIC
+                   and header.version == SnapshotHeader::VERSION
+                   and header.key_size == sizeof(K)
+                   and header.value_size == sizeof(V)
+                   and header.key_offset % alignof(K) == 0
+                   and header.value_offset % alignof(V) == 0
+                   and header.key_offset <= length
+                   and header.value_offset <= length
+                   and header.count <= (length - header.key_offset) / sizeof(K)
+                   and header.count
+                         <= (length - header.value_offset) / sizeof(V);
+
+    // keys strictly increasing, or the tree built would not be a search
+    // tree
+    bool sorted = valid;
+    if (valid) {
+      const K* const keys = reinterpret_cast<const K*>(bytes + header.key_offset);
+      for (usize i = 1; sorted and i < header.count; i++) {
+        sorted = keys[i - 1] < keys[i];
+      }
+    }
+
+    if (sorted) {
+      const K* key = reinterpret_cast<const K*>(bytes + header.key_offset);
+      const V* value = reinterpret_cast<const V*>(bytes + header.value_offset);
+
+      auto make = [&]() -> Node* {
+        return map.make_node(*key++, map.store(*value++), nullptr);
+      };
+
+      map.root = map.build_balanced(header.count, nullptr, make);
+      map.count = header.count;
+      if constexpr (windowed) {
+        map.shared.length = 0;
+        map.rewindow();
+      }
+      B::rebuilt(map);
+      AVLMAP_STAT(map.counters.max_height = map.stats().height);
+
+      if (ok) {
+        *ok = true;
+      }
+    }
+
+    ::munmap(mapped, length);
+
+    return map;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Make>
+  auto AVLmap<K, V, A, B, N, S, O>::build_balanced(usize n, Node* parent, Make& make)
+    -> Node* {
+    if (n == 0) {
+      return nullptr;
+    }
+
+    const usize left_count = n / 2;
+
+    Node* const left = build_balanced(left_count, nullptr, make);
+    Node* const node = make();
+    Node* const right = build_balanced(n - left_count - 1, node, make);
+
+    node->parent = parent;
+    node->left = left;
+    node->right = right;
+
+    if (left) {
+      left->parent = node;
+    }
+
+    const i32 left_height = left ? static_cast<i32>(left->rank) : 0;
+    const i32 right_height = right ? static_cast<i32>(right->rank) : 0;
+
+    node->rank = static_cast<usize>(std::max(left_height, right_height) + 1);
+    node->balance = left_height - right_height;
+    recombine(node);
+
+    return node;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::sanityCheck() -> bool {
+    // inline entries are in strictly increasing key order
+    if constexpr (inline_entries) {
+      if (small()) {
+        for (usize i = 1; i < count; i++) {
+          if (not(entry(i - 1)->key < entry(i)->key)) {
+            return false;
+          }
+        }
+
+        return count <= N;
+      }
+    }
+
+    usize n = 0;
+
+    if (not((root == nullptr or root->parent == nullptr)
+            and linked_in_order(root, nullptr, nullptr, n) and n == count)) {
+      return false;
+    }
+
+    if constexpr (windowed) {
+      for (Node* node = root ? root->first() : nullptr; node;
+           node = node->successor()) {
+        if (not shares_prefix(node->key)
+            or node->window != window_of(node->key)) {
+          return false;
+        }
+      }
+    }
+
+    // stored aggregates are exact, except above the pending write
+    if constexpr (augmented) {
+      for (Node* node = root ? root->first() : nullptr; node;
+           node = node->successor()) {
+        if (not written(node)
+            and not(node->aggregate
+                    == A::combine(
+                      A::combine(subtree_aggregate(node->left), lift(*node)),
+                      subtree_aggregate(node->right)
+                    ))) {
+          return false;
+        }
+      }
+    }
+
+    return B::valid(*this);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::linked_in_order(
+    const Node* node,
+    const K* lo,
+    const K* hi,
+    usize& n
+  ) -> bool {
+    if (node == nullptr) {
+      return true;
+    }
+
+    n++;
+
+    if ((lo and not(*lo < node->key)) or (hi and not(node->key < *hi))
+        or (node->left and node->left->parent != node)
+        or (node->right and node->right->parent != node)) {
+      return false;
+    }
+
+    return linked_in_order(node->left, lo, &node->key, n)
+       and linked_in_order(node->right, &node->key, hi, n);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::stats() const -> AVLmapStats {
+    AVLmapStats current{};
+    AVLMAP_STAT(current = AVLmapStats{counters});
+    current.height = subtree_height(root);
+    return current;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::reset_stats() -> void {
+    AVLMAP_STAT(counters = AVLmapCounts<StatCounter>{});
+    AVLMAP_STAT(counters.max_height = stats().height);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::memory_usage() const -> AVLmapMemory {
+    constexpr usize node_size = sizeof(Node);
+    constexpr usize payload = sizeof(K) + sizeof(V);
+    constexpr usize links = 3 * sizeof(Node*);
+
+    // a chunk is the request plus a size header, rounded up to 16 bytes
+    constexpr usize chunk = std::max<usize>(
+      32,
+      (node_size + sizeof(usize) + 15) / 16 * 16
+    );
+
+    // inline entries are counted as entries, not as part of the map object,
+    // and have no links or allocator overhead
+    const usize stored_inline = small() ? count : 0;
+    const usize in_nodes = count - stored_inline;
+
+    // values in the slab are payload, its unused slots the container's, the
+    // pointer to them in the node is metadata
+    constexpr usize in_node = slab_values ? sizeof(K) : payload;
+    usize slab = 0;
+    if constexpr (slab_values) {
+      slab = values.bytes() - count * sizeof(V);
+    }
+
+    // the option state, the block's nodes in use apart
+    usize block_live = 0;
+    usize option_bytes = 0;
+    if constexpr (tunable) {
+      const NodeBlock<Node>& block = options.block;
+      block_live = block.live;
+      option_bytes = options.cache.capacity() * sizeof(CacheSlot)
+                   + options.filter.bytes()
+                   + (block.capacity - block.live) * node_size
+                   + block.spare.capacity() * sizeof(Node*);
+    }
+
+    AVLmapMemory memory{};
+    memory.entries = count;
+    memory.payload = count * payload;
+    memory.links = in_nodes * links;
+    memory.metadata = in_nodes * (node_size - in_node - links)
+                    + stored_inline * (sizeof(KeyValue) - in_node);
+    memory.allocator = (in_nodes - block_live) * (chunk - node_size);
+    memory.container = sizeof(AVLmap) - stored_inline * sizeof(KeyValue)
+                     + option_bytes + slab;
+    memory.total = memory.payload + memory.links + memory.metadata
+                 + memory.allocator + memory.container;
+    return memory;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::clear() -> void {
+    AVLMAP_PROBE(tree_free, count);
+    destroy_entries();
+    destroy(root);
+    root = nullptr;
+    count = 0;
+    pending = {};
+
+    if constexpr (tunable) {
+      std::fill(options.cache.begin(), options.cache.end(), CacheSlot{0, nullptr});
+      if (options.filter.capacity() != 0) {
+        options.filter = CountingBloomFilter{options.filter.capacity()};
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::clear_async() -> void {
+    if (count == 0) {
+      return;
+    }
+
+    AVLMAP_PROBE(tree_free, count);
+
+    // a map on the heap takes the nodes over, its inline entries, block and
+    // slab included, and frees them like any other map does
+    AVLmap* const doomed = new AVLmap{std::move(*this)};
+
+    // the cache and the filter stay on, sized as they were
+    if constexpr (tunable) {
+      doomed->options.deferred_frees = false;
+      options.cache.assign(doomed->options.cache.size(), CacheSlot{0, nullptr});
+      if (doomed->options.filter.capacity() != 0) {
+        options.filter = CountingBloomFilter{doomed->options.filter.capacity()};
+      }
+    }
+
+    DeferredFree::instance().defer([doomed] { delete doomed; });
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::defer_frees(bool on) -> void {
+    static_assert(tunable, "defer_frees needs the RuntimeOptions policy");
+    options.deferred_frees = on;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::parallel_copies(usize threads) -> void {
+    static_assert(tunable, "parallel_copies needs the RuntimeOptions policy");
+    options.copy_threads = threads;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::compact(NodeLayout layout) -> void {
+    static_assert(tunable, "compact needs the RuntimeOptions policy");
+
+    // inline entries are as compact as it gets
+    if (count == 0 or small()) {
+      return;
+    }
+
+    // the old nodes in key order, a walk through them would touch the ones
+    // already moved
+    std::vector<Node*> nodes;
+    nodes.reserve(count);
+    for (Node* node = root->first(); node; node = node->successor()) {
+      nodes.push_back(node);
+    }
+
+    // place in the block of the node of each in-order rank
+    std::vector<usize> position(count);
+    if (layout == NodeLayout::VanEmdeBoas) {
+      usize levels = 0;
+      for (usize n = count; n; n >>= 1) {
+        levels++;
+      }
+
+      usize next = 0;
+      veb_positions(0, count, levels, next, position);
+    } else {
+      std::iota(position.begin(), position.end(), usize{0});
+    }
+
+    NodeBlock<Node> compacted{};
+    compacted.nodes = std::allocator<Node>{}.allocate(count);
+    compacted.capacity = count;
+    compacted.live = count;
+    AVLMAP_STAT(counters.allocations++);
+
+    usize rank = 0;
+    auto make = [&]() -> Node* {
+      Node* const old = nodes[rank];
+      Node* const node = new (compacted.nodes + position[rank++]) Node{
+        std::move(old->key),
+        std::move(old->stored),
+        nullptr,
+        0,
+        0,
+        nullptr,
+        nullptr,
+      };
+      if constexpr (windowed) {
+        node->window = old->window;
+      }
+
+      // the value moved with the node, only its memory goes
+      release(old);
+      return node;
+    };
+
+    root = build_balanced(count, nullptr, make);
+    options.block = std::move(compacted);
+    pending = {};
+    B::rebuilt(*this);
+
+    std::fill(options.cache.begin(), options.cache.end(), CacheSlot{0, nullptr});
+    AVLMAP_STAT(counters.max_height = stats().height);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::veb_positions(
+    usize lo,
+    usize n,
+    usize levels,
+    usize& next,
+    std::vector<usize>& position
+  ) -> void {
+    if (n == 0 or levels == 0) {
+      return;
+    }
+
+    if (levels == 1) {
+      position[lo + n / 2] = next++;
+      return;
+    }
+
+    // the top half of the levels, then every subtree below it
+    const usize top = levels / 2;
+    veb_positions(lo, n, top, next, position);
+
+    auto bottom = [&](usize sub_lo, usize sub_n) {
+      veb_positions(sub_lo, sub_n, levels - top, next, position);
+    };
+    subtrees_below(lo, n, top, bottom);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Fn>
+  auto AVLmap<K, V, A, B, N, S, O>::subtrees_below(
+    usize lo,
+    usize n,
+    usize depth,
+    Fn& fn
+  ) -> void {
+    if (n == 0) {
+      return;
+    }
+
+    if (depth == 0) {
+      fn(lo, n);
+      return;
+    }
+
+    // shaped as build_balanced does, n / 2 nodes on the left
+    subtrees_below(lo, n / 2, depth - 1, fn);
+    subtrees_below(lo + n / 2 + 1, n - n / 2 - 1, depth - 1, fn);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::aggregate() const -> typename A::value_type {
+    static_assert(augmented, "aggregate needs an augment policy");
+    if (small()) {
+      return entries_aggregate(nullptr, nullptr);
+    }
+
+    return subtree_aggregate(root);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::aggregate(const K& lo, const K& hi) const ->
+    typename A::value_type {
+    static_assert(augmented, "aggregate needs an augment policy");
+    if (small()) {
+      return entries_aggregate(&lo, &hi);
+    }
+
+    return range_aggregate(root, &lo, &hi, true);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::digest() const -> u64 {
+    static_assert(
+      std::is_same<A, MerkleDigest>::value,
+      "digest needs the MerkleDigest augment"
+    );
+    if (small()) {
+      return entries_aggregate(nullptr, nullptr);
+    }
+
+    return subtree_aggregate(root);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Fn>
+  auto AVLmap<K, V, A, B, N, S, O>::diff(const AVLmap& a, const AVLmap& b, Fn fn)
+    -> void {
+    static_assert(
+      std::is_same<A, MerkleDigest>::value,
+      "diff needs the MerkleDigest augment"
+    );
+    // there are no digests to compare while either map is small
+    if (a.small() or b.small()) {
+      diff_entries(a, b, fn);
+      return;
+    }
+
+    a.diff_range(a.root, b, nullptr, nullptr, fn);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Fn>
+  auto AVLmap<K, V, A, B, N, S, O>::diff_entries(
+    const AVLmap& a,
+    const AVLmap& b,
+    Fn& fn
+  ) -> void {
+    const V* const none = nullptr;
+    const_iterator ia = a.begin();
+    const_iterator ib = b.begin();
+
+    // both maps in key order side by side, a small one has at most N keys
+    while (ia != a.end() or ib != b.end()) {
+      if (ib == b.end() or (ia != a.end() and ia->Key() < ib->Key())) {
+        fn(ia->Key(), &ia->Value(), none);
+        ++ia;
+      } else if (ia == a.end() or ib->Key() < ia->Key()) {
+        fn(ib->Key(), none, &ib->Value());
+        ++ib;
+      } else {
+        if (lift(*ia) != lift(*ib)) {
+          fn(ia->Key(), &ia->Value(), &ib->Value());
+        }
+        ++ia;
+        ++ib;
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::export_columns(
+    std::vector<K>& keys,
+    std::vector<V>& values
+  ) const -> void {
+    export_range(nullptr, nullptr, keys, values);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::export_columns(
+    const K& lo,
+    const K& hi,
+    std::vector<K>& keys,
+    std::vector<V>& values
+  ) const -> void {
+    export_range(&lo, &hi, keys, values);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::export_range(
+    const K* lo,
+    const K* hi,
+    std::vector<K>& keys,
+    std::vector<V>& values
+  ) const -> void {
+    keys.clear();
+    values.clear();
+
+    if (small()) {
+      for (usize i = lo ? entry_rank(*lo) : 0; i < count; i++) {
+        if (hi and *hi < entry(i)->key) {
+          break;
+        }
+        keys.push_back(entry(i)->key);
+        values.push_back(entry(i)->payload());
+      }
+      return;
+    }
+
+    const usize threads = copy_thread_count();
+    if (threads == 1 or count < PARALLEL_COPY_MIN) {
+      if (lo == nullptr) {
+        keys.reserve(count);
+        values.reserve(count);
+      }
+      export_subtree(root, lo, hi, keys, values);
+      return;
+    }
+
+    // the top levels in key order, each node alone or, at the bottom, with
+    // its subtree. Subtrees out of the range are left out
+    struct Piece {
+      const Node* node;
+      bool subtree;
+    };
+
+    usize levels = 1;
+    while ((usize{1} << levels) < threads * 4) {
+      levels++;
+    }
+
+    std::vector<Piece> pieces{};
+    auto split = [&](auto& self, const Node* node, usize level) -> void {
+      if (node == nullptr) {
+        return;
+      }
+      if (level == levels) {
+        pieces.push_back(Piece{node, true});
+        return;
+      }
+
+      const bool above_lo = lo == nullptr or not(node->key < *lo);
+      const bool below_hi = hi == nullptr or not(*hi < node->key);
+      if (above_lo) {
+        self(self, node->left, level + 1);
+      }
+      if (above_lo and below_hi) {
+        pieces.push_back(Piece{node, false});
+      }
+      if (below_hi) {
+        self(self, node->right, level + 1);
+      }
+    };
+    split(split, root, 0);
+
+    // the subtrees are exported by the threads into columns of their own,
+    // which are then appended in key order
+    std::vector<std::vector<K>> piece_keys(pieces.size());
+    std::vector<std::vector<V>> piece_values(pieces.size());
+    std::atomic<usize> claimed{0};
+
+    auto work = [&](usize) {
+      for (usize i = claimed++; i < pieces.size(); i = claimed++) {
+        if (pieces[i].subtree) {
+          export_subtree(pieces[i].node, lo, hi, piece_keys[i], piece_values[i]);
+        }
+      }
+    };
+    run_parallel(threads, work);
+
+    usize total = 0;
+    for (usize i = 0; i < pieces.size(); i++) {
+      total += pieces[i].subtree ? piece_keys[i].size() : 1;
+    }
+    keys.reserve(total);
+    values.reserve(total);
+
+    for (usize i = 0; i < pieces.size(); i++) {
+      if (pieces[i].subtree) {
+        keys.insert(keys.end(),
+                    std::make_move_iterator(piece_keys[i].begin()),
+                    std::make_move_iterator(piece_keys[i].end()));
+        values.insert(values.end(),
+                      std::make_move_iterator(piece_values[i].begin()),
+                      std::make_move_iterator(piece_values[i].end()));
+      } else {
+        keys.push_back(pieces[i].node->key);
+        values.push_back(pieces[i].node->payload());
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::export_subtree(
+    const Node* node,
+    const K* lo,
+    const K* hi,
+    std::vector<K>& keys,
+    std::vector<V>& values
+  ) -> void {
+    // the first entry not below lo
+    const Node* at = nullptr;
+    for (const Node* down = node; down;) {
+      if (lo and down->key < *lo) {
+        down = down->right;
+      } else {
+        at = down;
+        down = down->left;
+      }
+    }
+
+    while (at and not(hi and *hi < at->key)) {
+      keys.push_back(at->key);
+      values.push_back(at->payload());
+
+      if (at->right) {
+        at = at->right;
+        while (at->left) {
+          at = at->left;
+        }
+      } else {
+        // up past the ancestors whose right subtree this was
+        while (at != node and at->parent->right == at) {
+          at = at->parent;
+        }
+        at = at == node ? nullptr : at->parent;
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::lift(const KeyValue& entry) -> typename A::value_type {
+    return A::lift(entry.key, entry.payload());
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::recombine(Node* node) -> void {
+    if constexpr (augmented) {
+      typename A::value_type aggregate = lift(*node);
+      if (node->left) {
+        aggregate = A::combine(node->left->aggregate, aggregate);
+      }
+      if (node->right) {
+        aggregate = A::combine(aggregate, node->right->aggregate);
+      }
+      node->aggregate = std::move(aggregate);
+    }
+
+    static_cast<void>(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::recombine_path(Node* node) -> void {
+    if constexpr (augmented) {
+      for (; node; node = node->parent) {
+        recombine(node);
+      }
+    }
+
+    static_cast<void>(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::settle() -> void {
+    if constexpr (augmented) {
+      recombine_path(std::exchange(pending.node, nullptr));
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::lend(Node* node) -> Node* {
+    if constexpr (augmented) {
+      if (pending.node != node) {
+        settle();
+        pending.node = node;
+      }
+    }
+
+    return node;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::settle_copy(const AVLmap& rhs) -> void {
+    if constexpr (augmented) {
+      if (rhs.pending.node) {
+        recombine_path(index(root, rhs.pending.node->key));
+      }
+    }
+
+    static_cast<void>(rhs);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::written(const Node* node) const -> bool {
+    if constexpr (augmented) {
+      for (const Node* at = pending.node; at; at = at->parent) {
+        if (at == node) {
+          return true;
+        }
+      }
+    }
+
+    static_cast<void>(node);
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::subtree_aggregate(const Node* node) const ->
+    typename A::value_type {
+    if (node == nullptr) {
+      return A::identity();
+    }
+
+    // only the path above the pending write is recombined, one child each
+    if (written(node)) {
+      return A::combine(
+        A::combine(subtree_aggregate(node->left), lift(*node)),
+        subtree_aggregate(node->right)
+      );
+    }
+
+    return node->aggregate;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::range_aggregate(
+    const Node* node,
+    const K* lo,
+    const K* hi,
+    bool inclusive
+  ) const -> typename A::value_type {
+    auto below_lo = [&](const K& key) {
+      return lo and (inclusive ? key < *lo : not(*lo < key));
+    };
+    auto above_hi = [&](const K& key) {
+      return hi and (inclusive ? *hi < key : not(key < *hi));
+    };
+
+    // highest node inside the range, the range splits there
+    while (node) {
+      if (below_lo(node->key)) {
+        node = node->right;
+      } else if (above_hi(node->key)) {
+        node = node->left;
+      } else {
+        break;
+      }
+    }
+
+    if (node == nullptr) {
+      return A::identity();
+    }
+
+    // left of the split only lo bounds, the pieces found going down have
+    // smaller keys and go in front
+    typename A::value_type before = A::identity();
+    for (const Node* left = node->left; left;) {
+      if (below_lo(left->key)) {
+        left = left->right;
+      } else {
+        before = A::combine(
+          A::combine(lift(*left), subtree_aggregate(left->right)),
+          before
+        );
+        left = left->left;
+      }
+    }
+
+    typename A::value_type after = A::identity();
+    for (const Node* right = node->right; right;) {
+      if (above_hi(right->key)) {
+        right = right->left;
+      } else {
+        after = A::combine(
+          after,
+          A::combine(subtree_aggregate(right->left), lift(*right))
+        );
+        right = right->right;
+      }
+    }
+
+    return A::combine(A::combine(before, lift(*node)), after);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Fn>
+  auto AVLmap<K, V, A, B, N, S, O>::diff_range(
+    const Node* a_node,
+    const AVLmap& b,
+    const K* lo,
+    const K* hi,
+    Fn& fn
+  ) const -> void {
+    if (subtree_aggregate(a_node) == b.range_aggregate(b.root, lo, hi, false)) {
+      return;
+    }
+
+    if (a_node == nullptr) {
+      diff_missing(b.root, lo, hi, fn);
+      return;
+    }
+
+    diff_range(a_node->left, b, lo, &a_node->key, fn);
+
+    const Node* const match = b.index(b.root, a_node->key);
+
+    if (match == nullptr or not(match->key == a_node->key)) {
+      fn(a_node->key, &a_node->payload(), static_cast<const V*>(nullptr));
+    } else if (lift(*a_node) != lift(*match)) {
+      fn(a_node->key, &a_node->payload(), &match->payload());
+    }
+
+    diff_range(a_node->right, b, &a_node->key, hi, fn);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Fn>
+  auto AVLmap<K, V, A, B, N, S, O>::diff_missing(
+    Node* node,
+    const K* lo,
+    const K* hi,
+    Fn& fn
+  ) -> void {
+    if (node == nullptr) {
+      return;
+    }
+
+    const bool above_lo = not lo or *lo < node->key;
+    const bool below_hi = not hi or node->key < *hi;
+
+    if (above_lo) {
+      diff_missing(node->left, lo, hi, fn);
+    }
+    if (above_lo and below_hi) {
+      fn(node->key, static_cast<const V*>(nullptr), &node->payload());
+    }
+    if (below_hi) {
+      diff_missing(node->right, lo, hi, fn);
+    }
+  }
+
+
+#ifdef AVLMAP_LATENCY
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::latency() const -> const AVLmapLatency& {
+    return latencies;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::reset_latency() -> void {
+    latencies.reset();
+  }
+#endif
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::linked(Node* node) -> void {
+    keyed(node);
+    settle();
+    recombine_path(node);
+    const usize steps = B::linked(*this, node);
+    AVLMAP_PROBE(
+      retrace,
+      node,
+      steps,
+      AVLMAP_PROBE_ENABLED(retrace) ? probe_height(root) : 0
+    );
+
+    AVLMAP_STAT(counters.retraces++);
+    AVLMAP_STAT(counters.retrace_steps += steps);
+    AVLMAP_STAT(
+      counters.max_height = std::max(counters.max_height, getdepth(*node) + 1)
+    );
+
+    static_cast<void>(steps);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::accessed(Node* node) -> void {
+    const usize moved = B::accessed(*this, node);
+    AVLMAP_STAT(counters.restructured += moved);
+    static_cast<void>(moved);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::shares_prefix(const K& key) const -> bool {
+    if constexpr (windowed) {
+      return KeyTraits<K>::shared(key, shared.key, shared.length)
+          == shared.length;
+    }
+
+    static_cast<void>(key);
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::window_of(const K& key) const -> u64 {
+    if constexpr (windowed) {
+      return KeyTraits<K>::window(key, shared.length);
+    }
+
+    static_cast<void>(key);
+    return 0;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::keyed(Node* node) -> void {
+    if constexpr (windowed) {
+      // the only key shares all of itself
+      if (count == 1) {
+        shared.key = node->key;
+        shared.length = KeyTraits<K>::shared(
+          node->key,
+          node->key,
+          std::numeric_limits<usize>::max()
+        );
+      } else {
+        const usize length = KeyTraits<K>::shared(
+          node->key,
+          shared.key,
+          shared.length
+        );
+
+        // the prefix shortens at most once per byte, so do the rewindows
+        if (length < shared.length) {
+          shared.length = length;
+          rewindow();
+          return;
+        }
+      }
+
+      node->window = window_of(node->key);
+    }
+
+    static_cast<void>(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::rewindow() -> void {
+    if constexpr (windowed) {
+      for (Node* node = root ? root->first() : nullptr; node;
+           node = node->successor()) {
+        node->window = window_of(node->key);
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::small() const -> bool {
+    if constexpr (inline_entries) {
+      return root == nullptr;
+    }
+
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::entry(usize i) const -> KeyValue* {
+    if constexpr (inline_entries) {
+      return std::launder(reinterpret_cast<KeyValue*>(
+        const_cast<unsigned char*>(inlined.bytes) + i * sizeof(KeyValue)
+      ));
+    }
+
+    static_cast<void>(i);
+    return nullptr;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::entry_rank(const K& key) const -> usize {
+    usize i = 0;
+
+    // at most N keys side by side, a scan beats the branches of a search
+    while (i < count and entry(i)->key < key) {
+      AVLMAP_STAT(counters.comparisons++);
+      i++;
+    }
+
+    return i;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::emplace_entry(usize i, K key, Stored value)
+    -> KeyValue* {
+    if (i == count) {
+      count++;
+      return new (entry(i)) KeyValue{std::move(key), std::move(value)};
+    }
+
+    // the last entry moves into the free slot, the others one up behind it
+    new (entry(count)) KeyValue{std::move(*entry(count - 1))};
+    for (usize j = count - 1; j > i; j--) {
+      *entry(j) = std::move(*entry(j - 1));
+    }
+    count++;
+
+    entry(i)->key = std::move(key);
+    entry(i)->stored = std::move(value);
+    return entry(i);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::remove_entry(usize i) -> void {
+    for (usize j = i + 1; j < count; j++) {
+      *entry(j - 1) = std::move(*entry(j));
+    }
+
+    count--;
+    entry(count)->~KeyValue();
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::destroy_entries() -> void {
+    if (not small()) {
+      return;
+    }
+
+    for (usize i = 0; i < count; i++) {
+      if constexpr (slab_values) {
+        values.free(entry(i)->stored);
+      }
+      entry(i)->~KeyValue();
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::copy_entries(const AVLmap& rhs) -> void {
+    usize copied = 0;
+
+    try {
+      for (; copied < rhs.count; copied++) {
+        const KeyValue* const from = rhs.entry(copied);
+        new (entry(copied)) KeyValue{from->key, store(from->payload())};
+      }
+    } catch (...) {
+      for (usize i = 0; i < copied; i++) {
+        if constexpr (slab_values) {
+          values.free(entry(i)->stored);
+        }
+        entry(i)->~KeyValue();
+      }
+      throw;
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::take_entries(AVLmap& from) -> void {
+    if (not small()) {
+      return;
+    }
+
+    for (usize i = 0; i < count; i++) {
+      new (entry(i)) KeyValue{std::move(*from.entry(i))};
+      from.entry(i)->~KeyValue();
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::entries_aggregate(
+    const K* lo,
+    const K* hi
+  ) const -> typename A::value_type {
+    typename A::value_type aggregate = A::identity();
+
+    for (usize i = lo ? entry_rank(*lo) : 0; i < count; i++) {
+      if (hi and *hi < entry(i)->key) {
+        break;
+      }
+      aggregate = A::combine(aggregate, lift(*entry(i)));
+    }
+
+    return aggregate;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::node_of(Entry* entry) -> Node* {
+    return static_cast<Node*>(entry);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::store(V value) -> Stored {
+    if constexpr (slab_values) {
+      return values.make(std::move(value));
+    } else {
+      return value;
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::take_value(Node* node) -> void {
+    if constexpr (slab_values) {
+      V* const value = node->stored;
+      node->stored = values.make(std::move(*value));
+      delete value;
+    }
+
+    static_cast<void>(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::make_node(K key, Stored value, Node* parent)
+    -> Node* {
+    // slots erased from the compacted block before the heap
+    if constexpr (tunable) {
+      NodeBlock<Node>& block = options.block;
+
+      if (not block.spare.empty()) {
+        Node* const where = block.spare.back();
+        block.spare.pop_back();
+        block.live++;
+
+        return new (where) Node{
+          std::move(key),
+          std::move(value),
+          parent,
+          0,
+          0,
+          nullptr,
+          nullptr,
+        };
+      }
+    }
+
+    AVLMAP_STAT(counters.allocations++);
+    return new Node{
+      std::move(key),
+      std::move(value),
+      parent,
+      0,
+      0,
+      nullptr,
+      nullptr,
+    };
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::free_node(Node* node) -> void {
+    if constexpr (slab_values) {
+      values.free(node->stored);
+    }
+
+    release(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::free_handle(Node* node) -> void {
+    if constexpr (slab_values) {
+      if (node) {
+        delete node->stored;
+      }
+    }
+
+    delete node;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::release(Node* node) -> void {
+    if constexpr (tunable) {
+      NodeBlock<Node>& block = options.block;
+
+      if (in_block(node)) {
+        node->~Node();
+
+        if (--block.live == 0) {
+          std::allocator<Node>{}.deallocate(block.nodes, block.capacity);
+          block = NodeBlock<Node>{};
+        } else {
+          block.spare.push_back(node);
+        }
+        return;
+      }
+    }
+
+    AVLMAP_STAT(counters.frees++);
+    delete node;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::in_block(const Node* node) const -> bool {
+    if constexpr (tunable) {
+      // compared as integers, the node may be anywhere
+      const uptr address = reinterpret_cast<uptr>(node);
+      const uptr first = reinterpret_cast<uptr>(options.block.nodes);
+
+      return address - first < options.block.capacity * sizeof(Node);
+    }
+
+    static_cast<void>(node);
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::discard() -> void {
+    if constexpr (tunable) {
+      if (options.deferred_frees) {
+        clear_async();
+        return;
+      }
+    }
+
+    AVLMAP_PROBE(tree_free, count);
+    destroy_entries();
+    destroy(root);
+    root = nullptr;
+    count = 0;
+    pending = {};
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::destroy(Node* node) -> void {
+    // a left child is rotated up until there is none, then the node goes
+    // and its right subtree is next: O(n), every node is seen at most twice
+    while (node) {
+      if (Node* const left = node->left) {
+        node->left = left->right;
+        left->right = node;
+        node = left;
+      } else {
+        Node* const right = node->right;
+        free_node(node);
+        node = right;
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::clone(const Node* node, Node* parent) -> Node* {
+    auto copy_of = [this](const Node* from, Node* to_parent) -> Node* {
+      Node* const copy = make_node(from->key, store(from->payload()), to_parent);
+      copy->rank = from->rank;
+      copy->balance = from->balance;
+      if constexpr (windowed) {
+        copy->window = from->window;
+      }
+      if constexpr (augmented) {
+        copy->aggregate = from->aggregate;
+      }
+      return copy;
+    };
+
+    return clone(node, parent, copy_of);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Copy>
+  auto AVLmap<K, V, A, B, N, S, O>::clone(const Node* node, Node* parent, Copy& copy)
+    -> Node* {
+    if (node == nullptr) {
+      return nullptr;
+    }
+
+    Node* const top = copy(node, parent);
+
+    // the source and the copy are walked side by side, down into the first
+    // child not copied yet, back up the parent links once both are
+    const Node* from = node;
+    Node* to = top;
+
+    for (;;) {
+      if (from->left and to->left == nullptr) {
+        to->left = copy(from->left, to);
+        from = from->left;
+        to = to->left;
+      } else if (from->right and to->right == nullptr) {
+        to->right = copy(from->right, to);
+        from = from->right;
+        to = to->right;
+      } else if (from == node) {
+        return top;
+      } else {
+        from = from->parent;
+        to = to->parent;
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::recycle(const AVLmap& rhs) -> void {
+    std::vector<Node*> old{};
+    old.reserve(count);
+    for (Node* node = root; node;) {
+      old.push_back(node);
+      if (node->left) {
+        node = node->left;
+      } else if (node->right) {
+        node = node->right;
+      } else {
+        // up to the first ancestor with a right subtree not walked yet
+        Node* parent = node->parent;
+        while (parent and (parent->right == node or parent->right == nullptr)) {
+          node = parent;
+          parent = node->parent;
+        }
+        node = parent ? parent->right : nullptr;
+      }
+    }
+
+    // a node is only taken off the list once its key and value are in, so
+    // if one throws every node is either in the new tree or on the list
+    usize reused = 0;
+    auto copy_of = [&](const Node* from, Node* parent) -> Node* {
+      Node* copy = nullptr;
+      if (reused < old.size()) {
+        copy = old[reused];
+        copy->key = from->key;
+        copy->payload() = from->payload();
+        reused++;
+
+        copy->parent = parent;
+        copy->left = nullptr;
+        copy->right = nullptr;
+      } else {
+        copy = make_node(from->key, store(from->payload()), parent);
+      }
+
+      copy->rank = from->rank;
+      copy->balance = from->balance;
+      if constexpr (windowed) {
+        copy->window = from->window;
+      }
+      if constexpr (augmented) {
+        copy->aggregate = from->aggregate;
+      }
+      if (parent == nullptr) {
+        root = copy;
+      }
+      return copy;
+    };
+
+    root = nullptr;
+    count = 0;
+    try {
+      static_cast<void>(clone(rhs.root, nullptr, copy_of));
+    } catch (...) {
+      for (usize i = reused; i < old.size(); i++) {
+        free_node(old[i]);
+      }
+      clear();
+      throw;
+    }
+
+    for (usize i = reused; i < old.size(); i++) {
+      free_node(old[i]);
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::clone_tree(const AVLmap& rhs) -> Node* {
+    if (rhs.small()) {
+      copy_entries(rhs);
+      return nullptr;
+    }
+
+    if constexpr (tunable and not slab_values) {
+      const usize threads = rhs.copy_thread_count();
+
+      if (threads > 1 and rhs.count >= PARALLEL_COPY_MIN
+          and options.block.nodes == nullptr) {
+        return clone_parallel(rhs, threads);
+      }
+    }
+
+    return clone(rhs.root, nullptr);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::copy_thread_count() const -> usize {
+    if constexpr (tunable) {
+      if (options.copy_threads == 0) {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+      }
+      return options.copy_threads;
+    }
+
+    return 1;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  template<typename Work>
+  auto AVLmap<K, V, A, B, N, S, O>::run_parallel(usize threads, Work& work)
+    -> void {
+    TaskPool::instance().run(threads, std::ref(work));
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::clone_parallel(const AVLmap& rhs, usize threads)
+    -> Node* {
+    // a node of the top levels, or a subtree below them, and the index of
+    // the top its parent is
+    struct Part {
+      const Node* from;
+      usize parent;
+    };
+
+    // about 4 subtrees per thread, so one done early takes another
+    usize levels = 1;
+    while ((usize{1} << levels) < threads * 4) {
+      levels++;
+    }
+
+    std::vector<Part> tops{Part{rhs.root, 0}};
+    std::vector<Part> subtrees{};
+    for (usize level = 1, first = 0; level <= levels; level++) {
+      const usize last = tops.size();
+      for (usize i = first; i < last; i++) {
+        for (const Node* child : {tops[i].from->left, tops[i].from->right}) {
+          if (child) {
+            (level < levels ? tops : subtrees).push_back(Part{child, i});
+          }
+        }
+      }
+      first = last;
+    }
+
+    // the tops take the front of the block, each thread then carves its
+    // arena out of the rest a chunk at a time, so at most a chunk per
+    // thread is left over
+    const usize chunk = std::max<usize>(rhs.count / (threads * 64), 64);
+    const usize capacity = rhs.count + threads * chunk;
+    Node* const nodes = std::allocator<Node>{}.allocate(capacity);
+    std::atomic<usize> carved{tops.size()};
+    AVLMAP_STAT(counters.allocations++);
+
+    auto place = [](Node* where, const Node* from, Node* parent) -> Node* {
+      Node* const copy = new (where) Node{
+        from->key,
+        from->stored,
+        parent,
+        from->rank,
+        from->balance,
+        nullptr,
+        nullptr,
+      };
+      if constexpr (windowed) {
+        copy->window = from->window;
+      }
+      if constexpr (augmented) {
+        copy->aggregate = from->aggregate;
+      }
+      return copy;
+    };
+
+    // every copy is linked as soon as it is made, so the nodes built before
+    // a copy throws can be found from the root
+    auto link = [&](const Part& part, Node* copy) {
+      if (tops[part.parent].from->left == part.from) {
+        nodes[part.parent].left = copy;
+      } else {
+        nodes[part.parent].right = copy;
+      }
+    };
+
+    usize tops_built = 0;
+    auto unwind = [&]() {
+      Node* node = tops_built != 0 ? nodes : nullptr;
+      while (node) {
+        if (Node* const left = node->left) {
+          node->left = left->right;
+          left->right = node;
+          node = left;
+        } else {
+          Node* const right = node->right;
+          node->~Node();
+          node = right;
+        }
+      }
+      std::allocator<Node>{}.deallocate(nodes, capacity);
+    };
+
+    try {
+      for (; tops_built < tops.size(); tops_built++) {
+        const Part& top = tops[tops_built];
+        Node* const parent = tops_built == 0 ? nullptr : nodes + top.parent;
+        Node* const copy = place(nodes + tops_built, top.from, parent);
+        if (parent) {
+          link(top, copy);
+        }
+      }
+    } catch (...) {
+      unwind();
+      throw;
+    }
+
+    // the subtrees are claimed one at a time by the threads, the calling
+    // one included, and cloned in pre-order into the arena of the thread
+    std::atomic<usize> claimed{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::exception_ptr> errors(subtrees.size());
+    std::vector<std::pair<Node*, Node*>> leftover(threads, {nullptr, nullptr});
+
+    auto work = [&](usize thread) {
+      Node* next = nullptr;
+      Node* end = nullptr;
+
+      for (usize i = claimed++; i < subtrees.size() and not failed;
+           i = claimed++) {
+        const Part& subtree = subtrees[i];
+        auto copy = [&](const Node* from, Node* parent) -> Node* {
+          if (next == end) {
+            next = nodes + carved.fetch_add(chunk);
+            end = next + chunk;
+          }
+          Node* const node = place(next++, from, parent);
+          if (from == subtree.from) {
+            link(subtree, node);
+          }
+          return node;
+        };
+
+        try {
+          static_cast<void>(clone(subtree.from, nodes + subtree.parent, copy));
+        } catch (...) {
+          errors[i] = std::current_exception();
+          failed = true;
+        }
+      }
+
+      leftover[thread] = {next, end};
+    };
+
+    run_parallel(threads, work);
+
+    for (const std::exception_ptr& error : errors) {
+      if (error) {
+        unwind();
+        std::rethrow_exception(error);
+      }
+    }
+
+    // slots carved but not used go to the spares, the ones never carved
+    // too, later inserts fill them first
+    NodeBlock<Node>& block = options.block;
+    block = NodeBlock<Node>{nodes, capacity, rhs.count, {}};
+    block.spare.reserve(capacity - rhs.count);
+    for (const auto& [next, end] : leftover) {
+      for (Node* slot = next; slot != end; slot++) {
+        block.spare.push_back(slot);
+      }
+    }
+    for (usize i = carved; i < capacity; i++) {
+      block.spare.push_back(nodes + i);
+    }
+
+    return nodes;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::attach(Node* parent, Node* node) -> void {
+    node->parent = parent;
+    if (node->key < parent->key) {
+      parent->left = node;
+    } else {
+      parent->right = node;
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::promote() -> void {
+    if constexpr (inline_entries) {
+      usize next = 0;
+
+      // a node made for an entry takes its key and value, the slot goes
+      auto make = [&]() -> Node* {
+        KeyValue* const from = entry(next++);
+        Node* const node = make_node(
+          std::move(from->key),
+          std::move(from->stored),
+          nullptr
+        );
+        from->~KeyValue();
+        return node;
+      };
+
+      root = build_balanced(count, nullptr, make);
+      if constexpr (windowed) {
+        // in key order, the first and last keys share the least
+        shared.key = root->first()->key;
+        shared.length = KeyTraits<K>::shared(
+          shared.key,
+          root->last()->key,
+          std::numeric_limits<usize>::max()
+        );
+        rewindow();
+      }
+      B::rebuilt(*this);
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::cache_lookups(usize slots) -> void {
+    static_assert(tunable, "cache_lookups needs the RuntimeOptions policy");
+    static_assert(hashable, "The hot key cache needs std::hash of the key");
+
+    std::vector<CacheSlot>& cache = options.cache;
+    usize size = slots ? 1 : 0;
+    while (size < slots) {
+      size <<= 1;
+    }
+
+    cache.assign(size, CacheSlot{0, nullptr});
+    cache.shrink_to_fit();
+
+    // inline entries are found without it
+    if (size == 0 or small()) {
+      return;
+    }
+
+    // start warm with what is already there, in key order so the last of
+    // colliding keys wins like it would at run time
+    for (iterator it = begin(); it != end(); ++it) {
+      const u64 hash = hash_key(it.node->key);
+      cache[hash & (size - 1)] = CacheSlot{hash, node_of(it.node)};
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::filter_lookups(usize expected_keys) -> void {
+    static_assert(tunable, "filter_lookups needs the RuntimeOptions policy");
+    static_assert(hashable, "The key filter needs std::hash of the key");
+
+    if (expected_keys == 0) {
+      options.filter = CountingBloomFilter{};
+      return;
+    }
+
+    refilter(std::max(expected_keys, count));
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::filtering() const -> bool {
+    if constexpr (tunable) {
+      return options.filter.capacity() != 0;
+    }
+
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::hash_of(const K& key) const -> u64 {
+    if constexpr (tunable and hashable) {
+      if (not options.cache.empty() or filtering()) {
+        return hash_key(key);
+      }
+    }
+
+    static_cast<void>(key);
+    return 0;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::filtered_out(u64 hash) const -> bool {
+    if constexpr (tunable) {
+      if (filtering() and not options.filter.may_contain(hash)) {
+        AVLMAP_STAT(counters.filter_rejects++);
+        return true;
+      }
+    }
+
+    static_cast<void>(hash);
+    return false;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::cached(const K& key, u64 hash) const -> Node* {
+    if constexpr (tunable) {
+      const std::vector<CacheSlot>& cache = options.cache;
+      if (cache.empty()) {
+        return nullptr;
+      }
+
+      const CacheSlot& slot = cache[hash & (cache.size() - 1)];
+
+      // the full hash settles most collisions without touching the node
+      if (slot.node and slot.hash == hash and slot.node->key == key) {
+        AVLMAP_STAT(counters.cache_hits++);
+        return slot.node;
+      }
+    }
+
+    static_cast<void>(key);
+    static_cast<void>(hash);
+    return nullptr;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::remember(Node* node, u64 hash) -> void {
+    if constexpr (tunable) {
+      std::vector<CacheSlot>& cache = options.cache;
+      if (not cache.empty()) {
+        cache[hash & (cache.size() - 1)] = CacheSlot{hash, node};
+      }
+    }
+
+    static_cast<void>(node);
+    static_cast<void>(hash);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::added(Node* node, u64 hash) -> void {
+    remember(node, hash);
+
+    if constexpr (tunable) {
+      if (not filtering()) {
+        return;
+      }
+
+      if (count > options.filter.capacity()) {
+        refilter(2 * count);
+      } else {
+        options.filter.add(hash);
+      }
+    }
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::forget(const Node* node, u64 hash) -> void {
+    if constexpr (tunable) {
+      std::vector<CacheSlot>& cache = options.cache;
+      if (not cache.empty()) {
+        CacheSlot& slot = cache[hash & (cache.size() - 1)];
+        if (slot.node == node) {
+          slot = CacheSlot{0, nullptr};
+        }
+      }
+
+      options.filter.remove(hash);
+    }
+
+    static_cast<void>(node);
+    static_cast<void>(hash);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::refilter(usize expected_keys) -> void {
+    if constexpr (tunable and hashable) {
+      options.filter = CountingBloomFilter{expected_keys};
+      for (iterator it = begin(); it != end(); ++it) {
+        options.filter.add(hash_key(it.node->key));
+      }
+    }
+
+    static_cast<void>(expected_keys);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::rotate_left(Node* node) -> Node* {
+    AVLMAP_STAT(counters.single_rotations++);
+    return pivot_left(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::rotate_right(Node* node) -> Node* {
+    AVLMAP_STAT(counters.single_rotations++);
+    return pivot_right(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::rotate_left_right(Node* node) -> Node* {
+    AVLMAP_STAT(counters.double_rotations++);
+    pivot_left(node->left);
+    return pivot_right(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::rotate_right_left(Node* node) -> Node* {
+    AVLMAP_STAT(counters.double_rotations++);
+    pivot_right(node->right);
+    return pivot_left(node);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::pivot_left(Node* node) -> Node* {
+    Node*& tree = node_ref(*node);
+    Node* const temp = tree;
+    tree = tree->right;
+    temp->right = tree->left;
+    tree->left = temp;
+
+    tree->parent = temp->parent;
+    temp->parent = tree;
+    if (temp->right) {
+      temp->right->parent = temp;
+    }
+    AVLMAP_PROBE(
+      rotate_left,
+      tree,
+      AVLMAP_PROBE_ENABLED(rotate_left) ? getdepth(*tree) : 0,
+      AVLMAP_PROBE_ENABLED(rotate_left) ? probe_height(tree) : 0
+    );
+
+    // both subtrees changed, the ones above keep their entries
+    recombine(temp);
+    recombine(tree);
+
+    return tree;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::pivot_right(Node* node) -> Node* {
+    Node*& tree = node_ref(*node);
+    Node* const temp = tree;
+    tree = tree->left;
+    temp->left = tree->right;
+    tree->right = temp;
+
+    tree->parent = temp->parent;
+    temp->parent = tree;
+    if (temp->left) {
+      temp->left->parent = temp;
+    }
+    AVLMAP_PROBE(
+      rotate_right,
+      tree,
+      AVLMAP_PROBE_ENABLED(rotate_right) ? getdepth(*tree) : 0,
+      AVLMAP_PROBE_ENABLED(rotate_right) ? probe_height(tree) : 0
+    );
+
+    // both subtrees changed, the ones above keep their entries
+    recombine(temp);
+    recombine(tree);
+
+    return tree;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::subtree_height(const Node* node) -> usize {
+    if (node == nullptr) {
+      return 0;
+    }
+
+    return 1 + std::max(subtree_height(node->left), subtree_height(node->right));
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::probe_height(const Node* node) const -> usize {
+    if (node == nullptr) {
+      return 0;
+    }
+
+    // only the ranks of AVLBalance are heights
+    if (not std::is_same<B, AVLBalance>::value) {
+      return subtree_height(node);
+    }
+
+    // in a rotation the ranks of node and of the child it took over are not
+    // updated yet, the ones below them are
+    auto below = [](const Node* child) -> usize {
+      if (child == nullptr) {
+        return 0;
+      }
+      const usize left = child->left ? child->left->rank : 0;
+      const usize right = child->right ? child->right->rank : 0;
+      return 1 + std::max(left, right);
+    };
+
+    return 1 + std::max(below(node->left), below(node->right));
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  [[nodiscard]] auto AVLmap<K, V, A, B, N, S, O>::node_ref(Node& node) -> Node*& {
+    Node* parent = node.parent;
+
+    if (parent == nullptr) {
+      return root;
+    }
+
+    return (parent->left == &node) ? parent->left : parent->right;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::AVLmap(const AVLmap& rhs):
+      root{nullptr},
+      count{0},
+      shared{rhs.shared} {
+    AVLMAP_PROBE(clone_begin, rhs.count);
+    if constexpr (tunable) {
+      // the copy starts with its own empty cache of the same size
+      options.cache.assign(rhs.options.cache.size(), CacheSlot{0, nullptr});
+      options.filter = rhs.options.filter;
+      options.deferred_frees = rhs.options.deferred_frees;
+      options.copy_threads = rhs.options.copy_threads;
+    }
+    root = clone_tree(rhs);
+    count = rhs.count;
+    settle_copy(rhs);
+    AVLMAP_PROBE(clone_end, count);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::AVLmap(AVLmap&& from):
+      root{std::exchange(from.root, nullptr)},
+      count{std::exchange(from.count, 0)},
+      shared{std::move(from.shared)},
+      pending{std::exchange(from.pending, {})},
+      values{std::move(from.values)} {
+    take_options(from);
+    settle();
+    take_entries(from);
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  AVLmap<K, V, A, B, N, S, O>::~AVLmap() {
+    discard();
+  }
+
+  template<typename T>
+  auto SumOf<T>::identity() -> T {
+    return T{};
+  }
+
+  template<typename T>
+  template<typename K>
+  auto SumOf<T>::lift(const K&, const T& value) -> T {
+    return value;
+  }
+
+  template<typename T>
+  auto SumOf<T>::combine(const T& a, const T& b) -> T {
+    return a + b;
+  }
+
+  template<typename T>
+  auto MinOf<T>::identity() -> T {
+    return std::numeric_limits<T>::max();
+  }
+
+  template<typename T>
+  template<typename K>
+  auto MinOf<T>::lift(const K&, const T& value) -> T {
+    return value;
+  }
+
+  template<typename T>
+  auto MinOf<T>::combine(const T& a, const T& b) -> T {
+    return b < a ? b : a;
+  }
+
+  template<typename T>
+  auto MaxOf<T>::identity() -> T {
+    return std::numeric_limits<T>::lowest();
+  }
+
+  template<typename T>
+  template<typename K>
+  auto MaxOf<T>::lift(const K&, const T& value) -> T {
+    return value;
+  }
+
+  template<typename T>
+  auto MaxOf<T>::combine(const T& a, const T& b) -> T {
+    return a < b ? b : a;
+  }
+
+  inline auto MerkleDigest::identity() -> u64 {
+    return 0;
   }
 
-  ////////////////////////////////////////////////////////////
-  // do not change this code from here to the end of the file
-  /* figure out whether node is left or right child or root
-   * used in print_backwards_padded
-   */
   template<typename K, typename V>
-  auto AVLmap<K, V>::getedgesymbol(const Node* node) const -> char {
+  auto MerkleDigest::lift(const K& key, const V& value) -> u64 {
+    return mix_hash(hash_key(key) ^ static_cast<u64>(std::hash<V>{}(value)));
+  }
+
+  inline auto MerkleDigest::combine(u64 a, u64 b) -> u64 {
+    return a + b;
+  }
+
+  inline auto mix_hash(u64 hash) -> u64 {
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBull;
+    hash ^= hash >> 31;
+    return hash;
+  }
+
+  template<typename K>
+  auto hash_key(const K& key) -> u64 {
+    return mix_hash(static_cast<u64>(std::hash<K>{}(key)));
+  }
+
+  inline auto KeyTraits<std::string>::window(
+    const std::string& key,
+    usize offset
+  ) -> u64 {
+    unsigned char bytes[8]{};
+
+    if (offset < key.size()) {
+      std::memcpy(
+        bytes,
+        key.data() + offset,
+        std::min<usize>(key.size() - offset, 8)
+      );
+    }
+
+    // big endian, so integer order is byte order
+    u64 window = 0;
+    for (const unsigned char byte : bytes) {
+      window = window << 8 | byte;
+    }
+
+    return window;
+  }
+
+  inline auto KeyTraits<std::string>::shared(
+    const std::string& a,
+    const std::string& b,
+    usize limit
+  ) -> usize {
+    const usize length = std::min({a.size(), b.size(), limit});
+    return static_cast<usize>(
+      std::mismatch(a.data(), a.data() + length, b.data()).first - a.data()
+    );
+  }
+
+  inline StatCounter::StatCounter(u64 start): value{start} {}
+
+  inline StatCounter::StatCounter(const StatCounter& other):
+      value{static_cast<u64>(other)} {}
+
+  inline auto StatCounter::operator=(const StatCounter& other)
+    -> StatCounter& {
+    value.store(static_cast<u64>(other), std::memory_order_relaxed);
+    return *this;
+  }
+
+  inline auto StatCounter::operator+=(u64 amount) -> StatCounter& {
+    value.store(
+      value.load(std::memory_order_relaxed) + amount,
+      std::memory_order_relaxed
+    );
+    return *this;
+  }
+
+  inline auto StatCounter::operator++(int) -> StatCounter {
+    const u64 old = value.load(std::memory_order_relaxed);
+    value.store(old + 1, std::memory_order_relaxed);
+    return StatCounter{old};
+  }
+
+  inline StatCounter::operator u64() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+  template<typename Count>
+  template<typename Other>
+  AVLmapCounts<Count>::AVLmapCounts(const AVLmapCounts<Other>& other):
+      comparisons{other.comparisons},
+      lookups{other.lookups},
+      nodes_visited{other.nodes_visited},
+      single_rotations{other.single_rotations},
+      double_rotations{other.double_rotations},
+      allocations{other.allocations},
+      frees{other.frees},
+      retraces{other.retraces},
+      retrace_steps{other.retrace_steps},
+      cache_hits{other.cache_hits},
+      filter_rejects{other.filter_rejects},
+      filter_false_positives{other.filter_false_positives},
+      restructured{other.restructured},
+      height{other.height},
+      max_height{other.max_height} {}
+
+  inline auto operator<<(std::ostream& os, const AVLmapStats& stats)
+    -> std::ostream& {
+    const f64 lookups = stats.lookups ? stats.lookups : 1;
+    const f64 retraces = stats.retraces ? stats.retraces : 1;
+
+    os << "lookups " << stats.lookups;
+    os << ", visited/lookup " << stats.nodes_visited / lookups;
+    os << ", comparisons " << stats.comparisons;
+    os << ", rotations " << stats.single_rotations;
+    os << " single " << stats.double_rotations << " double";
+    os << ", allocations " << stats.allocations;
+    os << ", frees " << stats.frees;
+    os << ", steps/retrace " << stats.retrace_steps / retraces;
+    os << ", restructured " << stats.restructured;
+    os << ", cache hits " << stats.cache_hits;
+    os << ", filter rejects " << stats.filter_rejects;
+    os << " (" << stats.filter_false_positives << " false positives)";
+    os << ", height " << stats.height << " (max " << stats.max_height << ")";
+
+    return os;
+  }
+
+  inline auto operator<<(std::ostream& os, const AVLmapMemory& memory)
+    -> std::ostream& {
+    const f64 entries = memory.entries ? memory.entries : 1;
+
+    os << "entries " << memory.entries;
+    os << ", total " << memory.total << " B";
+    os << " (" << memory.total / entries << " B/entry)";
+    os << ", payload " << memory.payload / entries;
+    os << ", links " << memory.links / entries;
+    os << ", metadata " << memory.metadata / entries;
+    os << ", allocator " << memory.allocator / entries << " B/entry";
+
+    return os;
+  }
+
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::begin() -> iterator {
+    if constexpr (inline_entries) {
+      if (small()) {
+        return count ? iterator{entry(0), entry(count)} : end();
+      }
+    }
+
+    return root ? iterator{root->first()} : end();
+  }
+
+  ////////////////////////////////////////////////////////////
+  // do not change this code from here to the end of the file
+  /* figure out whether node is left or right child or root
+   * used in print_backwards_padded
+   */
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::getedgesymbol(const Node* node) const -> char {
     const Node* parent = node->parent;
 
     if (parent == nullptr) {
@@ -601,16 +3076,25 @@ namespace CS280 {
    * iterative function.
    * Left branch of the tree is at the bottom
    */
-  template<typename K, typename V>
-  auto operator<<(std::ostream& os, const AVLmap<K, V>& map) -> std::ostream& {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto operator<<(std::ostream& os, const AVLmap<K, V, A, B, N, S, O>& map) -> std::ostream& {
     map.print(os);
     return os;
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::print(std::ostream& os, bool print_value) const -> void {
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::print(std::ostream& os, bool print_value) const -> void {
+    // a small map prints as it is kept, in a row, the last key on top
+    for (usize i = small() ? count : 0; i > 0; i--) {
+      os << entry(i - 1)->key;
+      if (print_value) {
+        os << " -> " << entry(i - 1)->payload();
+      }
+      os << std::endl;
+    }
+
     if (root) {
-      AVLmap<K, V>::Node* b = root->last();
+      AVLmap<K, V, A, B, N, S, O>::Node* b = root->last();
       while (b) {
         int depth = getdepth(*b);
         int i;
@@ -624,7 +3108,7 @@ namespace CS280 {
             }
             os << b->key;
             if (print_value) {
-              os << " -> " << b->value;
+              os << " -> " << b->payload();
             }
             os << std::endl;
             break;
@@ -638,7 +3122,7 @@ namespace CS280 {
             }
             os << b->key;
             if (print_value) {
-              os << " -> " << b->value;
+              os << " -> " << b->payload();
             }
             os << std::endl;
             break;
@@ -648,7 +3132,7 @@ namespace CS280 {
             }
             os << b->key;
             if (print_value) {
-              os << " -> " << b->value;
+              os << " -> " << b->payload();
             }
             os << std::endl;
             for (i = 0; i < depth; ++i) {
@@ -663,9 +3147,15 @@ namespace CS280 {
     std::printf("\n");
   }
 
-  template<typename K, typename V>
-  auto AVLmap<K, V>::getdepth(const Node& node) const -> usize {
-    return root->height - node.height;
+  template<typename K, typename V, typename A, typename B, usize N, typename S, typename O>
+  auto AVLmap<K, V, A, B, N, S, O>::getdepth(const Node& node) const -> usize {
+    usize depth = 0;
+
+    for (const Node* up = node.parent; up; up = up->parent) {
+      depth++;
+    }
+
+    return depth;
   }
 } // namespace CS280
 
@@ -3,461 +3,1970 @@
 #ifndef AVLMAP_H
 #define AVLMAP_H
 
-/**
- * @brief 32 Bit Floating Point Number
- */
-#include <cstdint>
-using f32 = float;
+#include "int-types.h"
 
-/**
- * @brief 64 Bit Floating Point Number
- */
-using f64 = long double;
+#include <atomic>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "balance-policy.h"
+#include "bloom-filter.h"
+#include "deferred-free.h"
+#include "task-pool.h"
+#include "value-slab.h"
+
+#ifdef AVLMAP_LATENCY
+#include "latency-histogram.h"
+#endif
 
 /**
- * @brief Fix Sized Unsigned 8 Bit Integer (cannot be negative)
+ * @brief Compiles its argument only when structural counters are enabled
+ * (define AVLMAP_STATS), otherwise the instrumentation costs nothing
  */
-using u8 = std::uint8_t;
+#ifdef AVLMAP_STATS
+#define AVLMAP_STAT(...) __VA_ARGS__
+#else
+#define AVLMAP_STAT(...)
+#endif
 
 /**
- * @brief Fix Sized Unsigned 16 Bit Integer (cannot be negative)
+ * @brief Times the rest of the enclosing scope into the given histogram of
+ * the map and of the calling thread when latency recording is enabled
+ * (define AVLMAP_LATENCY), otherwise it costs nothing
  */
-using u16 = std::uint16_t;
+#ifdef AVLMAP_LATENCY
+#define AVLMAP_TIME(operation)                                                 \
+  LatencyTimer latency_timer {                                                 \
+    latencies.operation, thread_latency().operation                            \
+  }
+#else
+#define AVLMAP_TIME(operation)
+#endif
 
 /**
- * @brief Fix Sized Unsigned 32 Bit Integer (cannot be negative)
+ * @brief AVLMAP_TIME for const members, which may run on several threads at
+ * once: only the histogram of the calling thread records
  */
-using u32 = std::uint32_t;
+#ifdef AVLMAP_LATENCY
+#define AVLMAP_TIME_CONST(operation)                                           \
+  LatencyTimer latency_timer { thread_latency().operation }
+#else
+#define AVLMAP_TIME_CONST(operation)
+#endif
 
 /**
- * @brief Fix Sized Unsigned 64 Bit Integer (cannot be negative)
+ * @brief Static tracepoint (USDT, provider "avlmap") for perf / bpftrace when
+ * AVLMAP_USDT is defined, a probe is a single nop in the instruction stream
+ * until a tracer attaches. Compiled out otherwise. Arguments that cost more
+ * than a load are computed only under AVLMAP_PROBE_ENABLED(name), which
+ * reads the probe's semaphore, nonzero while a tracer is attached
  */
-using u64 = unsigned long int;
+#ifdef AVLMAP_USDT
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define AVLMAP_PROBE(...) STAP_PROBEV(avlmap, __VA_ARGS__)
+#define AVLMAP_PROBE_ENABLED(name)                                             \
+  __builtin_expect(avlmap_##name##_semaphore != 0, 0)
+#define AVLMAP_SEMAPHORE(name)                                                 \
+  extern "C" {                                                                 \
+    inline volatile unsigned short avlmap_##name##_semaphore                   \
+      __attribute__((section(".probes"))){0};                                  \
+  }
+AVLMAP_SEMAPHORE(clone_begin)
+AVLMAP_SEMAPHORE(clone_end)
+AVLMAP_SEMAPHORE(node_alloc)
+AVLMAP_SEMAPHORE(node_free)
+AVLMAP_SEMAPHORE(retrace)
+AVLMAP_SEMAPHORE(rotate_left)
+AVLMAP_SEMAPHORE(rotate_right)
+AVLMAP_SEMAPHORE(tree_free)
+#undef AVLMAP_SEMAPHORE
+#else
+#error "AVLMAP_USDT needs <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel)"
+#endif
+#else
+#define AVLMAP_PROBE(...)
+#define AVLMAP_PROBE_ENABLED(name) false
+#endif
 
-/**
- * @brief Biggest Unsigned Integer type that the current platform can use
- * (cannot be negative)
- */
-using umax = std::uintmax_t;
+namespace CS280 {
 
-/**
- * @brief Unsigned Integer for when referring to any form of memory size or
- * offset (eg. an array length or index)
- */
-using usize = std::size_t;
-/**
- * @brief Unsigned Integer Pointer typically used for pointer arithmetic
- */
-using uptr = std::uintptr_t;
+  /**
+   * @brief Mixes the bits of a hash (splitmix64 finalizer), std::hash is the
+   * identity for integers which would leave most filter bits unused
+   */
+  [[nodiscard]] inline auto mix_hash(u64 hash) -> u64;
 
-/**
- * @brief Signed 8 bit Integer
- */
-using i8 = std::int8_t;
+  /**
+   * @brief Hashes a key for filters and caches
+   */
+  template<typename K>
+  [[nodiscard]] auto hash_key(const K& key) -> u64;
 
-/**
- * @brief Signed 16 bit Integer
- */
-using i16 = std::int16_t;
+  /**
+   * @brief Key traits of an AVLmap, by default keys are only compared with ==
+   * and <. A specialization with prefixed = true and
+   *   static window(key, offset) -> u64     the 8 bytes of the key from
+   *                                         offset, big endian and zero
+   *                                         padded past its end
+   *   static shared(a, b, limit) -> usize   length of the common prefix of
+   *                                         two keys, at most limit
+   * lets every node keep the window of its key just past the prefix all
+   * keys of the map share, a search then decides most steps with one
+   * integer compare. Windows must order keys like < does whenever they
+   * differ (bytewise unsigned order, as for std::string)
+   */
+  template<typename K>
+  struct KeyTraits {
+    static constexpr bool prefixed = false;
+  };
 
-/**
- * @brief Signed 32 bit Integer
- */
-using i32 = std::int32_t;
+  template<>
+  struct KeyTraits<std::string> {
+    static constexpr bool prefixed = true;
 
-/**
- * @brief Signed 64 bit Integer
- */
-using i64 = std::int64_t;
+    [[nodiscard]] static inline auto window(
+      const std::string& key,
+      usize offset
+    ) -> u64;
 
-/**
- * @brief Integer pointer typically used for pointer arithmetic
- */
-using iptr = std::intptr_t;
+    [[nodiscard]] static inline auto shared(
+      const std::string& a,
+      const std::string& b,
+      usize limit
+    ) -> usize;
+  };
 
-#include <cstddef>
-#include <ostream>
+  /**
+   * @brief Counter an AVLmap bumps in const searches too, which may run on
+   * several threads at once: a relaxed atomic increased with a plain load
+   * and store, so there is no data race and no locked instruction. Searches
+   * racing on one map may lose a count, a single thread counts exactly
+   */
+  class StatCounter {
+  public:
 
-namespace CS280 {
+    /**
+     * @brief Counter starting at the given value
+     */
+    StatCounter(u64 start = 0);
+
+    /**
+     * @brief Copy constructor
+     */
+    StatCounter(const StatCounter& other);
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const StatCounter& other) -> StatCounter&;
+
+    /**
+     * @brief Adds to the counter
+     */
+    auto operator+=(u64 amount) -> StatCounter&;
+
+    /**
+     * @brief Adds one, returns the old value
+     */
+    auto operator++(int) -> StatCounter;
+
+    /**
+     * @brief The current value
+     */
+    operator u64() const;
+
+  private:
+
+    std::atomic<u64> value;
+  };
 
   /**
-   * @brief Binary Search Tree
-   *
-   * @tparam K Key
-   * @tparam V Value
+   * @brief Structural operation counters of an AVLmap (see AVLmap::stats),
+   * the counters stay 0 unless AVLMAP_STATS is defined. The map keeps them
+   * as StatCounters, stats() hands out a copy as plain integers
    */
-  template<typename K, typename V>
-  class AVLmap {
+  template<typename Count>
+  struct AVLmapCounts {
+    /**
+     * @brief All zero
+     */
+    AVLmapCounts() = default;
 
-  public:
+    /**
+     * @brief Copy of counters kept as another type
+     */
+    template<typename Other>
+    explicit AVLmapCounts(const AVLmapCounts<Other>& other);
 
-    class iterator;
-    class const_iterator;
+    /**
+     * @brief Key comparisons (== and <) made while searching, not counting
+     * the integer compares of key windows (see KeyTraits)
+     */
+    Count comparisons{0};
 
     /**
-     * @class Node
-     * @brief BST Node
+     * @brief Searches from the root (find, operator[], insert)
      */
-    class Node {
-    public:
+    Count lookups{0};
 
-      /**
-       * @brief Normal constructor
-       */
-      Node(K k, V val, Node* p, usize h, i32 b, Node* l, Node* r);
+    /**
+     * @brief Nodes visited by all searches
+     */
+    Count nodes_visited{0};
 
-      /**
-       * @brief Copy constructor
-       */
-      Node(const Node&) = delete;
+    /**
+     * @brief Single rotations
+     */
+    Count single_rotations{0};
 
-      /**
-       * @brief Destructor
-       */
-      ~Node();
+    /**
+     * @brief Double rotations (counted once, not as two singles)
+     */
+    Count double_rotations{0};
 
-      /**
-       * @brief Copy assignment
-       */
-      auto operator=(const Node&) -> Node& = delete;
+    /**
+     * @brief Nodes allocated
+     */
+    Count allocations{0};
 
-      /**
-       * @brief  Move constructor
-       */
-      Node(Node&&);
+    /**
+     * @brief Nodes freed
+     */
+    Count frees{0};
 
-      /**
-       * @brief move assignment
-       */
-      auto operator=(Node&& from) -> Node&;
+    /**
+     * @brief Rebalancing passes after an insert or erase
+     */
+    Count retraces{0};
 
-      /**
-       * @brief Gets the key stored
-       */
-      [[nodiscard]] auto Key() const -> const K&;
+    /**
+     * @brief Nodes looked at by all rebalancing passes
+     */
+    Count retrace_steps{0};
 
-      /**
-       * @brief Gets the value stored
-       */
-      [[nodiscard]] auto Value() -> V&;
+    /**
+     * @brief Finds and operator[] answered by the hot key cache (see
+     * AVLmap::cache_lookups)
+     */
+    Count cache_hits{0};
 
-      /**
-       * @brief Gets the leftmost node
-       */
-      [[nodiscard]] auto first() -> Node*;
+    /**
+     * @brief Finds of a missing key answered by the key filter (see
+     * AVLmap::filter_lookups)
+     */
+    Count filter_rejects{0};
 
-      /**
-       * @brief Gets the rightmost node
-       */
-      [[nodiscard]] auto last() -> Node*;
+    /**
+     * @brief Finds of a missing key the key filter let through
+     */
+    Count filter_false_positives{0};
 
-      /**
-       * @brief Gets the successor node
-       */
-      [[nodiscard]] auto successor() -> Node*;
+    /**
+     * @brief Nodes relinked to move hot keys up (AdaptiveBalance)
+     */
+    Count restructured{0};
 
-      /**
-       * @brief Gets the predecessor Node
-       */
-      [[nodiscard]] auto decrement() -> Node*;
+    /**
+     * @brief Current height of the tree in levels (0 when empty, or while
+     * the entries are inline, see N)
+     */
+    usize height{0};
 
-      /**
-       * @brief Prints to stream
-       */
-      auto print(std::ostream& os) const -> void;
+    /**
+     * @brief Deepest level a node was linked at since the last reset
+     */
+    usize max_height{0};
+  };
 
-    private:
+  /**
+   * @brief Counters as stats() hands them out
+   */
+  using AVLmapStats = AVLmapCounts<u64>;
 
-      /**
-       * @brief Clones a new node on the heap
-       */
-      [[nodiscard]] auto clone() const -> Node*;
+  /**
+   * @brief Prints a one line summary of the counters
+   */
+  inline auto operator<<(std::ostream& os, const AVLmapStats& stats)
+    -> std::ostream&;
 
-      /**
-       * @brief Creates & adds a child with the given key and value
-       */
-      [[nodiscard]] auto add_child(K key, V value) -> Node&;
+  /**
+   * @brief Memory held by an AVLmap (see AVLmap::memory_usage), in bytes.
+   * Only the node itself is counted, memory a key or value owns elsewhere
+   * (eg. the buffer of a long std::string) is not
+   */
+  struct AVLmapMemory {
+    /**
+     * @brief Number of entries
+     */
+    usize entries;
 
-      /**
-       * @brief Recomputes the height and balance (recurses up)
-       */
-      auto refresh_balance_and_height() -> void;
+    /**
+     * @brief Keys and values stored in the nodes
+     */
+    usize payload;
+
+    /**
+     * @brief Parent, left and right pointers
+     */
+    usize links;
+
+    /**
+     * @brief Height, balance and padding inside the nodes
+     */
+    usize metadata;
+
+    /**
+     * @brief Estimated allocator headers and size class rounding, modelled on
+     * glibc malloc (8 byte header, 16 byte granularity, 32 byte minimum)
+     */
+    usize allocator;
+
+    /**
+     * @brief The map object itself, its hot key cache, its key filter and
+     * the unused part of its value slab
+     */
+    usize container;
+
+    /**
+     * @brief Sum of all of the above
+     */
+    usize total;
+  };
+
+  /**
+   * @brief Prints a one line breakdown, with bytes per entry
+   */
+  inline auto operator<<(std::ostream& os, const AVLmapMemory& memory)
+    -> std::ostream&;
+
+  /**
+   * @brief Header of a binary snapshot written by AVLmap::save, the key array
+   * starts at key_offset and the value array at value_offset (both from the
+   * start of the file)
+   */
+  struct SnapshotHeader {
+    /**
+     * @brief Identifies the file format, also detects a byte order mismatch
+     */
+    u32 magic;
+
+    /**
+     * @brief Format version
+     */
+    u32 version;
+
+    /**
+     * @brief sizeof the key type the snapshot was written with
+     */
+    u32 key_size;
+
+    /**
+     * @brief sizeof the value type the snapshot was written with
+     */
+    u32 value_size;
+
+    /**
+     * @brief Number of entries
+     */
+    u64 count;
+
+    /**
+     * @brief Offset of the key array
+     */
+    u64 key_offset;
+
+    /**
+     * @brief Offset of the value array
+     */
+    u64 value_offset;
+
+    /**
+     * @brief "AVLM" read as a little endian integer
+     */
+    static constexpr u32 MAGIC = 0x4D4C5641;
+
+    /**
+     * @brief Current format version
+     */
+    static constexpr u32 VERSION = 1;
+  };
+
+  /**
+   * @brief Augment policy of an AVLmap that keeps no per subtree aggregate,
+   * nodes get no extra field and no maintenance code is compiled.
+   *
+   * Any other policy is a type with
+   *   value_type                              the aggregate, compared with ==
+   *                                           by sanityCheck
+   *   static identity() -> value_type         aggregate of no entries
+   *   static lift(key, value) -> value_type   aggregate of one entry
+   *   static combine(a, b) -> value_type      associative, a before b in key
+   *                                           order
+   */
+  struct NoAugment {
+    /**
+     * @brief Nothing is aggregated
+     */
+    struct value_type {};
+  };
+
+  /**
+   * @brief Sum of the values
+   */
+  template<typename T>
+  struct SumOf {
+    using value_type = T;
+
+    [[nodiscard]] static auto identity() -> T;
+
+    template<typename K>
+    [[nodiscard]] static auto lift(const K& key, const T& value) -> T;
+
+    [[nodiscard]] static auto combine(const T& a, const T& b) -> T;
+  };
+
+  /**
+   * @brief Smallest value (the biggest T when empty)
+   */
+  template<typename T>
+  struct MinOf {
+    using value_type = T;
+
+    [[nodiscard]] static auto identity() -> T;
+
+    template<typename K>
+    [[nodiscard]] static auto lift(const K& key, const T& value) -> T;
+
+    [[nodiscard]] static auto combine(const T& a, const T& b) -> T;
+  };
+
+  /**
+   * @brief Biggest value (the lowest T when empty)
+   */
+  template<typename T>
+  struct MaxOf {
+    using value_type = T;
+
+    [[nodiscard]] static auto identity() -> T;
+
+    template<typename K>
+    [[nodiscard]] static auto lift(const K& key, const T& value) -> T;
+
+    [[nodiscard]] static auto combine(const T& a, const T& b) -> T;
+  };
+
+  /**
+   * @brief Merkle style content hash (see AVLmap::digest and AVLmap::diff):
+   * the sum of one hash per entry, so maps with the same entries have the
+   * same digest whatever their shape
+   */
+  struct MerkleDigest {
+    using value_type = u64;
+
+    [[nodiscard]] static auto identity() -> u64;
+
+    template<typename K, typename V>
+    [[nodiscard]] static auto lift(const K& key, const V& value) -> u64;
+
+    [[nodiscard]] static auto combine(u64 a, u64 b) -> u64;
+  };
+
+  /**
+   * @brief Per node storage of an augment policy, empty for NoAugment so it
+   * takes no space as a base class
+   */
+  template<typename A>
+  struct AugmentSlot {
+    /**
+     * @brief Combined aggregate of the subtree
+     */
+    typename A::value_type aggregate{A::identity()};
+  };
+
+  template<>
+  struct AugmentSlot<NoAugment> {};
+
+  /**
+   * @brief Node of an augmented AVLmap whose value may have been written
+   * through the reference the map last handed out (see AVLmap::aggregate),
+   * empty for NoAugment
+   */
+  template<typename A, typename Node>
+  struct PendingWrite {
+    /**
+     * @brief The node, null if none
+     */
+    Node* node{nullptr};
+  };
+
+  template<typename Node>
+  struct PendingWrite<NoAugment, Node> {};
+
+  /**
+   * @brief Storage for the entries an AVLmap keeps inside itself while it is
+   * small (see its N parameter), empty when N is 0 so it takes no space
+   */
+  template<typename Entry, usize N>
+  struct EntrySlots {
+    static_assert(N <= 64, "At most 64 entries can be kept inline");
+
+    /**
+     * @brief Room for N entries in key order, entry i starts at byte
+     * i * sizeof(Entry), the first size() of them are constructed
+     */
+    alignas(Entry) unsigned char bytes[N * sizeof(Entry)];
+  };
+
+  template<typename Entry>
+  struct EntrySlots<Entry, 0> {};
+
+  /**
+   * @brief Where the inline entries an iterator walks end (see EntrySlots),
+   * null while it walks nodes. Empty for maps without inline entries
+   */
+  template<typename Entry, bool Inline>
+  struct EntryBound {
+    /**
+     * @brief One past the last inline entry, null for nodes
+     */
+    Entry* last{nullptr};
+  };
+
+  template<typename Entry>
+  struct EntryBound<Entry, false> {};
+
+  /**
+   * @brief Per node key window (see KeyTraits), a constant 0 taking no space
+   * when keys are not prefixed
+   */
+  template<bool Prefixed>
+  struct KeyWindow {
+    /**
+     * @brief The window of the key just past the shared prefix of the map
+     */
+    u64 window{0};
+  };
+
+  template<>
+  struct KeyWindow<false> {
+    static constexpr u64 window = 0;
+  };
+
+  /**
+   * @brief Prefix all keys of an AVLmap share (see KeyTraits), empty when
+   * keys are not prefixed
+   */
+  template<typename K, bool Prefixed>
+  struct SharedPrefix {
+    /**
+     * @brief A key the prefix is taken from, the first one of the map
+     */
+    K key{};
+
+    /**
+     * @brief Length of the prefix, it only ever shrinks while the map is not
+     * emptied (an erase leaves it shorter than it could be)
+     */
+    usize length{0};
+  };
+
+  template<typename K>
+  struct SharedPrefix<K, false> {};
+
+  /**
+   * @brief Value storage policy of an AVLmap: every value is stored in its
+   * node, next to the key and the links
+   */
+  struct InlineValues {};
+
+  /**
+   * @brief Value storage policy of an AVLmap: values are stored in a
+   * ValueSlab of the map and nodes only hold a pointer to theirs, so the
+   * nodes a search walks stay small whatever the size of V. Costs the
+   * pointer and an indirection per value read. A value keeps its address
+   * while in the map, extract moves it out to the heap
+   */
+  struct SlabValues {};
+
+  /**
+   * @brief Order AVLmap::compact lays the nodes out in
+   */
+  enum class NodeLayout {
+    /**
+     * @brief Key order, a scan walks memory forwards
+     */
+    InOrder,
+
+    /**
+     * @brief van Emde Boas order: the top half of the levels first, then
+     * each subtree below them, recursively, so a search touches few blocks
+     * of memory whatever their size
+     */
+    VanEmdeBoas,
+  };
+
+  /**
+   * @brief Block of nodes laid out by AVLmap::compact, slots of erased nodes
+   * are reused by later inserts and the block is freed with its last node
+   */
+  template<typename Node>
+  struct NodeBlock {
+    /**
+     * @brief Room for capacity nodes
+     */
+    Node* nodes{nullptr};
+
+    /**
+     * @brief Size of the block in nodes
+     */
+    usize capacity{0};
+
+    /**
+     * @brief Nodes alive in the block
+     */
+    usize live{0};
+
+    /**
+     * @brief Slots of erased nodes, the last one is reused first
+     */
+    std::vector<Node*> spare{};
+  };
+
+  /**
+   * @brief Entry of the hot key cache of an AVLmap
+   */
+  template<typename Node>
+  struct HotKeySlot {
+    u64 hash;
+
+    Node* node;
+  };
+
+  /**
+   * @brief Options policy of an AVLmap: none of the run time options
+   * (cache_lookups, filter_lookups, compact, defer_frees, parallel_copies) is
+   * compiled in, so the map object is only its root and its size
+   */
+  struct NoOptions {};
+
+  /**
+   * @brief Options policy of an AVLmap: the map keeps the state of the run
+   * time options, each one off until turned on
+   */
+  struct RuntimeOptions {};
+
+  /**
+   * @brief State of the run time options of an AVLmap, empty for NoOptions
+   * so it takes no space
+   */
+  template<typename Node, typename O>
+  struct OptionState {
+    /**
+     * @brief Hot key cache (see cache_lookups), empty when off
+     */
+    std::vector<HotKeySlot<Node>> cache{};
+
+    /**
+     * @brief Key filter (see filter_lookups), of 0 capacity when off
+     */
+    CountingBloomFilter filter{};
+
+    /**
+     * @brief Nodes laid out by compact, or cloned by parallel copies
+     */
+    NodeBlock<Node> block{};
+
+    /**
+     * @brief Are old nodes freed in the background (see defer_frees)
+     */
+    bool deferred_frees = false;
+
+    /**
+     * @brief Threads copies of the map clone on (see parallel_copies)
+     */
+    usize copy_threads = 1;
+  };
+
+  template<typename Node>
+  struct OptionState<Node, NoOptions> {};
+
+  /**
+   * @brief Binary Search Tree
+   *
+   * @tparam K Key
+   * @tparam V Value
+   * @tparam A Augment policy (see NoAugment)
+   * @tparam B Balancing policy (AVLBalance, RedBlackBalance, WAVLBalance,
+   * TreapBalance or AdaptiveBalance, see balance-policy.h)
+   * @tparam N Entries kept inside the map object instead of on the heap (at
+   * most 64). Up to N entries the map is a sorted array of keys and values
+   * (no links, no balancing data) searched linearly, and allocates nothing.
+   * Inserting entry N + 1 moves them into nodes built into a balanced tree
+   * in O(N), and the map stays a tree until it is emptied. Iterators point
+   * at an Entry in both modes, but while the map is small an insert or
+   * erase shifts the entries behind it and invalidates iterators to them,
+   * as does the promotion
+   * @tparam S Value storage policy (InlineValues or SlabValues)
+   * @tparam O Options policy (NoOptions or RuntimeOptions)
+   */
+  template<
+    typename K,
+    typename V,
+    typename A = NoAugment,
+    typename B = AVLBalance,
+    usize N = 0,
+    typename S = InlineValues,
+    typename O = NoOptions>
+  class AVLmap {
+
+    /**
+     * @brief Are values kept in a slab (see SlabValues)
+     */
+    static constexpr bool slab_values = std::is_same<S, SlabValues>::value;
+
+    /**
+     * @brief Are the run time options compiled in (see RuntimeOptions)
+     */
+    static constexpr bool tunable = std::is_same<O, RuntimeOptions>::value;
+
+    /**
+     * @brief What a node stores of its value: the value, or a pointer to it
+     * in the slab
+     */
+    using Stored = std::conditional_t<slab_values, V*, V>;
+
+  public:
+
+    class iterator;
+    class const_iterator;
+    class node_type;
+
+    /**
+     * @class KeyValue
+     * @brief Key and value of an entry, all an inline entry holds (see N).
+     * Nodes add the links and the balancing data
+     */
+    class KeyValue {
+    public:
+
+      /**
+       * @brief Normal constructor
+       */
+      KeyValue(K k, Stored val);
+
+      /**
+       * @brief Copy constructor
+       */
+      KeyValue(const KeyValue&) = delete;
+
+      /**
+       * @brief Move constructor
+       */
+      KeyValue(KeyValue&&) = default;
+
+      /**
+       * @brief Copy assignment
+       */
+      auto operator=(const KeyValue&) -> KeyValue& = delete;
+
+      /**
+       * @brief Move assignment
+       */
+      auto operator=(KeyValue&&) -> KeyValue& = default;
+
+      /**
+       * @brief Gets the key stored
+       */
+      [[nodiscard]] auto Key() const -> const K&;
+
+      /**
+       * @brief Gets the value stored
+       */
+      [[nodiscard]] auto Value() -> V&;
+
+      /**
+       * @brief Gets the value stored (const)
+       */
+      [[nodiscard]] auto Value() const -> const V&;
+
+      /**
+       * @brief Destructor
+       */
+      ~KeyValue() = default;
+
+    protected:
+
+      /**
+       * @brief The value, wherever it is stored
+       */
+      [[nodiscard]] auto payload() -> V&;
+
+      /**
+       * @brief The value, wherever it is stored (const)
+       */
+      [[nodiscard]] auto payload() const -> const V&;
+
+      /**
+       * @brief Key data
+       */
+      K key;
+
+      /**
+       * @brief Value data, or where it is (see S)
+       */
+      Stored stored;
+
+      friend class AVLmap;
+      friend class node_type;
+    };
+
+    /**
+     * @class Node
+     * @brief BST Node
+     */
+    class Node:
+        public KeyValue,
+        private AugmentSlot<A>,
+        private KeyWindow<KeyTraits<K>::prefixed> {
+    public:
+
+      /**
+       * @brief Normal constructor
+       */
+      Node(K k, Stored val, Node* p, usize h, i32 b, Node* l, Node* r);
+
+      /**
+       * @brief Copy constructor
+       */
+      Node(const Node&) = delete;
+
+      /**
+       * @brief Destructor, the children are freed by the map
+       */
+      ~Node() = default;
+
+      /**
+       * @brief Copy assignment
+       */
+      auto operator=(const Node&) -> Node& = delete;
+
+      /**
+       * @brief  Move constructor
+       */
+      Node(Node&&);
+
+      /**
+       * @brief move assignment
+       */
+      auto operator=(Node&& from) -> Node&;
+
+      /**
+       * @brief Gets the leftmost node
+       */
+      [[nodiscard]] auto first() -> Node*;
+
+      /**
+       * @brief Gets the rightmost node
+       */
+      [[nodiscard]] auto last() -> Node*;
+
+      /**
+       * @brief Gets the successor node
+       */
+      [[nodiscard]] auto successor() -> Node*;
+
+      /**
+       * @brief Gets the predecessor Node
+       */
+      [[nodiscard]] auto decrement() -> Node*;
+
+      /**
+       * @brief Prints to stream
+       */
+      auto print(std::ostream& os) const -> void;
+
+    private:
+
+      using KeyValue::key;
+      using KeyValue::stored;
+      using KeyValue::payload;
+
+      /**
+       * @brief Pointer to the parent
+       */
+      Node* parent{nullptr};
+
+      /**
+       * @brief Balancing data of the policy: the height (AVL), the rank
+       * (WAVL), the priority (treap) or the access count (adaptive)
+       */
+      usize rank;
+
+      /**
+       * @brief Balancing data of the policy: the balance factor (AVL), the
+       * colour (red-black) or the peak size at the root (adaptive)
+       */
+      i32 balance;
+
+      /**
+       * @brief Left child
+       */
+      Node* left{nullptr};
+
+      /**
+       * @brief Right child
+       */
+      Node* right{nullptr};
+
+      friend class AVLmap;
+      friend class node_type;
+      friend B;
+    };
+
+    /**
+     * @brief What iterators point at: a KeyValue when the map keeps entries
+     * inline (see N), in the array or in a node, the Node otherwise
+     */
+    using Entry = std::conditional_t<N != 0, KeyValue, Node>;
+
+    /**
+     * @class iterator
+     * @brief Iterator for a non-const BST
+     *
+     */
+    class iterator {
+    public:
+
+      /**
+       * @brief Default / normal constructor
+       */
+      iterator(Entry* p = nullptr);
+
+      /**
+       * @brief Pre-increment, move to the next
+       */
+      auto operator++() -> iterator&;
+
+      /**
+       * @brief Post-increment, returns the current and after move to the next
+       */
+      auto operator++(int) -> iterator;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator*() const -> Entry&;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator->() const -> Entry*;
+
+      /**
+       * @brief Checks if this and another iterator are not equal
+       */
+      [[nodiscard]] auto operator!=(const iterator& rhs) const -> bool;
+
+      /**
+       * @brief Checks if this and another iterator are equal
+       */
+      [[nodiscard]] auto operator==(const iterator& rhs) const -> bool;
+
+      friend class AVLmap;
+
+    private:
+
+      /**
+       * @brief Iterator over the inline entries up to last
+       */
+      iterator(Entry* p, Entry* last);
+
+      Entry* node;
+
+      /**
+       * @brief End of the inline entries walked (see EntryBound)
+       */
+      [[no_unique_address]] EntryBound<Entry, N != 0> bound{};
+    };
+
+    /**
+     * @class const_iterator
+     * @brief Iterator for a const BST
+     */
+    class const_iterator {
+    public:
+
+      /**
+       * @brief Default/Normal Constructor
+       */
+      const_iterator(Entry* p = nullptr);
+
+      /**
+       * @brief Pre-increment
+       */
+      auto operator++() -> const_iterator&;
+
+      /**
+       * @brief Post-increment
+       */
+      auto operator++(int) -> const_iterator;
+
+      /**
+       * @brief Gets a refereence to the inner node
+       */
+      [[nodiscard]] auto operator*() const -> const Entry&;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator->() const -> const Entry*;
+
+      /**
+       * @brief Checks if this and another iter is not equal
+       */
+      [[nodiscard]] auto operator!=(const const_iterator& rhs) const -> bool;
+
+      /**
+       * @brief Checks if this and another iter is equal
+       */
+      [[nodiscard]] auto operator==(const const_iterator& rhs) const -> bool;
+
+      friend class AVLmap;
+
+    private:
+
+      /**
+       * @brief Iterator over the inline entries up to last
+       */
+      const_iterator(Entry* p, Entry* last);
+
+      /**
+       * @brief Pointer to the given node
+       */
+      Entry* node;
+
+      /**
+       * @brief End of the inline entries walked (see EntryBound)
+       */
+      [[no_unique_address]] EntryBound<Entry, N != 0> bound{};
+    };
+
+    /**
+     * @class node_type
+     * @brief Owning handle to a node detached from a map (see extract), can be
+     * reinserted into any map of the same type without reallocating the node
+     */
+    class node_type {
+    public:
+
+      /**
+       * @brief Empty handle
+       */
+      node_type();
+
+      /**
+       * @brief Copy constructor
+       */
+      node_type(const node_type&) = delete;
+
+      /**
+       * @brief Move constructor
+       */
+      node_type(node_type&& from);
+
+      /**
+       * @brief Copy assignment
+       */
+      auto operator=(const node_type&) -> node_type& = delete;
+
+      /**
+       * @brief Move assignment, frees the currently owned node
+       */
+      auto operator=(node_type&& from) -> node_type&;
+
+      /**
+       * @brief Destructor, frees the owned node (if any)
+       */
+      ~node_type();
+
+      /**
+       * @brief Does this handle own no node
+       */
+      [[nodiscard]] auto empty() const -> bool;
+
+      /**
+       * @brief Does this handle own a node
+       */
+      explicit operator bool() const;
+
+      /**
+       * @brief Gets the key of the owned node, may be changed before reinserting
+       */
+      [[nodiscard]] auto key() const -> K&;
+
+      /**
+       * @brief Gets the value of the owned node
+       */
+      [[nodiscard]] auto mapped() const -> V&;
+
+      friend class AVLmap;
+
+    private:
+
+      /**
+       * @brief Takes ownership of an already detached node
+       */
+      explicit node_type(Node* node);
+
+      /**
+       * @brief Pointer to the owned node
+       */
+      Node* node;
+    };
+
+    /**
+     * @struct insert_return_type
+     * @brief Result of inserting a node handle
+     */
+    struct insert_return_type {
+      /**
+       * @brief Node with the key of the inserted handle
+       */
+      iterator position;
+
+      /**
+       * @brief Was the node linked into the tree
+       */
+      bool inserted;
+
+      /**
+       * @brief Holds the node back if the key was already present
+       */
+      node_type node;
+    };
+
+    /**
+     * @brief Iterator at the end of every BST
+     */
+    static const iterator end_it;
+
+    /**
+     * @brief Const Iterator at the end of every BST
+     */
+    static const const_iterator const_end_it;
+
+    /**
+     * @brief Default constructor
+     */
+    AVLmap();
+
+    /**
+     * @brief Copy constructor
+     *
+     * @param rhs
+     */
+    AVLmap(const AVLmap& rhs);
+
+    /**
+     * @brief Move constructor
+     *
+     * @param from
+     */
+    AVLmap(AVLmap&& from);
+
+    /**
+     * @brief Copy assignment. The nodes of this map are reused for the
+     * entries of rhs (keys and values assigned), only the ones missing are
+     * allocated and only the ones left over freed, so refreshing a map from
+     * one of about its size allocates nothing
+     */
+    auto operator=(const AVLmap& rhs) -> AVLmap&;
+
+    /**
+     * @brief Move assignment
+     *
+     * @param rhs
+     */
+    auto operator=(AVLmap&& rhs) -> AVLmap&;
+
+    /**
+     * @brief Destructor
+     */
+    ~AVLmap();
+
+    /**
+     * @brief How many elements are in the tree
+     */
+    auto size() const -> usize;
+
+    /**
+     * @brief Is the size 0
+     */
+    auto empty() const -> bool;
+
+    /**
+     * @brief Value getter and setter, creates key if it does not exist
+     */
+    auto operator[](const K& key) -> V&;
+
+    /**
+     * @brief Beginning iterator (mutable)
+     */
+    auto begin() -> iterator;
+
+    /**
+     * @brief End iterator (mutable)
+     */
+    auto end() -> iterator;
+
+    /**
+     * @brief Attempts to find an iterator pointing to a node in this BST that
+     * has the given key
+     */
+    auto find(const K& key) -> iterator;
+
+    /**
+     * @brief Attempts to erase the node represented by the given iterator
+     */
+    auto erase(iterator it) -> void;
+
+    /**
+     * @brief Unlinks the node represented by the given iterator and hands
+     * ownership of it to the caller without freeing it
+     */
+    auto extract(iterator it) -> node_type;
+
+    /**
+     * @brief Unlinks the node with the given key (if any) and hands ownership
+     * of it to the caller without freeing it
+     */
+    auto extract(const K& key) -> node_type;
+
+    /**
+     * @brief Links the node owned by the handle into this tree, no allocation
+     * or copy of the key or value is done. If the key is already present the
+     * node is handed back through the returned value
+     */
+    auto insert(node_type&& handle) -> insert_return_type;
+
+    /**
+     * @brief Beginning iterator (const)
+     */
+    auto begin() const -> const_iterator;
+
+    /**
+     * @brief End iterator (const)
+     */
+    auto end() const -> const_iterator;
+
+    /**
+     * @brief Attempts to find an iterator pointing to a node in this BST that
+     * has the given key
+     */
+    auto find(const K& key) const -> const_iterator;
+
+    /**
+     * @brief Writes the tree to a versioned binary snapshot: a small header
+     * followed by the in-order array of keys and then of values. Only
+     * trivially copyable keys and values are supported. Returns false if the
+     * file could not be written
+     */
+    auto save(const char* path) const -> bool;
+
+    /**
+     * @brief Memory maps a snapshot written by save and builds a perfectly
+     * balanced tree from it in O(n), with one pass over the keys checking
+     * they are in order. An empty map is returned (and ok set to false) if
+     * the file is missing, malformed or its keys are not in order
+     */
+    [[nodiscard]] static auto load_mmap(const char* path, bool* ok = nullptr)
+      -> AVLmap;
+
+    // do not need this one (why)
+    // const_iterator erase(iterator& it) const;
+
+    /**
+     * @brief Prints this to an output stream
+     */
+    auto print(std::ostream& os, bool print_value = false) const -> void;
+
+    /**
+     * @brief Gets the edge symbol character
+     */
+    auto getedgesymbol(const Node* node) const -> char;
+
+    /**
+     * @brief Checks the links, the key order, the size, the invariant of
+     * the balancing policy and the stored aggregates, O(n)
+     */
+    auto sanityCheck() -> bool;
+
+    /**
+     * @brief Structural counters since construction or the last reset_stats,
+     * only the current height (an O(n) walk) is filled in unless
+     * AVLMAP_STATS is defined
+     */
+    [[nodiscard]] auto stats() const -> AVLmapStats;
+
+    /**
+     * @brief Zeroes the structural counters
+     */
+    auto reset_stats() -> void;
+
+    /**
+     * @brief Bytes used by the map, split into payload, link, metadata and
+     * allocator overhead. O(1), every node has the same size
+     */
+    [[nodiscard]] auto memory_usage() const -> AVLmapMemory;
+
+    /**
+     * @brief Erases every entry, keeps the hot key cache and key filter
+     * sizes
+     */
+    auto clear() -> void;
+
+    /**
+     * @brief Like clear, but the map only hands its nodes to the
+     * DeferredFree thread, which frees them (and destroys the keys and
+     * values) in the background. O(1) but for the inline entries, which move
+     * with them. The map can be used again at once
+     */
+    auto clear_async() -> void;
+
+    /**
+     * @brief Makes the destructor and move assignment free the old nodes
+     * like clear_async (copy assignment reuses them, and frees the ones
+     * left over at once), so freeing a big map costs a request thread
+     * nothing. The copy and move constructors take the setting over,
+     * assignments keep the one of the map assigned to. Keys and values must
+     * be safe to destroy on another thread, and a map destroyed after main
+     * returns should not defer. Needs the RuntimeOptions policy
+     */
+    auto defer_frees(bool on) -> void;
+
+    /**
+     * @brief Makes copies of this map (copy constructor and copy assignment
+     * from it) clone the tree on up to threads threads, 0 for one per core.
+     * The top levels are copied first, then the subtrees below them are
+     * cloned in parallel into one block of nodes (freed like the one of
+     * compact), each thread filling chunks of it it took for itself, so the
+     * threads never share an allocator. Maps of fewer than PARALLEL_COPY_MIN
+     * entries or with slab values copy on the calling thread.
+     * export_columns uses the same threads, which are the ones of the
+     * TaskPool, started once and kept. Copies take the setting over.
+     * Keys and values must be safe to copy on another thread. Needs the
+     * RuntimeOptions policy
+     */
+    auto parallel_copies(usize threads) -> void;
+
+    /**
+     * @brief Rebuilds the tree perfectly balanced with every node moved (key
+     * and value, not copied) into one block in the given layout, and frees
+     * the old nodes. After erase and insert churn has scattered the nodes
+     * over the heap this makes scans and searches touch neighbouring memory
+     * again. O(n), invalidates iterators and empties the hot key cache. The
+     * old nodes go back to malloc, whether its heap is trimmed (as with
+     * glibc's malloc_trim) is left to the caller, it locks every arena.
+     * Needs the RuntimeOptions policy, which keeps the block
+     */
+    auto compact(NodeLayout layout = NodeLayout::InOrder) -> void;
+
+    /**
+     * @brief Puts a direct mapped cache from key hash to node in front of
+     * find and operator[], so a repeated lookup costs a hash and a probe
+     * instead of a search. slots is rounded up to a power of two, 0 removes
+     * the cache. Nodes only move in compact, so only erase and extract drop
+     * entries.
+     * Const finds read the cache but do not fill it. Copies get an empty
+     * cache of the same size. Needs the RuntimeOptions policy
+     */
+    auto cache_lookups(usize slots) -> void;
+
+    /**
+     * @brief Keeps a counting Bloom filter of the keys (5 bytes per key) so
+     * most finds of a missing key return end() after probing one cache line
+     * instead of searching, about 1% still search. Sized for expected_keys
+     * and rebuilt twice as big whenever the map outgrows it, 0 removes it.
+     * Copies and moves take it along. Needs the RuntimeOptions policy
+     */
+    auto filter_lookups(usize expected_keys) -> void;
+
+    /**
+     * @brief Aggregate (see the augment policy) of every entry. The
+     * aggregates of the subtrees are kept up to date by every insert, erase
+     * and rotation, so queries only read them and are safe to run from
+     * several threads at once.
+     *
+     * A value written through the reference operator[] returns, or through
+     * the iterator find or insert return, is folded in by the next non const
+     * call; until then queries recombine the O(log n) nodes above it. Values
+     * written through any other iterator are not seen
+     */
+    [[nodiscard]] auto aggregate() const -> typename A::value_type;
+
+    /**
+     * @brief Aggregate of the entries with lo <= key <= hi in O(log n)
+     */
+    [[nodiscard]] auto aggregate(const K& lo, const K& hi) const ->
+      typename A::value_type;
+
+    /**
+     * @brief Hash of the contents (0 when empty), needs the MerkleDigest
+     * augment, kept up to date as aggregate() is
+     */
+    [[nodiscard]] auto digest() const -> u64;
+
+    /**
+     * @brief Calls fn(key, a_value, b_value) in key order for every key whose
+     * entry differs, with nullptr for the side the key is missing from.
+     * Subtrees of a whose digest matches the digest of the same key range in
+     * b are skipped, so the cost grows with the number of differences rather
+     * than with the size of the maps
+     */
+    template<typename Fn>
+    static auto diff(const AVLmap& a, const AVLmap& b, Fn fn) -> void;
+
+    /**
+     * @brief Writes every key to keys and its value to values in key order,
+     * keys[i] the key of values[i], replacing what they held. One walk of
+     * the tree with no iterators; a map of at least PARALLEL_COPY_MIN
+     * entries is walked a subtree per thread on the threads set with
+     * parallel_copies
+     */
+    auto export_columns(std::vector<K>& keys, std::vector<V>& values) const
+      -> void;
+
+    /**
+     * @brief Like export_columns, for the entries with lo <= key <= hi. The
+     * subtrees out of the range are not walked
+     */
+    auto export_columns(
+      const K& lo,
+      const K& hi,
+      std::vector<K>& keys,
+      std::vector<V>& values
+    ) const -> void;
+
+#ifdef AVLMAP_LATENCY
+    /**
+     * @brief Latency histograms of operator[], find and erase on this map
+     * (thread_latency() has the ones of the calling thread). finds on a
+     * const map are only recorded per thread, so concurrent readers never
+     * write to the map
+     */
+    [[nodiscard]] auto latency() const -> const AVLmapLatency&;
+
+    /**
+     * @brief Zeroes the latency histograms of this map
+     */
+    auto reset_latency() -> void;
+#endif
+
+    friend class iterator;
+    friend class const_iterator;
+    friend B;
+
+  private:
+
+    /**
+     * @brief Gets how deep the given node is
+     */
+    [[nodiscard]] auto getdepth(const Node& node) const -> usize;
+
+    /**
+     * @brief Gets the node with the given key, or what its parent should be
+     */
+    auto index(Node* node, const K& key) const -> Node*;
+
+    auto balanced_index(Node* node, const K& key) const -> Node*;
+
+    /**
+     * @brief Single rotation, the left child of node takes its place, returns
+     * it (for the balancing policy)
+     */
+    auto rotate_right(Node* node) -> Node*;
+
+    /**
+     * @brief Single rotation, the right child of node takes its place,
+     * returns it (for the balancing policy)
+     */
+    auto rotate_left(Node* node) -> Node*;
+
+    /**
+     * @brief Double rotation, the right child of the left child of node takes
+     * its place, returns it (for the balancing policy)
+     */
+    auto rotate_left_right(Node* node) -> Node*;
+
+    /**
+     * @brief Double rotation, the left child of the right child of node
+     * takes its place, returns it (for the balancing policy)
+     */
+    auto rotate_right_left(Node* node) -> Node*;
+
+    /**
+     * @brief Rotation without counting it in the stats
+     */
+    auto pivot_right(Node* node) -> Node*;
+
+    /**
+     * @brief Rotation without counting it in the stats
+     */
+    auto pivot_left(Node* node) -> Node*;
+
+    /**
+     * @brief Height of a subtree in levels, walks all of it
+     */
+    [[nodiscard]] static auto subtree_height(const Node* node) -> usize;
+
+    /**
+     * @brief Height of a subtree for the tracepoints: from the ranks two
+     * levels down under AVLBalance (right in the middle of a rotation too),
+     * a walk of it (subtree_height) under the other policies, whose rank is
+     * not a height
+     */
+    [[nodiscard]] auto probe_height(const Node* node) const -> usize;
+
+    /**
+     * @brief Are the parent links of the subtree right and its keys in order
+     * (and between lo and hi when given), counts its nodes into n
+     */
+    [[nodiscard]] static auto linked_in_order(
+      const Node* node,
+      const K* lo,
+      const K* hi,
+      usize& n
+    ) -> bool;
+
+    [[nodiscard]] auto node_ref(Node& node) -> Node*&;
+
+    /**
+     * @brief Unlinks the node from the tree and returns it detached (no parent
+     * or children), the caller takes ownership. A node with two children is
+     * replaced by its successor, so no other node moves in memory
+     */
+    [[nodiscard]] auto detach(Node* to_erase) -> Node*;
+
+    /**
+     * @brief Rebalances after the node was linked as a leaf (or the root)
+     */
+    auto linked(Node* node) -> void;
+
+    /**
+     * @brief Are up to N entries kept inline (N is not 0)
+     */
+    static constexpr bool inline_entries = N != 0;
+
+    /**
+     * @brief Entries below which a copy or export is not worth the threads
+     */
+    static constexpr usize PARALLEL_COPY_MIN = usize{1} << 16;
+
+    /**
+     * @brief Is the map its inline entries rather than a tree (see N)
+     */
+    [[nodiscard]] auto small() const -> bool;
+
+    /**
+     * @brief Inline entry i, const maps hand it out through const_iterator
+     */
+    [[nodiscard]] auto entry(usize i) const -> KeyValue*;
+
+    /**
+     * @brief Index of the first inline entry whose key is not below key,
+     * found by a linear scan
+     */
+    [[nodiscard]] auto entry_rank(const K& key) const -> usize;
 
-      /**
-       * @brief Key data
-       */
-      K key;
+    /**
+     * @brief Inserts an inline entry at index i, shifting the ones behind it
+     */
+    auto emplace_entry(usize i, K key, Stored value) -> KeyValue*;
 
-      /**
-       * @brief Value data
-       */
-      V value;
+    /**
+     * @brief Removes inline entry i, shifting the ones behind it, its value
+     * must already be freed or taken
+     */
+    auto remove_entry(usize i) -> void;
 
-      /**
-       * @brief Pointer to the parent
-       */
-      Node* parent{nullptr};
+    /**
+     * @brief Destroys the inline entries and their values
+     */
+    auto destroy_entries() -> void;
 
-      /**
-       * @brief Height of this node
-       */
-      usize height;
+    /**
+     * @brief Copies the inline entries of rhs into this empty map, none are
+     * left if a copy throws
+     */
+    auto copy_entries(const AVLmap& rhs) -> void;
 
-      /**
-       * @brief Balance of the node
-       */
-      i32 balance;
+    /**
+     * @brief Moves the inline entries of from into this map. Root and count
+     * must already be taken from it
+     */
+    auto take_entries(AVLmap& from) -> void;
 
-      /**
-       * @brief Left child
-       */
-      Node* left{nullptr};
+    /**
+     * @brief Aggregate of the inline entries with lo <= key <= hi, a null
+     * bound is open
+     */
+    [[nodiscard]] auto entries_aggregate(const K* lo, const K* hi) const
+      -> typename A::value_type;
 
-      /**
-       * @brief Right child
-       */
-      Node* right{nullptr};
+    /**
+     * @brief Node an iterator into the tree is at
+     */
+    [[nodiscard]] static auto node_of(Entry* entry) -> Node*;
 
-      friend class AVLmap;
-    };
+    /**
+     * @brief Puts a value where nodes keep theirs (see S)
+     */
+    [[nodiscard]] auto store(V value) -> Stored;
 
     /**
-     * @class iterator
-     * @brief Iterator for a non-const BST
-     *
+     * @brief Moves the value of a node from a handle into the slab (see
+     * SlabValues), handles keep theirs on the heap
      */
-    class iterator {
-    public:
+    auto take_value(Node* node) -> void;
 
-      /**
-       * @brief Default / normal constructor
-       */
-      iterator(Node* p = nullptr);
+    /**
+     * @brief Node in a spare slot of the compacted block if there is one,
+     * on the heap otherwise
+     */
+    [[nodiscard]] auto make_node(K key, Stored value, Node* parent) -> Node*;
 
-      /**
-       * @brief Pre-increment, move to the next
-       */
-      auto operator++() -> iterator&;
+    /**
+     * @brief Frees a node made by make_node and its value
+     */
+    auto free_node(Node* node) -> void;
 
-      /**
-       * @brief Post-increment, returns the current and after move to the next
-       */
-      auto operator++(int) -> iterator;
+    /**
+     * @brief Frees the memory of a node made by make_node, not its value
+     */
+    auto release(Node* node) -> void;
 
-      /**
-       * @brief Gets the inner node
-       */
-      [[nodiscard]] auto operator*() const -> Node&;
+    /**
+     * @brief Frees a node owned by a node handle, whose value is on the heap
+     * when values are kept in a slab
+     */
+    static auto free_handle(Node* node) -> void;
 
-      /**
-       * @brief Gets the inner node
-       */
-      [[nodiscard]] auto operator->() const -> Node*;
+    /**
+     * @brief Is the node in the compacted block
+     */
+    [[nodiscard]] auto in_block(const Node* node) const -> bool;
 
-      /**
-       * @brief Checks if this and another iterator are not equal
-       */
-      [[nodiscard]] auto operator!=(const iterator& rhs) const -> bool;
+    /**
+     * @brief Sets position[rank] to the place of the node of that in-order
+     * rank in van Emde Boas order, for the top levels of the balanced
+     * subtree of n nodes from rank lo (as build_balanced shapes it). Places
+     * are handed out from next
+     */
+    static auto veb_positions(
+      usize lo,
+      usize n,
+      usize levels,
+      usize& next,
+      std::vector<usize>& position
+    ) -> void;
 
-      /**
-       * @brief Checks if this and another iterator are equal
-       */
-      [[nodiscard]] auto operator==(const iterator& rhs) const -> bool;
+    /**
+     * @brief Calls fn(lo, n) for every subtree depth levels below the root
+     * of the balanced subtree of n nodes from rank lo, in key order
+     */
+    template<typename Fn>
+    static auto subtrees_below(usize lo, usize n, usize depth, Fn& fn) -> void;
 
-      friend class AVLmap;
+    /**
+     * @brief Frees the nodes before they are replaced, in the background if
+     * frees are deferred
+     */
+    auto discard() -> void;
 
-    private:
+    /**
+     * @brief Frees a subtree, without recursion so any shape will do
+     */
+    auto destroy(Node* node) -> void;
 
-      Node* node;
-    };
+    /**
+     * @brief Copies a subtree of another map under the given parent, same
+     * shape and balancing data. Without recursion, so any shape will do
+     */
+    [[nodiscard]] auto clone(const Node* node, Node* parent) -> Node*;
 
     /**
-     * @class const_iterator
-     * @brief Iterator for a const BST
+     * @brief Walks a subtree of another map and rebuilds it under the given
+     * parent, copy(from, parent) must return a copy of node from linked to
+     * parent, with its balancing data. Nodes are copied in pre-order
      */
-    class const_iterator {
-    public:
+    template<typename Copy>
+    [[nodiscard]] static auto clone(const Node* node, Node* parent, Copy& copy)
+      -> Node*;
 
-      /**
-       * @brief Default/Normal Constructor
-       */
-      const_iterator(Node* p = nullptr);
+    /**
+     * @brief Rebuilds the tree of rhs out of the nodes of this one, taken in
+     * pre-order so a tree of the same shape keeps its nodes in place. Makes
+     * the nodes missing and frees the ones left over. If a copy throws the
+     * map is left empty
+     */
+    auto recycle(const AVLmap& rhs) -> void;
 
-      /**
-       * @brief Pre-increment
-       */
-      auto operator++() -> const_iterator&;
+    /**
+     * @brief Copies the tree of rhs, in parallel if rhs asked for it and is
+     * big enough (see parallel_copies)
+     */
+    [[nodiscard]] auto clone_tree(const AVLmap& rhs) -> Node*;
 
-      /**
-       * @brief Post-increment
-       */
-      auto operator++(int) -> const_iterator;
+    /**
+     * @brief Threads copies of this map run on (see parallel_copies)
+     */
+    [[nodiscard]] auto copy_thread_count() const -> usize;
 
-      /**
-       * @brief Gets a refereence to the inner node
-       */
-      [[nodiscard]] auto operator*() const -> const Node&;
+    /**
+     * @brief Runs work(thread) on the calling thread (thread 0) and on up
+     * to threads - 1 threads of the TaskPool, returns once all are done
+     */
+    template<typename Work>
+    static auto run_parallel(usize threads, Work& work) -> void;
 
-      /**
-       * @brief Gets the inner node
-       */
-      [[nodiscard]] auto operator->() const -> const Node*;
+    /**
+     * @brief Copies the tree of rhs into a new block on the given number of
+     * threads, each cloning subtrees in pre-order into its own part of it
+     */
+    [[nodiscard]] auto clone_parallel(const AVLmap& rhs, usize threads)
+      -> Node*;
 
-      /**
-       * @brief Checks if this and another iter is not equal
-       */
-      [[nodiscard]] auto operator!=(const const_iterator& rhs) const -> bool;
+    /**
+     * @brief Links a detached node as the leaf of the node a search for its
+     * key ended at
+     */
+    auto attach(Node* parent, Node* node) -> void;
 
-      /**
-       * @brief Checks if this and another iter is equal
-       */
-      [[nodiscard]] auto operator==(const const_iterator& rhs) const -> bool;
+    /**
+     * @brief Moves the inline entries into nodes built into a balanced tree
+     */
+    auto promote() -> void;
 
-      friend class AVLmap;
+    /**
+     * @brief diff of maps either of which is small, by walking both in key
+     * order. What it reports is at least as long as the bigger map
+     */
+    template<typename Fn>
+    static auto diff_entries(const AVLmap& a, const AVLmap& b, Fn& fn) -> void;
 
-    private:
+    /**
+     * @brief Lets the policy adapt to a search that hit node
+     */
+    auto accessed(Node* node) -> void;
 
-      /**
-       * @brief Pointer to the given node
-       */
-      Node* node;
-    };
+    /**
+     * @brief Do nodes keep a key window (see KeyTraits)
+     */
+    static constexpr bool windowed = KeyTraits<K>::prefixed;
 
     /**
-     * @brief Iterator at the end of every BST
+     * @brief Does the key start with the shared prefix, only then can its
+     * window be compared with the windows of the nodes
      */
-    static const iterator end_it;
+    [[nodiscard]] auto shares_prefix(const K& key) const -> bool;
 
     /**
-     * @brief Const Iterator at the end of every BST
+     * @brief Window of a key just past the shared prefix
      */
-    static const const_iterator const_end_it;
+    [[nodiscard]] auto window_of(const K& key) const -> u64;
 
     /**
-     * @brief Default constructor
+     * @brief Sets the window of a node new to the map, shortens the shared
+     * prefix first (and recomputes every window) if its key does not start
+     * with it
      */
-    AVLmap();
+    auto keyed(Node* node) -> void;
 
     /**
-     * @brief Copy constructor
-     *
-     * @param rhs
+     * @brief Recomputes the window of every node
      */
-    AVLmap(const AVLmap& rhs);
+    auto rewindow() -> void;
 
     /**
-     * @brief Move constructor
-     *
-     * @param from
+     * @brief Can keys be hashed, the hot key cache needs it
      */
-    AVLmap(AVLmap&& from);
+    static constexpr bool hashable = std::is_default_constructible<
+      std::hash<K>
+    >::value;
 
     /**
-     * @brief Copy assignment
+     * @brief Entry of the hot key cache
      */
-    auto operator=(const AVLmap& rhs) -> AVLmap&;
+    using CacheSlot = HotKeySlot<Node>;
 
     /**
-     * @brief Move assignment
-     *
-     * @param rhs
+     * @brief Is the key filter on
      */
-    auto operator=(AVLmap&& rhs) -> AVLmap&;
+    [[nodiscard]] auto filtering() const -> bool;
 
     /**
-     * @brief Destructor
+     * @brief Takes the run time options of from over, leaving it without
+     * cache, filter or block
      */
-    virtual ~AVLmap();
+    auto take_options(AVLmap& from) -> void;
 
     /**
-     * @brief How many elements are in the tree
+     * @brief Hash of a key if the hot key cache or the key filter is on, 0
+     * otherwise
      */
-    auto size() -> usize;
+    [[nodiscard]] auto hash_of(const K& key) const -> u64;
 
     /**
-     * @brief Is the size 0
+     * @brief Does the key filter (if on) rule the hash out
      */
-    auto empty() -> bool;
+    [[nodiscard]] auto filtered_out(u64 hash) const -> bool;
 
     /**
-     * @brief Value getter and setter, creates key if it does not exist
+     * @brief Node of key if the hot key cache has it, null otherwise
      */
-    auto operator[](const K& key) -> V&;
+    [[nodiscard]] auto cached(const K& key, u64 hash) const -> Node*;
 
     /**
-     * @brief Beginning iterator (mutable)
+     * @brief Puts node in the hot key cache (if on) under the given hash
      */
-    auto begin() -> iterator;
+    auto remember(Node* node, u64 hash) -> void;
 
     /**
-     * @brief End iterator (mutable)
+     * @brief Records a node new to the map in the key filter (if on), which
+     * is rebuilt once the map outgrows it, and in the hot key cache
      */
-    auto end() -> iterator;
+    auto added(Node* node, u64 hash) -> void;
 
     /**
-     * @brief Attempts to find an iterator pointing to a node in this BST that
-     * has the given key
+     * @brief Drops a node leaving the map from the hot key cache and the key
+     * filter
      */
-    auto find(const K& key) -> iterator;
+    auto forget(const Node* node, u64 hash) -> void;
 
     /**
-     * @brief Attempts to erase the node represented by the given iterator
+     * @brief Rebuilds the key filter for the given number of keys
      */
-    auto erase(iterator it) -> void;
+    auto refilter(usize expected_keys) -> void;
 
     /**
-     * @brief Beginning iterator (const)
+     * @brief Is an augment policy in use
      */
-    auto begin() const -> const_iterator;
+    static constexpr bool augmented = not std::is_same<A, NoAugment>::value;
 
     /**
-     * @brief End iterator (const)
+     * @brief Aggregate of a single entry
      */
-    auto end() const -> const_iterator;
+    [[nodiscard]] static auto lift(const KeyValue& entry)
+      -> typename A::value_type;
 
     /**
-     * @brief Attempts to find an iterator pointing to a node in this BST that
-     * has the given key
+     * @brief Recomputes the aggregate of node from its children
      */
-    auto find(const K& key) const -> const_iterator;
+    static auto recombine(Node* node) -> void;
 
-    // do not need this one (why)
-    // const_iterator erase(iterator& it) const;
+    /**
+     * @brief Recomputes the aggregates of node and its ancestors
+     */
+    static auto recombine_path(Node* node) -> void;
 
     /**
-     * @brief Prints this to an output stream
+     * @brief Folds the pending write (if any) into the aggregates, before
+     * anything reshapes the tree or hands out another value
      */
-    auto print(std::ostream& os, bool print_value = false) const -> void;
+    auto settle() -> void;
 
     /**
-     * @brief Gets the edge symbol character
+     * @brief Makes node the pending write, its value is being handed out.
+     * Returns node
      */
-    auto getedgesymbol(const Node* node) const -> char;
+    auto lend(Node* node) -> Node*;
 
-    auto sanityCheck() -> bool;
+    /**
+     * @brief Recombines, in this copy of rhs, the path of the write pending
+     * in rhs
+     */
+    auto settle_copy(const AVLmap& rhs) -> void;
 
-    friend class iterator;
-    friend class const_iterator;
+    /**
+     * @brief Is node the pending write or one of its ancestors, whose stored
+     * aggregates may not include it yet
+     */
+    [[nodiscard]] auto written(const Node* node) const -> bool;
 
-  private:
+    /**
+     * @brief Aggregate of a subtree, the stored one unless the pending write
+     * is in it
+     */
+    [[nodiscard]] auto subtree_aggregate(const Node* node) const ->
+      typename A::value_type;
 
     /**
-     * @brief Gets how deep the given node is
+     * @brief Aggregate of the entries of a subtree between lo and hi (a null
+     * bound is unbounded), bounds included or not, in O(height)
      */
-    [[nodiscard]] auto getdepth(const Node& node) const -> usize;
+    [[nodiscard]] auto range_aggregate(
+      const Node* node,
+      const K* lo,
+      const K* hi,
+      bool inclusive
+    ) const -> typename A::value_type;
 
     /**
-     * @brief Gets the node with the given key, or what its parent should be
+     * @brief diff of the subtree a_node of this map, covering the keys
+     * between lo and hi, against the same key range of b
      */
-    auto index(Node* node, const K& key) const -> Node*;
+    template<typename Fn>
+    auto diff_range(
+      const Node* a_node,
+      const AVLmap& b,
+      const K* lo,
+      const K* hi,
+      Fn& fn
+    ) const -> void;
 
-    auto balanced_index(Node* node, const K& key) const -> Node*;
+    /**
+     * @brief Reports every entry of b between lo and hi as missing from a
+     */
+    template<typename Fn>
+    static auto diff_missing(Node* node, const K* lo, const K* hi, Fn& fn)
+      -> void;
 
-    auto rotate_right(Node* node) -> Node*;
+    /**
+     * @brief export_columns of the entries between the bounds (none if null)
+     */
+    auto export_range(
+      const K* lo,
+      const K* hi,
+      std::vector<K>& keys,
+      std::vector<V>& values
+    ) const -> void;
 
-    auto rotate_left(Node* node) -> Node*;
+    /**
+     * @brief Appends the entries of a subtree between the bounds (none if
+     * null) to the columns in key order, without recursion
+     */
+    static auto export_subtree(
+      const Node* node,
+      const K* lo,
+      const K* hi,
+      std::vector<K>& keys,
+      std::vector<V>& values
+    ) -> void;
 
-    [[nodiscard]] auto node_ref(Node& node) -> Node*&;
+    /**
+     * @brief Builds a perfectly balanced subtree of n nodes, make() is called
+     * once per node in key order and must return a new node with its key and
+     * value set. rank is set to the height and balance to the height
+     * difference, B::rebuilt makes them valid for the policy
+     */
+    template<typename Make>
+    [[nodiscard]] auto build_balanced(usize n, Node* parent, Make& make)
+      -> Node*;
 
     /**
      * @brief Root of the tree
@@ -468,13 +1977,83 @@ namespace CS280 {
      * @brief Size of the tree
      */
     usize count = 0;
+
+    /**
+     * @brief Prefix shared by all keys (see KeyTraits)
+     */
+    [[no_unique_address]] SharedPrefix<K, windowed> shared{};
+
+    /**
+     * @brief Node whose value may have been written since (see aggregate)
+     */
+    [[no_unique_address]] PendingWrite<A, Node> pending{};
+
+    /**
+     * @brief Inline entries (see N)
+     */
+    [[no_unique_address]] EntrySlots<KeyValue, N> inlined{};
+
+    /**
+     * @brief State of the run time options (see O)
+     */
+    [[no_unique_address]] OptionState<Node, O> options{};
+
+    /**
+     * @brief Value slab (see SlabValues), an empty placeholder otherwise
+     */
+    [[no_unique_address]] std::conditional_t<
+      slab_values,
+      ValueSlab<V>,
+      InlineValues
+    > values{};
+
+#ifdef AVLMAP_STATS
+    /**
+     * @brief Structural counters, updated by const searches too
+     */
+    mutable AVLmapCounts<StatCounter> counters{};
+#endif
+
+#ifdef AVLMAP_LATENCY
+    /**
+     * @brief Latency histograms, of the non const operations only
+     */
+    AVLmapLatency latencies{};
+#endif
   };
 
   /**
    * @brief Prints out the bst map to the stream
    */
-  template<typename K, typename V>
-  auto operator<<(std::ostream& os, const AVLmap<K, V>& map) -> std::ostream&;
+  template<
+    typename K,
+    typename V,
+    typename A,
+    typename B,
+    usize N,
+    typename S,
+    typename O>
+  auto operator<<(std::ostream& os, const AVLmap<K, V, A, B, N, S, O>& map)
+    -> std::ostream&;
+
+  /**
+   * @brief AVLmap keeping its first N entries inline (see AVLmap)
+   */
+  template<typename K, typename V, usize N = 16>
+  using SmallAVLmap = AVLmap<K, V, NoAugment, AVLBalance, N>;
+
+  /**
+   * @brief AVLmap with the run time options compiled in (see RuntimeOptions)
+   */
+  template<
+    typename K,
+    typename V,
+    typename A = NoAugment,
+    typename B = AVLBalance,
+    usize N = 0,
+    typename S = InlineValues
+  >
+  using TunableAVLmap = AVLmap<K, V, A, B, N, S, RuntimeOptions>;
 } // namespace CS280
 
 #ifndef AVLMAP_CPP
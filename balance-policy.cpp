@@ -0,0 +1,863 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <random>
+#include <vector>
+
+#ifndef BALANCE_POLICY_H
+#include "balance-policy.h"
+#endif
+
+#ifndef BALANCE_POLICY_CPP
+#define BALANCE_POLICY_CPP
+
+namespace CS280 {
+
+  template<typename Tree>
+  auto AVLBalance::linked(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    node->rank = 1;
+    node->balance = 0;
+    return retrace(tree, node->parent);
+  }
+
+  template<typename Tree>
+  auto AVLBalance::unlinked(
+    Tree& tree,
+    typename Tree::Node* parent,
+    bool,
+    const typename Tree::Node&
+  ) -> usize {
+    return retrace(tree, parent);
+  }
+
+  template<typename Tree>
+  auto AVLBalance::rebuilt(Tree&) -> void {}
+
+  template<typename Tree>
+  auto AVLBalance::accessed(Tree&, typename Tree::Node*) -> usize {
+    return 0;
+  }
+
+  template<typename Tree>
+  auto AVLBalance::valid(const Tree& tree) -> bool {
+    return tree.root == nullptr or checked_height(tree.root) != 0;
+  }
+
+  template<typename Node>
+  auto AVLBalance::checked_height(const Node* node) -> usize {
+    if (node == nullptr) {
+      return 0;
+    }
+
+    const usize left = checked_height(node->left);
+    const usize right = checked_height(node->right);
+    const int balance = static_cast<int>(left) - static_cast<int>(right);
+
+    if ((node->left and left == 0) or (node->right and right == 0)
+        or balance < -1 or balance > 1 or node->balance != balance
+        or node->rank != 1 + std::max(left, right)) {
+      return 0;
+    }
+
+    return node->rank;
+  }
+
+  template<typename Node>
+  auto AVLBalance::height(const Node* node) -> usize {
+    return node ? node->rank : 0;
+  }
+
+  template<typename Node>
+  auto AVLBalance::update(Node* node) -> void {
+    // spelled out, the links of a tree may only convert to Node*
+    const usize left = height<Node>(node->left);
+    const usize right = height<Node>(node->right);
+
+    node->rank = 1 + std::max(left, right);
+    node->balance = static_cast<int>(left) - static_cast<int>(right);
+  }
+
+  template<typename Tree>
+  auto AVLBalance::retrace(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    usize steps = 0;
+
+    while (node) {
+      steps++;
+      const usize before = node->rank;
+      update(node);
+
+      if (node->balance > 1 or node->balance < -1) {
+        // a tie in the child (only after an erase) takes the single rotation
+        if (node->balance > 1) {
+          node = node->left->balance < 0 ? tree.rotate_left_right(node)
+                                         : tree.rotate_right(node);
+        } else {
+          node = node->right->balance > 0 ? tree.rotate_right_left(node)
+                                          : tree.rotate_left(node);
+        }
+
+        update<typename Tree::Node>(node->left);
+        update<typename Tree::Node>(node->right);
+        update(node);
+      }
+
+      // the subtree kept its height, nothing above changes
+      if (node->rank == before) {
+        break;
+      }
+
+      node = node->parent;
+    }
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto RedBlackBalance::linked(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    using Node = typename Tree::Node;
+
+    node->rank = 0;
+    node->balance = 1;
+
+    usize steps = 1;
+
+    // a red parent is never the root, so the grandparent exists
+    while (red(node->parent)) {
+      steps++;
+
+      Node* const parent = node->parent;
+      Node* const grandparent = parent->parent;
+      Node* const uncle = parent == grandparent->left ? grandparent->right
+                                                      : grandparent->left;
+
+      if (red(uncle)) {
+        parent->balance = 0;
+        uncle->balance = 0;
+        grandparent->balance = 1;
+        node = grandparent;
+        continue;
+      }
+
+      Node* top = nullptr;
+
+      if (parent == grandparent->left) {
+        top = node == parent->left ? tree.rotate_right(grandparent)
+                                   : tree.rotate_left_right(grandparent);
+      } else {
+        top = node == parent->right ? tree.rotate_left(grandparent)
+                                    : tree.rotate_right_left(grandparent);
+      }
+
+      top->balance = 0;
+      grandparent->balance = 1;
+      break;
+    }
+
+    tree.root->balance = 0;
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto RedBlackBalance::unlinked(
+    Tree& tree,
+    typename Tree::Node* parent,
+    bool left,
+    const typename Tree::Node& node
+  ) -> usize {
+    using Node = typename Tree::Node;
+
+    // removing a red position leaves every black count as it was
+    if (node.balance == 1) {
+      return 0;
+    }
+
+    Node* child = parent ? (left ? parent->left : parent->right) : tree.root;
+    usize steps = 0;
+
+    // child is "doubly black", its sibling side has one black too many
+    while (child != tree.root and not red(child)) {
+      steps++;
+
+      Node* sibling = left ? parent->right : parent->left;
+
+      if (red(sibling)) {
+        sibling->balance = 0;
+        parent->balance = 1;
+
+        if (left) {
+          tree.rotate_left(parent);
+          sibling = parent->right;
+        } else {
+          tree.rotate_right(parent);
+          sibling = parent->left;
+        }
+      }
+
+      if (not red(sibling->left) and not red(sibling->right)) {
+        sibling->balance = 1;
+        child = parent;
+        parent = child->parent;
+        left = parent and child == parent->left;
+        continue;
+      }
+
+      if (left) {
+        if (not red(sibling->right)) {
+          sibling->left->balance = 0;
+          sibling->balance = 1;
+          sibling = tree.rotate_right(sibling);
+        }
+
+        sibling->balance = parent->balance;
+        parent->balance = 0;
+        sibling->right->balance = 0;
+        tree.rotate_left(parent);
+      } else {
+        if (not red(sibling->left)) {
+          sibling->right->balance = 0;
+          sibling->balance = 1;
+          sibling = tree.rotate_left(sibling);
+        }
+
+        sibling->balance = parent->balance;
+        parent->balance = 0;
+        sibling->left->balance = 0;
+        tree.rotate_right(parent);
+      }
+
+      child = tree.root;
+      break;
+    }
+
+    if (child) {
+      child->balance = 0;
+    }
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto RedBlackBalance::rebuilt(Tree& tree) -> void {
+    if (tree.root == nullptr) {
+      return;
+    }
+
+    // every leaf is on one of the two lowest levels, colouring the lowest
+    // one red (when it is not the root) keeps the black counts equal
+    paint(tree.root, 0, tree.root->rank - 1);
+    tree.root->balance = 0;
+  }
+
+  template<typename Tree>
+  auto RedBlackBalance::accessed(Tree&, typename Tree::Node*) -> usize {
+    return 0;
+  }
+
+  template<typename Tree>
+  auto RedBlackBalance::valid(const Tree& tree) -> bool {
+    return not red(tree.root) and black_height(tree.root) != 0;
+  }
+
+  template<typename Node>
+  auto RedBlackBalance::black_height(const Node* node) -> usize {
+    if (node == nullptr) {
+      return 1;
+    }
+
+    if (red(node) and (red(node->left) or red(node->right))) {
+      return 0;
+    }
+
+    const usize left = black_height(node->left);
+
+    if (left == 0 or left != black_height(node->right)) {
+      return 0;
+    }
+
+    return left + (red(node) ? 0 : 1);
+  }
+
+  template<typename Node>
+  auto RedBlackBalance::red(const Node* node) -> bool {
+    return node and node->balance == 1;
+  }
+
+  template<typename Node>
+  auto RedBlackBalance::paint(
+    Node* node,
+    usize depth,
+    usize red_depth
+  ) -> void {
+    if (node == nullptr) {
+      return;
+    }
+
+    node->balance = depth == red_depth ? 1 : 0;
+    paint(node->left, depth + 1, red_depth);
+    paint(node->right, depth + 1, red_depth);
+  }
+
+  template<typename Tree>
+  auto WAVLBalance::linked(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    using Node = typename Tree::Node;
+
+    node->rank = 1;
+    node->balance = 0;
+
+    usize steps = 1;
+    Node* parent = node->parent;
+
+    // node is a 0-child (same rank as its parent)
+    while (parent and parent->rank == node->rank) {
+      steps++;
+
+      Node* const sibling = node == parent->left ? parent->right : parent->left;
+
+      if (parent->rank - rank(sibling) == 1) {
+        parent->rank++;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      // parent is 0,2: rotate, the inner child of node decides how
+      if (node == parent->left) {
+        Node* const inner = node->right;
+
+        if (node->rank - rank(inner) == 2) {
+          tree.rotate_right(parent);
+          parent->rank--;
+        } else {
+          tree.rotate_left_right(parent);
+          inner->rank++;
+          node->rank--;
+          parent->rank--;
+        }
+      } else {
+        Node* const inner = node->left;
+
+        if (node->rank - rank(inner) == 2) {
+          tree.rotate_left(parent);
+          parent->rank--;
+        } else {
+          tree.rotate_right_left(parent);
+          inner->rank++;
+          node->rank--;
+          parent->rank--;
+        }
+      }
+      break;
+    }
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto WAVLBalance::unlinked(
+    Tree& tree,
+    typename Tree::Node* parent,
+    bool left,
+    const typename Tree::Node&
+  ) -> usize {
+    using Node = typename Tree::Node;
+
+    if (parent == nullptr) {
+      return 0;
+    }
+
+    usize steps = 1;
+    Node* child = left ? parent->left : parent->right;
+
+    // a leaf of rank 2 is not allowed
+    if (not parent->left and not parent->right and parent->rank == 2) {
+      parent->rank = 1;
+      child = parent;
+      parent = child->parent;
+    }
+
+    // child is a 3-child, its sibling is never null
+    while (parent and parent->rank - rank(child) == 3) {
+      steps++;
+
+      const bool child_left = parent->left == child;
+      Node* const sibling = child_left ? parent->right : parent->left;
+
+      if (parent->rank - rank(sibling) == 2) {
+        parent->rank--;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+
+      if (sibling->rank - rank(sibling->left) == 2
+          and sibling->rank - rank(sibling->right) == 2) {
+        sibling->rank--;
+        parent->rank--;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+
+      Node* const outer = child_left ? sibling->right : sibling->left;
+      Node* const inner = child_left ? sibling->left : sibling->right;
+
+      if (sibling->rank - rank(outer) == 1) {
+        if (child_left) {
+          tree.rotate_left(parent);
+        } else {
+          tree.rotate_right(parent);
+        }
+
+        sibling->rank++;
+        parent->rank--;
+
+        if (not parent->left and not parent->right) {
+          parent->rank--;
+        }
+      } else {
+        if (child_left) {
+          tree.rotate_right_left(parent);
+        } else {
+          tree.rotate_left_right(parent);
+        }
+
+        inner->rank += 2;
+        sibling->rank--;
+        parent->rank -= 2;
+      }
+      break;
+    }
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto WAVLBalance::rebuilt(Tree&) -> void {}
+
+  template<typename Tree>
+  auto WAVLBalance::accessed(Tree&, typename Tree::Node*) -> usize {
+    return 0;
+  }
+
+  template<typename Tree>
+  auto WAVLBalance::valid(const Tree& tree) -> bool {
+    return ranked(tree.root);
+  }
+
+  template<typename Node>
+  auto WAVLBalance::ranked(const Node* node) -> bool {
+    if (node == nullptr) {
+      return true;
+    }
+
+    if (not node->left and not node->right and node->rank != 1) {
+      return false;
+    }
+
+    for (const Node* child : {node->left, node->right}) {
+      if (rank(child) >= node->rank or node->rank - rank(child) > 2) {
+        return false;
+      }
+    }
+
+    return ranked(node->left) and ranked(node->right);
+  }
+
+  template<typename Node>
+  auto WAVLBalance::rank(const Node* node) -> usize {
+    return node ? node->rank : 0;
+  }
+
+  template<typename Tree>
+  auto TreapBalance::linked(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    node->rank = priority();
+    node->balance = 0;
+
+    usize steps = 1;
+
+    while (node->parent and node->parent->rank < node->rank) {
+      steps++;
+
+      if (node == node->parent->left) {
+        tree.rotate_right(node->parent);
+      } else {
+        tree.rotate_left(node->parent);
+      }
+    }
+
+    return steps;
+  }
+
+  template<typename Tree>
+  auto TreapBalance::unlinked(
+    Tree&,
+    typename Tree::Node*,
+    bool,
+    const typename Tree::Node&
+  ) -> usize {
+    // the spliced out position had at most one child, which moved up under
+    // a node of higher priority
+    return 0;
+  }
+
+  template<typename Tree>
+  auto TreapBalance::rebuilt(Tree& tree) -> void {
+    using Node = typename Tree::Node;
+
+    std::vector<Node*> nodes{};
+    if (tree.root) {
+      nodes.push_back(tree.root);
+    }
+
+    // level order, so handing out sorted priorities keeps the heap order
+    for (usize i = 0; i < nodes.size(); i++) {
+      if (nodes[i]->left) {
+        nodes.push_back(nodes[i]->left);
+      }
+      if (nodes[i]->right) {
+        nodes.push_back(nodes[i]->right);
+      }
+    }
+
+    std::vector<usize> priorities(nodes.size());
+    std::generate(priorities.begin(), priorities.end(), priority);
+    std::sort(priorities.begin(), priorities.end(), std::greater<>{});
+
+    for (usize i = 0; i < nodes.size(); i++) {
+      nodes[i]->rank = priorities[i];
+      nodes[i]->balance = 0;
+    }
+  }
+
+  template<typename Tree>
+  auto TreapBalance::accessed(Tree&, typename Tree::Node*) -> usize {
+    return 0;
+  }
+
+  template<typename Tree>
+  auto TreapBalance::valid(const Tree& tree) -> bool {
+    return heap_ordered(tree.root);
+  }
+
+  template<typename Node>
+  auto TreapBalance::heap_ordered(const Node* node) -> bool {
+    if (node == nullptr) {
+      return true;
+    }
+
+    for (const Node* child : {node->left, node->right}) {
+      if (child and child->rank > node->rank) {
+        return false;
+      }
+    }
+
+    return heap_ordered(node->left) and heap_ordered(node->right);
+  }
+
+  inline auto TreapBalance::priority() -> usize {
+    thread_local std::mt19937_64 generator{std::random_device{}()};
+    return static_cast<usize>(generator());
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::linked(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    using Node = typename Tree::Node;
+
+    node->rank = 0;
+    node->balance = 0;
+
+    // the peak is an i32, saturating only delays the halving rebuild
+    const usize peak = std::min<usize>(
+      std::max(static_cast<usize>(tree.root->balance), tree.count),
+      INT32_MAX
+    );
+    tree.root->balance = static_cast<i32>(peak);
+
+    const usize bound = limit(peak);
+    const usize level = depth(node);
+
+    if (level <= bound) {
+      return level;
+    }
+
+    // the deepest ancestor whose bigger child holds over 2/3 of its nodes and
+    // that can be rebuilt within the levels left below it, one must exist
+    // past this depth
+    usize nodes = 1;
+    usize steps = level;
+    usize at = level;
+    Node* child = node;
+
+    for (Node* top = node->parent; top; child = top, top = top->parent) {
+      at--;
+      const Node* sibling = child == top->left ? top->right : top->left;
+      const usize total = nodes + 1 + size(sibling, SIZE_MAX);
+      steps += total - nodes;
+
+      if (5 * nodes > 3 * total and levels(total) <= bound - at + 1) {
+        return steps + rebuild(tree, top, bound - at + 1);
+      }
+
+      nodes = total;
+    }
+
+    return steps + rebuild(tree, tree.root, bound);
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::unlinked(
+    Tree& tree,
+    typename Tree::Node* parent,
+    bool,
+    const typename Tree::Node& node
+  ) -> usize {
+    if (tree.root == nullptr) {
+      return 0;
+    }
+
+    // the only child of the root took its place
+    if (parent == nullptr) {
+      tree.root->balance = node.balance;
+    }
+
+    if (2 * tree.count >= static_cast<usize>(tree.root->balance)) {
+      return 0;
+    }
+
+    const usize steps = rebuild(tree, tree.root, limit(tree.count));
+    tree.root->balance = static_cast<i32>(tree.count);
+    return steps;
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::rebuilt(Tree& tree) -> void {
+    using Node = typename Tree::Node;
+
+    std::vector<Node*> nodes{};
+    if (tree.root) {
+      nodes.push_back(tree.root);
+    }
+
+    for (usize i = 0; i < nodes.size(); i++) {
+      nodes[i]->rank = 0;
+      nodes[i]->balance = 0;
+
+      for (Node* child : {nodes[i]->left, nodes[i]->right}) {
+        if (child) {
+          nodes.push_back(child);
+        }
+      }
+    }
+
+    if (tree.root) {
+      tree.root->balance = static_cast<i32>(
+        std::min<usize>(tree.count, INT32_MAX)
+      );
+    }
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::accessed(Tree& tree, typename Tree::Node* node)
+    -> usize {
+    using Node = typename Tree::Node;
+
+    const usize hits = node->rank += node->rank != SIZE_MAX;
+
+    // a hotter parent means the node already is where it belongs, which
+    // settles most of the checks once the counts grew
+    if (hits < THRESHOLD or (hits & (hits - 1)) != 0 or node == tree.root
+        or node->parent->rank >= hits) {
+      return 0;
+    }
+
+    // climb past colder ancestors while the subtree stays within the budget
+    // of this access
+    const usize cap = hits <= SIZE_MAX / BUDGET ? hits * BUDGET
+                                                      : SIZE_MAX;
+    usize nodes = size(node, cap);
+    Node* top = node;
+
+    while (top->parent and top->parent->rank < hits) {
+      const Node* const sibling = top == top->parent->left
+                                ? top->parent->right
+                                : top->parent->left;
+      const usize total = nodes + 1 + size(sibling, cap - nodes);
+
+      if (total > cap) {
+        break;
+      }
+
+      nodes = total;
+      top = top->parent;
+    }
+
+    if (top == node) {
+      return 0;
+    }
+
+    // the subtree already fits in the levels left, so will its rebuild
+    const usize bound = limit(static_cast<usize>(
+      tree.root->balance
+    ));
+
+    return rebuild(tree, top, bound - depth(top) + 1);
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::valid(const Tree& tree) -> bool {
+    if (tree.root == nullptr) {
+      return true;
+    }
+
+    const usize peak = static_cast<usize>(tree.root->balance);
+    return tree.count <= peak and height(tree.root) <= limit(peak);
+  }
+
+  inline auto AdaptiveBalance::levels(usize n) -> usize {
+    usize bits = 0;
+
+    for (; n; n >>= 1) {
+      bits++;
+    }
+
+    return bits;
+  }
+
+  inline auto AdaptiveBalance::limit(usize n) -> usize {
+    return (3 * levels(n) + 1) / 2;
+  }
+
+  template<typename Node>
+  auto AdaptiveBalance::depth(const Node* node) -> usize {
+    usize level = 1;
+
+    for (; node->parent; node = node->parent) {
+      level++;
+    }
+
+    return level;
+  }
+
+  template<typename Node>
+  auto AdaptiveBalance::size(const Node* node, usize cap)
+    -> usize {
+    if (node == nullptr) {
+      return 0;
+    }
+
+    if (cap == 0) {
+      return 1;
+    }
+
+    const usize left = 1 + size(node->left, cap - 1);
+
+    if (left > cap) {
+      return left;
+    }
+
+    return left + size(node->right, cap - left);
+  }
+
+  template<typename Node>
+  auto AdaptiveBalance::height(const Node* node) -> usize {
+    if (node == nullptr) {
+      return 0;
+    }
+
+    return 1 + std::max(height(node->left), height(node->right));
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::rebuild(
+    Tree& tree,
+    typename Tree::Node* top,
+    usize levels
+  ) -> usize {
+    using Node = typename Tree::Node;
+
+    Node* const parent = top->parent;
+    Node** const link = parent == nullptr ? &tree.root
+                      : top == parent->left ? &parent->left
+                                            : &parent->right;
+    const i32 peak = top->balance;
+
+    // in order, by walking down the left spines
+    std::vector<Node*> nodes{};
+    std::vector<Node*> pending{};
+
+    for (Node* node = top; node or not pending.empty();) {
+      for (; node; node = node->left) {
+        pending.push_back(node);
+      }
+
+      node = pending.back();
+      pending.pop_back();
+      nodes.push_back(node);
+      node = node->right;
+    }
+
+    // every node weighs its count plus one, so cold ones still split evenly
+    std::vector<usize> weights(nodes.size() + 1, 0);
+    for (usize i = 0; i < nodes.size(); i++) {
+      weights[i + 1] = weights[i] + std::min(nodes[i]->rank, SIZE_MAX / 2 /
+                                             nodes.size()) + 1;
+    }
+
+    *link = build<Tree>(nodes, weights, 0, nodes.size(), levels, parent);
+
+    for (Node* node : nodes) {
+      node->balance = 0;
+    }
+
+    (*link)->balance = peak;
+
+    return nodes.size();
+  }
+
+  template<typename Tree>
+  auto AdaptiveBalance::build(
+    const std::vector<typename Tree::Node*>& nodes,
+    const std::vector<usize>& weights,
+    usize lo,
+    usize hi,
+    usize levels,
+    typename Tree::Node* parent
+  ) -> typename Tree::Node* {
+    using Node = typename Tree::Node;
+
+    if (lo == hi) {
+      return nullptr;
+    }
+
+    // the node holding the middle weight, moved so no side gets more nodes
+    // than the levels below can hold
+    const usize half = weights[lo] + (weights[hi] - weights[lo]) / 2;
+    usize middle = static_cast<usize>(
+      std::upper_bound(&weights[lo + 1], &weights[hi], half) - &weights[1]
+    );
+
+    const usize side = levels > 64 ? SIZE_MAX
+                                         : (usize{1} << (levels - 1)) - 1;
+    middle = std::min(middle, lo + side);
+    middle = std::max(middle, hi - 1 - std::min(side, hi - 1 - lo));
+
+    Node* const node = nodes[middle];
+    node->parent = parent;
+    node->left = build<Tree>(nodes, weights, lo, middle, levels - 1, node);
+    node->right = build<Tree>(nodes, weights, middle + 1, hi, levels - 1, node);
+    Tree::recombine(node);
+
+    return node;
+  }
+} // namespace CS280
+
+#endif
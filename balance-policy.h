@@ -0,0 +1,337 @@
+#pragma once
+
+#ifndef BALANCE_POLICY_H
+#define BALANCE_POLICY_H
+
+#include <vector>
+
+#include "int-types.h"
+
+namespace CS280 {
+
+  /**
+   * @brief Balancing policies of an AVLmap. The map does the plain binary
+   * search tree work and calls the policy after every structural change:
+   *
+   *   linked(tree, node)                   node was linked as a new leaf (or
+   *                                        as the root), its balancing data
+   *                                        is still unset
+   *   unlinked(tree, parent, left, node)   node was removed, the subtree
+   *                                        that took its place is the left or
+   *                                        right child of parent (null when
+   *                                        the root was removed). node still
+   *                                        holds the balancing data of the
+   *                                        removed position
+   *   rebuilt(tree)                        the tree was built perfectly
+   *                                        balanced with rank set to the
+   *                                        height (a leaf is 1) and balance to
+   *                                        the height difference
+   *   accessed(tree, node)                 a find or operator[] of a mutable
+   *                                        map hit node
+   *   valid(tree)                          checks the invariant of the policy
+   *                                        (see AVLmap::sanityCheck)
+   *
+   * linked and unlinked return how many nodes they looked at, accessed how
+   * many it relinked (0 for all but AdaptiveBalance). Every node has
+   * a rank and a balance field whose meaning belongs to the policy. The
+   * rotations of the map (rotate_left, rotate_right, rotate_left_right and
+   * rotate_right_left) are counted in AVLmap::stats.
+   */
+
+  /**
+   * @brief AVL: the heights of the two subtrees of a node differ by at most
+   * one. Lowest trees, so the fastest lookups, but deletes may rotate at
+   * every level. rank is the height (a leaf is 1), balance the left height
+   * minus the right height
+   */
+  struct AVLBalance {
+    template<typename Tree>
+    static auto linked(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    static auto unlinked(
+      Tree& tree,
+      typename Tree::Node* parent,
+      bool left,
+      const typename Tree::Node& node
+    ) -> usize;
+
+    template<typename Tree>
+    static auto rebuilt(Tree& tree) -> void;
+
+    template<typename Tree>
+    static auto accessed(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    [[nodiscard]] static auto valid(const Tree& tree) -> bool;
+
+  private:
+
+    /**
+     * @brief Height of a possibly null subtree
+     */
+    template<typename Node>
+    [[nodiscard]] static auto height(const Node* node) -> usize;
+
+    /**
+     * @brief Recomputes rank and balance from the children
+     */
+    template<typename Node>
+    static auto update(Node* node) -> void;
+
+    /**
+     * @brief Height of a subtree if its ranks and balances are right, 0
+     * otherwise
+     */
+    template<typename Node>
+    [[nodiscard]] static auto checked_height(const Node* node) -> usize;
+
+    /**
+     * @brief Walks up from node restoring the balance, stops once a subtree
+     * keeps its height
+     */
+    template<typename Tree>
+    static auto retrace(Tree& tree, typename Tree::Node* node) -> usize;
+  };
+
+  /**
+   * @brief Red-black: no red node has a red child and every path down to a
+   * null child passes as many black nodes. Up to twice as high as AVL but at
+   * most three rotations per erase. balance is 1 for red and 0 for black,
+   * rank is unused
+   */
+  struct RedBlackBalance {
+    template<typename Tree>
+    static auto linked(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    static auto unlinked(
+      Tree& tree,
+      typename Tree::Node* parent,
+      bool left,
+      const typename Tree::Node& node
+    ) -> usize;
+
+    template<typename Tree>
+    static auto rebuilt(Tree& tree) -> void;
+
+    template<typename Tree>
+    static auto accessed(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    [[nodiscard]] static auto valid(const Tree& tree) -> bool;
+
+  private:
+
+    /**
+     * @brief Is the node red (null children are black)
+     */
+    template<typename Node>
+    [[nodiscard]] static auto red(const Node* node) -> bool;
+
+    /**
+     * @brief Black nodes on every path down from node (null counts as one),
+     * 0 if the paths differ or a red node has a red child
+     */
+    template<typename Node>
+    [[nodiscard]] static auto black_height(const Node* node) -> usize;
+
+    /**
+     * @brief Colours the nodes at the given depth red and the others black
+     */
+    template<typename Node>
+    static auto paint(Node* node, usize depth, usize red_depth)
+      -> void;
+  };
+
+  /**
+   * @brief Weak AVL (rank-balanced): every rank difference is 1 or 2 and
+   * leaves have rank 1. With inserts only it is an AVL tree, erases need at
+   * most two rotations and the height never exceeds that of a red-black tree
+   * holding the same keys. rank is the rank (a leaf is 1), balance is unused
+   */
+  struct WAVLBalance {
+    template<typename Tree>
+    static auto linked(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    static auto unlinked(
+      Tree& tree,
+      typename Tree::Node* parent,
+      bool left,
+      const typename Tree::Node& node
+    ) -> usize;
+
+    template<typename Tree>
+    static auto rebuilt(Tree& tree) -> void;
+
+    template<typename Tree>
+    static auto accessed(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    [[nodiscard]] static auto valid(const Tree& tree) -> bool;
+
+  private:
+
+    /**
+     * @brief Rank of a possibly null subtree (null is 0)
+     */
+    template<typename Node>
+    [[nodiscard]] static auto rank(const Node* node) -> usize;
+
+    /**
+     * @brief Are all rank differences of the subtree 1 or 2 and its leaves
+     * of rank 1
+     */
+    template<typename Node>
+    [[nodiscard]] static auto ranked(const Node* node) -> bool;
+  };
+
+  /**
+   * @brief Treap: every node gets a random priority and the tree is a heap
+   * on them, which makes it shaped like a random insertion order whatever
+   * the real one. Expected O(log n) height, about one rotation per insert and
+   * none per erase. rank is the priority, balance is unused
+   */
+  struct TreapBalance {
+    template<typename Tree>
+    static auto linked(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    static auto unlinked(
+      Tree& tree,
+      typename Tree::Node* parent,
+      bool left,
+      const typename Tree::Node& node
+    ) -> usize;
+
+    template<typename Tree>
+    static auto rebuilt(Tree& tree) -> void;
+
+    template<typename Tree>
+    static auto accessed(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    [[nodiscard]] static auto valid(const Tree& tree) -> bool;
+
+  private:
+
+    /**
+     * @brief Random priority, from a generator of the calling thread
+     */
+    [[nodiscard]] static auto priority() -> usize;
+
+    /**
+     * @brief Is no node of the subtree of higher priority than its parent
+     */
+    template<typename Node>
+    [[nodiscard]] static auto heap_ordered(const Node* node) -> bool;
+  };
+
+  /**
+   * @brief Access adaptive: counts the hits of every node and, each time the
+   * count of one doubles (from 8 on), rebuilds the subtree of its highest
+   * colder ancestor holding at most twice as many nodes as the count,
+   * weighted by the counts so hot keys move toward the root. That bounds the
+   * work to a few nodes per hit. Depth never exceeds 1.5 times the levels of
+   * a perfectly balanced tree of the size the map peaked at since its last
+   * full rebuild: an insert linking a node deeper than that rebuilds a
+   * subtree that is out of balance (scapegoat style), an erase halving the
+   * size rebuilds it all. No rotations. rank is the access count, balance is
+   * that peak size at the root and 0 elsewhere. Only finds on a mutable map
+   * count
+   */
+  struct AdaptiveBalance {
+    template<typename Tree>
+    static auto linked(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    static auto unlinked(
+      Tree& tree,
+      typename Tree::Node* parent,
+      bool left,
+      const typename Tree::Node& node
+    ) -> usize;
+
+    template<typename Tree>
+    static auto rebuilt(Tree& tree) -> void;
+
+    template<typename Tree>
+    static auto accessed(Tree& tree, typename Tree::Node* node) -> usize;
+
+    template<typename Tree>
+    [[nodiscard]] static auto valid(const Tree& tree) -> bool;
+
+  private:
+
+    /**
+     * @brief Access count at which restructuring starts
+     */
+    static constexpr usize THRESHOLD = 8;
+
+    /**
+     * @brief Nodes a restructuring may rebuild per access counted
+     */
+    static constexpr usize BUDGET = 2;
+
+    /**
+     * @brief Levels of a perfectly balanced tree of n nodes
+     */
+    [[nodiscard]] static auto levels(usize n) -> usize;
+
+    /**
+     * @brief Deepest level allowed in a tree that peaked at n nodes
+     */
+    [[nodiscard]] static auto limit(usize n) -> usize;
+
+    /**
+     * @brief Level of node, the root is 1
+     */
+    template<typename Node>
+    [[nodiscard]] static auto depth(const Node* node) -> usize;
+
+    /**
+     * @brief Nodes in a subtree, or anything above cap once it has more
+     */
+    template<typename Node>
+    [[nodiscard]] static auto size(const Node* node, usize cap)
+      -> usize;
+
+    /**
+     * @brief Levels of a subtree, walks all of it
+     */
+    template<typename Node>
+    [[nodiscard]] static auto height(const Node* node) -> usize;
+
+    /**
+     * @brief Relinks the subtree of top weighted by the access counts within
+     * the given number of levels, returns how many nodes it holds
+     */
+    template<typename Tree>
+    static auto rebuild(
+      Tree& tree,
+      typename Tree::Node* top,
+      usize levels
+    ) -> usize;
+
+    /**
+     * @brief Links nodes [lo, hi) under parent, rooted at the node holding
+     * the middle of their total weight as far as the levels allow. The
+     * aggregates of the tree are recombined bottom up as the nodes are linked
+     */
+    template<typename Tree>
+    [[nodiscard]] static auto build(
+      const std::vector<typename Tree::Node*>& nodes,
+      const std::vector<usize>& weights,
+      usize lo,
+      usize hi,
+      usize levels,
+      typename Tree::Node* parent
+    ) -> typename Tree::Node*;
+  };
+} // namespace CS280
+
+#ifndef BALANCE_POLICY_CPP
+#include "balance-policy.cpp"
+#endif
+#endif
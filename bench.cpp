@@ -0,0 +1,855 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "avl-map.h"
+#include "radix-map.h"
+
+/**
+ * Workload benchmarks for AVLmap under each balancing policy (AVLmap,
+ * red-black, WAVL, treap, adaptive), AVLmap with a hot key cache (cached)
+ * or a counting Bloom filter (filtered), AVLmap compacted in key order or
+ * van Emde Boas order after the prefill (compacted, vEB), RadixMap (radix)
+ * and std::map and std::unordered_map as baselines.
+ *
+ * usage: bench [--workload NAME] [--map NAME] [SIZE...]
+ *        bench --memory [SIZE...]
+ *
+ * Any size from 1K up to 100M is accepted, every workload runs at most 1M
+ * timed operations regardless of the size. The height column is the one of
+ * the tree after the run. rot/op and visit/op, the rotations and the nodes
+ * visited by searches per timed operation, are only filled in when built
+ * with AVLMAP_STATS.
+ *
+ * --memory fills an AVLmap per key / value type instead and reports
+ * memory_usage() next to the peak RSS growth, both per entry.
+ */
+
+namespace {
+
+  using Key = u64;
+  using Value = u64;
+
+  /**
+   * @brief AVLmap under another balancing policy
+   */
+  template<typename B>
+  using Policy = CS280::AVLmap<Key, Value, CS280::NoAugment, B>;
+
+  /**
+   * @brief Operations every benchmarked map provides
+   */
+  template<typename Map>
+  struct Ops;
+
+  template<typename A, typename B, usize N, typename S, typename O>
+  struct Ops<CS280::AVLmap<Key, Value, A, B, N, S, O>> {
+    using Map = CS280::AVLmap<Key, Value, A, B, N, S, O>;
+
+#ifdef AVLMAP_STATS
+    static constexpr bool counted = true;
+#else
+    static constexpr bool counted = false;
+#endif
+
+    static auto insert(Map& map, Key key, Value value) -> void {
+      map[key] = value;
+    }
+
+    static auto find(Map& map, Key key) -> bool {
+      return map.find(key) != map.end();
+    }
+
+    static auto erase(Map& map, Key key) -> void {
+      map.erase(map.find(key));
+    }
+
+    static auto scan(Map& map, Key from, usize length) -> Value {
+      Value sum = 0;
+      typename Map::iterator it = map.find(from);
+      for (usize i = 0; i < length and it != map.end(); i++, ++it) {
+        sum += it->Value();
+      }
+      return sum;
+    }
+
+    static auto rotations(const Map& map) -> u64 {
+      const CS280::AVLmapStats stats = map.stats();
+      return stats.single_rotations + stats.double_rotations;
+    }
+
+    static auto visited(const Map& map) -> u64 {
+      return map.stats().nodes_visited;
+    }
+
+    static auto height(const Map& map) -> usize {
+      return map.stats().height;
+    }
+  };
+
+  /**
+   * @brief AVLmap with a 4096 slot hot key cache
+   */
+  struct Cached: CS280::TunableAVLmap<Key, Value> {
+    Cached() {
+      cache_lookups(4096);
+    }
+  };
+
+  template<>
+  struct Ops<Cached>: Ops<CS280::TunableAVLmap<Key, Value>> {};
+
+  /**
+   * @brief AVLmap with a counting Bloom filter, grown along with the map
+   */
+  struct Filtered: CS280::TunableAVLmap<Key, Value> {
+    Filtered() {
+      filter_lookups(1024);
+    }
+  };
+
+  template<>
+  struct Ops<Filtered>: Ops<CS280::TunableAVLmap<Key, Value>> {};
+
+  /**
+   * @brief AVLmap compacted in the given layout once prefilled
+   */
+  template<CS280::NodeLayout L>
+  struct Compacted: CS280::TunableAVLmap<Key, Value> {};
+
+  template<CS280::NodeLayout L>
+  struct Ops<Compacted<L>>: Ops<CS280::TunableAVLmap<Key, Value>> {};
+
+  template<>
+  struct Ops<CS280::RadixMap<Key, Value>> {
+    using Map = CS280::RadixMap<Key, Value>;
+
+    static constexpr bool counted = false;
+
+    static auto insert(Map& map, Key key, Value value) -> void {
+      map[key] = value;
+    }
+
+    static auto find(Map& map, Key key) -> bool {
+      return map.find(key) != map.end();
+    }
+
+    static auto erase(Map& map, Key key) -> void {
+      map.erase(map.find(key));
+    }
+
+    static auto scan(Map& map, Key from, usize length) -> Value {
+      Value sum = 0;
+      Map::iterator it = map.find(from);
+      for (usize i = 0; i < length and it != map.end(); i++, ++it) {
+        sum += it->Value();
+      }
+      return sum;
+    }
+
+    static auto rotations(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto visited(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto height(const Map&) -> usize {
+      return 0;
+    }
+  };
+
+  template<>
+  struct Ops<std::map<Key, Value>> {
+    using Map = std::map<Key, Value>;
+
+    static constexpr bool counted = false;
+
+    static auto insert(Map& map, Key key, Value value) -> void {
+      map[key] = value;
+    }
+
+    static auto find(Map& map, Key key) -> bool {
+      return map.find(key) != map.end();
+    }
+
+    static auto erase(Map& map, Key key) -> void {
+      map.erase(key);
+    }
+
+    static auto scan(Map& map, Key from, usize length) -> Value {
+      Value sum = 0;
+      Map::iterator it = map.find(from);
+      for (usize i = 0; i < length and it != map.end(); i++, ++it) {
+        sum += it->second;
+      }
+      return sum;
+    }
+
+    static auto rotations(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto visited(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto height(const Map&) -> usize {
+      return 0;
+    }
+  };
+
+  template<>
+  struct Ops<std::unordered_map<Key, Value>> {
+    using Map = std::unordered_map<Key, Value>;
+
+    static constexpr bool counted = false;
+
+    static auto insert(Map& map, Key key, Value value) -> void {
+      map[key] = value;
+    }
+
+    static auto find(Map& map, Key key) -> bool {
+      return map.find(key) != map.end();
+    }
+
+    static auto erase(Map& map, Key key) -> void {
+      map.erase(key);
+    }
+
+    // unordered, a scan is not meaningful
+    static auto scan(Map&, Key, usize) -> Value {
+      return 0;
+    }
+
+    static auto rotations(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto visited(const Map&) -> u64 {
+      return 0;
+    }
+
+    static auto height(const Map&) -> usize {
+      return 0;
+    }
+  };
+
+  /**
+   * @brief Hardware cache miss counter of this thread, reports nothing where
+   * perf events are unavailable (containers, non Linux)
+   */
+  class CacheMisses {
+  public:
+
+    CacheMisses(): fd{-1} {
+      perf_event_attr attr{};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      fd = static_cast<int>(
+        ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)
+      );
+    }
+
+    CacheMisses(const CacheMisses&) = delete;
+
+    auto operator=(const CacheMisses&) -> CacheMisses& = delete;
+
+    ~CacheMisses() {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+
+    [[nodiscard]] auto available() const -> bool {
+      return fd >= 0;
+    }
+
+    auto start() -> void {
+      if (fd >= 0) {
+        ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+
+    auto stop() -> u64 {
+      u64 misses = 0;
+      if (fd >= 0) {
+        ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (::read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+          misses = 0;
+        }
+      }
+      return misses;
+    }
+
+  private:
+
+    int fd;
+  };
+
+  /**
+   * @brief Zipfian ranks over [0, n) (Gray et al. as in YCSB), rank 0 is
+   * the hottest
+   */
+  class Zipfian {
+  public:
+
+    Zipfian(usize n, f64 theta):
+        n{n}, theta{theta}, alpha{1 / (1 - theta)}, zetan{0}, eta{0} {
+      for (usize i = 1; i <= n; i++) {
+        zetan += 1 / std::pow(static_cast<f64>(i), theta);
+      }
+
+      const f64 zeta2 = 1 + 1 / std::pow(2.0L, theta);
+      eta = (1 - std::pow(2.0L / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    auto operator()(std::mt19937_64& gen) -> usize {
+      const f64 u = std::uniform_real_distribution<f64>{0, 1}(gen);
+      const f64 uz = u * zetan;
+
+      if (uz < 1) {
+        return 0;
+      }
+      if (uz < 1 + std::pow(0.5L, theta)) {
+        return std::min<usize>(1, n - 1);
+      }
+
+      const f64 rank = n * std::pow(eta * u - eta + 1, alpha);
+      return std::min(static_cast<usize>(rank), n - 1);
+    }
+
+  private:
+
+    usize n;
+
+    f64 theta;
+
+    f64 alpha;
+
+    f64 zetan;
+
+    f64 eta;
+  };
+
+  /**
+   * @brief Key of the i-th entry, even so that odd keys are known misses
+   */
+  auto key_of(usize i) -> Key {
+    return Key{i} * 2;
+  }
+
+  /**
+   * @brief Keys 0..n-1 (as key_of) in a random order
+   */
+  auto shuffled(usize n, std::mt19937_64& gen) -> std::vector<Key> {
+    std::vector<Key> keys(n);
+    for (usize i = 0; i < n; i++) {
+      keys[i] = key_of(i);
+    }
+    std::shuffle(keys.begin(), keys.end(), gen);
+    return keys;
+  }
+
+  /**
+   * @brief Result of one workload run
+   */
+  struct Result {
+    usize ops;
+
+    f64 seconds;
+
+    u64 misses;
+
+    Value checksum;
+
+    // rotations made and nodes visited by the timed part, when the map
+    // counts them
+    bool counted;
+
+    u64 rotations;
+
+    u64 visited;
+
+    // height of the tree after the run, 0 for the baselines
+    usize height;
+  };
+
+  /**
+   * @brief Runs the timed part of a workload on map with the cache miss
+   * counter
+   */
+  template<typename Map, typename Fn>
+  auto measure(const Map& map, usize ops, Fn fn) -> Result {
+    static CacheMisses counter{};
+    const u64 rotations = Ops<Map>::rotations(map);
+    const u64 visited = Ops<Map>::visited(map);
+
+    counter.start();
+    const auto start = std::chrono::steady_clock::now();
+    const Value checksum = fn();
+    const auto stop = std::chrono::steady_clock::now();
+    const u64 misses = counter.stop();
+
+    return Result{
+      ops,
+      std::chrono::duration<f64>(stop - start).count(),
+      misses,
+      checksum,
+      Ops<Map>::counted,
+      Ops<Map>::rotations(map) - rotations,
+      Ops<Map>::visited(map) - visited,
+      Ops<Map>::height(map),
+    };
+  }
+
+  template<typename Map>
+  auto prefill(Map& map, const std::vector<Key>& keys) -> void {
+    for (const Key key : keys) {
+      Ops<Map>::insert(map, key, key);
+    }
+  }
+
+  template<CS280::NodeLayout L>
+  auto prefill(Compacted<L>& map, const std::vector<Key>& keys) -> void {
+    for (const Key key : keys) {
+      map[key] = key;
+    }
+    map.compact(L);
+  }
+
+  template<typename Map>
+  auto run_workload(const std::string& workload, usize n) -> Result {
+    using O = Ops<Map>;
+
+    std::mt19937_64 gen{n};
+    const usize ops = std::min<usize>(n, 1000000);
+    const std::vector<Key> keys = shuffled(n, gen);
+    Map map{};
+
+    if (workload == "sequential") {
+      return measure(map, n, [&] {
+        for (usize i = 0; i < n; i++) {
+          O::insert(map, key_of(i), i);
+        }
+        return Value{0};
+      });
+    }
+
+    if (workload == "random") {
+      return measure(map, n, [&] {
+        for (const Key key : keys) {
+          O::insert(map, key, key);
+        }
+        return Value{0};
+      });
+    }
+
+    prefill(map, keys);
+
+    if (workload == "zipfian") {
+      Zipfian zipf{n, 0.99L};
+      std::vector<Key> lookups(ops);
+      for (Key& key : lookups) {
+        // scattered so hot keys are not neighbours
+        key = keys[zipf(gen)];
+      }
+
+      return measure(map, ops, [&] {
+        Value hits = 0;
+        for (const Key key : lookups) {
+          hits += O::find(map, key);
+        }
+        return hits;
+      });
+    }
+
+    if (workload == "read-heavy" or workload == "write-heavy") {
+      // 95% or 50% finds, the rest inserts of new (odd) keys
+      const u64 write_percent = workload == "read-heavy" ? 5 : 50;
+      std::uniform_int_distribution<usize> pick{0, n - 1};
+      std::uniform_int_distribution<u64> percent{0, 99};
+
+      return measure(map, ops, [&] {
+        Value hits = 0;
+        for (usize i = 0; i < ops; i++) {
+          if (percent(gen) < write_percent) {
+            O::insert(map, key_of(pick(gen)) + 1, i);
+          } else {
+            hits += O::find(map, key_of(pick(gen)));
+          }
+        }
+        return hits;
+      });
+    }
+
+    if (workload == "missing") {
+      // finds of keys that are not in (odd ones), as a membership check
+      std::uniform_int_distribution<usize> pick{0, n - 1};
+      std::vector<Key> lookups(ops);
+      for (Key& key : lookups) {
+        key = key_of(pick(gen)) + 1;
+      }
+
+      return measure(map, ops, [&] {
+        Value hits = 0;
+        for (const Key key : lookups) {
+          hits += O::find(map, key);
+        }
+        return hits;
+      });
+    }
+
+    if (workload == "churn") {
+      // erase a present key and insert a missing one, size stays at n
+      std::vector<Key> present = keys;
+      std::uniform_int_distribution<usize> pick{0, n - 1};
+
+      return measure(map, ops, [&] {
+        for (usize i = 0; i < ops; i++) {
+          Key& slot = present[pick(gen)];
+          O::erase(map, slot);
+          slot ^= 1;
+          O::insert(map, slot, i);
+        }
+        return Value{0};
+      });
+    }
+
+    if (workload == "scan") {
+      const usize length = 100;
+      const usize scans = std::max<usize>(ops / length, 1);
+      std::uniform_int_distribution<usize> pick{0, n - 1};
+
+      return measure(map, scans * length, [&] {
+        Value sum = 0;
+        for (usize i = 0; i < scans; i++) {
+          sum += O::scan(map, key_of(pick(gen)), length);
+        }
+        return sum;
+      });
+    }
+
+    std::fprintf(stderr, "unknown workload %s\n", workload.c_str());
+    std::exit(1);
+  }
+
+  auto report(
+    const std::string& workload,
+    const char* map,
+    usize n,
+    const Result& result
+  ) -> void {
+    const f64 ns = result.seconds * 1e9 / result.ops;
+    char misses[32] = "-";
+    char rotations[32] = "-";
+    char visited[32] = "-";
+    char height[32] = "-";
+
+    if (result.misses) {
+      std::snprintf(
+        misses,
+        sizeof(misses),
+        "%.2f",
+        static_cast<double>(result.misses) / result.ops
+      );
+    }
+
+    if (result.counted) {
+      std::snprintf(
+        rotations,
+        sizeof(rotations),
+        "%.3f",
+        static_cast<double>(result.rotations) / result.ops
+      );
+      std::snprintf(
+        visited,
+        sizeof(visited),
+        "%.2f",
+        static_cast<double>(result.visited) / result.ops
+      );
+    }
+
+    if (result.height) {
+      std::snprintf(height, sizeof(height), "%zu", result.height);
+    }
+
+    std::printf(
+      "%-12s %-14s %10zu %10.1f %12.0f %12s %8s %8s %8s\n",
+      workload.c_str(),
+      map,
+      n,
+      static_cast<double>(ns),
+      static_cast<double>(result.ops / result.seconds),
+      misses,
+      height,
+      rotations,
+      visited
+    );
+    std::fflush(stdout);
+  }
+
+  /**
+   * @brief 64 byte value
+   */
+  struct Blob {
+    u8 bytes[64];
+  };
+
+  /**
+   * @brief Peak resident set size of this process in bytes
+   */
+  auto peak_rss() -> usize {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<usize>(usage.ru_maxrss) * 1024;
+  }
+
+  template<typename K>
+  auto make_key(u64 i) -> K {
+    return static_cast<K>(i);
+  }
+
+  template<>
+  auto make_key<std::string>(u64 i) -> std::string {
+    return "key:" + std::to_string(i);
+  }
+
+  /**
+   * @brief Fills a map of n entries in a child process, so the peak RSS is
+   * the one of this map alone, and prints its memory breakdown
+   */
+  template<typename K, typename V, typename S = CS280::InlineValues>
+  auto memory_row(const char* types, usize n) -> void {
+    std::fflush(stdout);
+    const pid_t child = ::fork();
+
+    if (child != 0) {
+      int status = 0;
+      ::waitpid(child, &status, 0);
+      return;
+    }
+
+    const usize before = peak_rss();
+    CS280::AVLmap<K, V, CS280::NoAugment, CS280::AVLBalance, 0, S> map{};
+
+    for (u64 i = 0; i < n; i++) {
+      // multiplying by an odd constant permutes the keys, a scattered
+      // insertion order without holding a key array
+      map[make_key<K>(i * 0x9E3779B97F4A7C15UL)] = V{};
+    }
+
+    const usize rss = peak_rss() - before;
+    const CS280::AVLmapMemory memory = map.memory_usage();
+    const f64 entries = map.size() ? map.size() : 1;
+
+    std::printf(
+      "%-16s %10zu %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f %10.1f\n",
+      types,
+      map.size(),
+      static_cast<double>(memory.payload / entries),
+      static_cast<double>(memory.links / entries),
+      static_cast<double>(memory.metadata / entries),
+      static_cast<double>(memory.allocator / entries),
+      static_cast<double>(memory.total / entries),
+      static_cast<double>(rss / entries),
+      static_cast<double>(peak_rss()) / (1 << 20)
+    );
+    std::fflush(stdout);
+    std::_Exit(0);
+  }
+
+  auto memory_report(const std::vector<usize>& sizes) -> void {
+    std::printf(
+      "%-16s %10s %8s %8s %8s %8s %8s %10s %10s\n",
+      "key/value",
+      "size",
+      "payload",
+      "links",
+      "meta",
+      "alloc",
+      "total",
+      "rss B/ent",
+      "peak MB"
+    );
+
+    for (const usize n : sizes) {
+      memory_row<u32, u32>("u32/u32", n);
+      memory_row<u64, u64>("u64/u64", n);
+      memory_row<u64, Blob>("u64/blob64", n);
+      memory_row<u64, Blob, CS280::SlabValues>("u64/blob64 slab", n);
+      memory_row<std::string, u64>("string/u64", n);
+    }
+  }
+} // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::string> workloads{
+    "sequential",
+    "random",
+    "zipfian",
+    "read-heavy",
+    "write-heavy",
+    "missing",
+    "churn",
+    "scan",
+  };
+  std::vector<std::string> maps{
+    "AVLmap",
+    "red-black",
+    "WAVL",
+    "treap",
+    "adaptive",
+    "cached",
+    "filtered",
+    "compacted",
+    "vEB",
+    "radix",
+    "std::map",
+    "unordered_map",
+  };
+  std::vector<usize> sizes{};
+  bool memory = false;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+
+    if (arg == "--memory") {
+      memory = true;
+    } else if (arg == "--workload" and i + 1 < argc) {
+      workloads = {argv[++i]};
+    } else if (arg == "--map" and i + 1 < argc) {
+      maps = {argv[++i]};
+    } else {
+      sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+  }
+
+  if (sizes.empty()) {
+    sizes = {1000, 100000};
+  }
+
+  if (memory) {
+    memory_report(sizes);
+    return 0;
+  }
+
+  std::printf(
+    "%-12s %-14s %10s %10s %12s %12s %8s %8s %8s\n",
+    "workload",
+    "map",
+    "size",
+    "ns/op",
+    "ops/sec",
+    "misses/op",
+    "height",
+    "rot/op",
+    "visit/op"
+  );
+
+  for (const std::string& workload : workloads) {
+    for (const usize n : sizes) {
+      for (const std::string& map : maps) {
+        if (map == "AVLmap") {
+          report(
+            workload,
+            "AVLmap",
+            n,
+            run_workload<CS280::AVLmap<Key, Value>>(workload, n)
+          );
+        } else if (map == "red-black") {
+          report(
+            workload,
+            "red-black",
+            n,
+            run_workload<Policy<CS280::RedBlackBalance>>(workload, n)
+          );
+        } else if (map == "WAVL") {
+          report(
+            workload,
+            "WAVL",
+            n,
+            run_workload<Policy<CS280::WAVLBalance>>(workload, n)
+          );
+        } else if (map == "treap") {
+          report(
+            workload,
+            "treap",
+            n,
+            run_workload<Policy<CS280::TreapBalance>>(workload, n)
+          );
+        } else if (map == "adaptive") {
+          report(
+            workload,
+            "adaptive",
+            n,
+            run_workload<Policy<CS280::AdaptiveBalance>>(workload, n)
+          );
+        } else if (map == "cached") {
+          report(workload, "cached", n, run_workload<Cached>(workload, n));
+        } else if (map == "filtered") {
+          report(workload, "filtered", n, run_workload<Filtered>(workload, n));
+        } else if (map == "compacted") {
+          report(
+            workload,
+            "compacted",
+            n,
+            run_workload<Compacted<CS280::NodeLayout::InOrder>>(workload, n)
+          );
+        } else if (map == "vEB") {
+          report(
+            workload,
+            "vEB",
+            n,
+            run_workload<Compacted<CS280::NodeLayout::VanEmdeBoas>>(workload, n)
+          );
+        } else if (map == "radix") {
+          report(
+            workload,
+            "radix",
+            n,
+            run_workload<CS280::RadixMap<Key, Value>>(workload, n)
+          );
+        } else if (map == "std::map") {
+          report(
+            workload,
+            "std::map",
+            n,
+            run_workload<std::map<Key, Value>>(workload, n)
+          );
+        } else if (map == "unordered_map" and workload != "scan") {
+          report(
+            workload,
+            "unordered_map",
+            n,
+            run_workload<std::unordered_map<Key, Value>>(workload, n)
+          );
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+
+#ifndef BLOOM_FILTER_H
+#include "bloom-filter.h"
+#endif
+
+#ifndef BLOOM_FILTER_CPP
+#define BLOOM_FILTER_CPP
+
+namespace CS280 {
+
+  inline BloomFilter::BloomFilter(): words{}, blocks{0} {}
+
+  inline BloomFilter::BloomFilter(
+    usize expected_keys,
+    usize bits_per_key
+  ):
+      words{}, blocks{0} {
+    const usize bits = std::max<usize>(
+      expected_keys * bits_per_key,
+      1
+    );
+    blocks = (bits + BLOCK_WORDS * 64 - 1) / (BLOCK_WORDS * 64);
+    words.assign(blocks * BLOCK_WORDS, 0);
+  }
+
+  inline auto BloomFilter::add(u64 hash) -> void {
+    if (blocks == 0) {
+      return;
+    }
+
+    // the high half picks the block, the low half seeds a generator whose
+    // top bits pick the bits within it (its low bits cycle too quickly, the
+    // probes of different keys would overlap)
+    u64* const block = &words[(hash >> 32) % blocks * BLOCK_WORDS];
+    u32 bits = static_cast<u32>(hash);
+
+    for (u32 i = 0; i < PROBES; i++) {
+      const u32 bit = bits >> 23;
+      block[bit / 64] |= u64{1} << (bit % 64);
+      bits = bits * 0x9E3779B1u + 0x7F4A7C15u;
+    }
+  }
+
+  inline auto BloomFilter::may_contain(u64 hash) const -> bool {
+    if (blocks == 0) {
+      return false;
+    }
+
+    const u64* const block = &words[
+      (hash >> 32) % blocks * BLOCK_WORDS
+    ];
+    u32 bits = static_cast<u32>(hash);
+
+    for (u32 i = 0; i < PROBES; i++) {
+      const u32 bit = bits >> 23;
+      if ((block[bit / 64] & (u64{1} << (bit % 64))) == 0) {
+        return false;
+      }
+      bits = bits * 0x9E3779B1u + 0x7F4A7C15u;
+    }
+
+    return true;
+  }
+
+  inline auto BloomFilter::bytes() const -> usize {
+    return words.size() * sizeof(u64);
+  }
+
+  inline CountingBloomFilter::CountingBloomFilter():
+      words{}, blocks{0}, keys{0} {}
+
+  inline CountingBloomFilter::CountingBloomFilter(
+    usize expected_keys,
+    usize counters_per_key
+  ):
+      words{}, blocks{0}, keys{expected_keys} {
+    const usize counters = std::max<usize>(
+      expected_keys * counters_per_key,
+      1
+    );
+    blocks = (counters + BLOCK_COUNTERS - 1) / BLOCK_COUNTERS;
+    words.assign(blocks * BLOCK_WORDS, 0);
+  }
+
+  inline auto CountingBloomFilter::add(u64 hash) -> void {
+    if (blocks == 0) {
+      return;
+    }
+
+    u64* const counters = &words[block(hash)];
+    u32 bits = static_cast<u32>(hash);
+
+    for (u32 i = 0; i < PROBES; i++) {
+      const u32 counter = bits >> 25;
+      const u32 shift = counter % 16 * 4;
+
+      if (((counters[counter / 16] >> shift) & 0xF) != 0xF) {
+        counters[counter / 16] += u64{1} << shift;
+      }
+      bits = bits * 0x9E3779B1u + 0x7F4A7C15u;
+    }
+  }
+
+  inline auto CountingBloomFilter::remove(u64 hash) -> void {
+    if (blocks == 0) {
+      return;
+    }
+
+    u64* const counters = &words[block(hash)];
+    u32 bits = static_cast<u32>(hash);
+
+    for (u32 i = 0; i < PROBES; i++) {
+      const u32 counter = bits >> 25;
+      const u32 shift = counter % 16 * 4;
+      const u64 value = (counters[counter / 16] >> shift) & 0xF;
+
+      // a stuck counter may stand for more keys than it counted
+      if (value != 0 and value != 0xF) {
+        counters[counter / 16] -= u64{1} << shift;
+      }
+      bits = bits * 0x9E3779B1u + 0x7F4A7C15u;
+    }
+  }
+
+  inline auto CountingBloomFilter::may_contain(u64 hash) const
+    -> bool {
+    if (blocks == 0) {
+      return false;
+    }
+
+    const u64* const counters = &words[block(hash)];
+    u32 bits = static_cast<u32>(hash);
+
+    for (u32 i = 0; i < PROBES; i++) {
+      const u32 counter = bits >> 25;
+      if (((counters[counter / 16] >> (counter % 16 * 4)) & 0xF) == 0) {
+        return false;
+      }
+      bits = bits * 0x9E3779B1u + 0x7F4A7C15u;
+    }
+
+    return true;
+  }
+
+  inline auto CountingBloomFilter::capacity() const -> usize {
+    return blocks ? keys : 0;
+  }
+
+  inline auto CountingBloomFilter::bytes() const -> usize {
+    return words.size() * sizeof(u64);
+  }
+
+  inline auto CountingBloomFilter::block(u64 hash) const
+    -> usize {
+    // the high half picks the block, the low half the counters within it
+    return (hash >> 32) % blocks * BLOCK_WORDS;
+  }
+} // namespace CS280
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <vector>
+
+#include "int-types.h"
+
+namespace CS280 {
+
+  /**
+   * @brief Blocked Bloom filter: every key sets all of its bits in a single
+   * 64 byte block, so a query touches exactly one cache line
+   */
+  class BloomFilter {
+
+  public:
+
+    /**
+     * @brief Empty filter, contains nothing
+     */
+    inline BloomFilter();
+
+    /**
+     * @brief Filter sized for the given number of keys
+     */
+    inline explicit BloomFilter(
+      usize expected_keys,
+      usize bits_per_key = 10
+    );
+
+    /**
+     * @brief Adds a key hash (see hash_key)
+     */
+    inline auto add(u64 hash) -> void;
+
+    /**
+     * @brief False if the hash was never added, true if it probably was
+     */
+    [[nodiscard]] inline auto may_contain(u64 hash) const -> bool;
+
+    /**
+     * @brief Memory used by the filter bits
+     */
+    [[nodiscard]] inline auto bytes() const -> usize;
+
+  private:
+
+    /**
+     * @brief Bits set per key
+     */
+    static constexpr u32 PROBES = 6;
+
+    /**
+     * @brief 64 bit words per block (one cache line), probes take the top 9
+     * bits of a 32 bit generator so a block must hold 512 bits
+     */
+    static constexpr usize BLOCK_WORDS = 8;
+
+    /**
+     * @brief Filter bits, blocks are consecutive groups of BLOCK_WORDS
+     */
+    std::vector<u64> words;
+
+    /**
+     * @brief Number of blocks
+     */
+    usize blocks;
+  };
+
+  /**
+   * @brief Blocked counting Bloom filter: like BloomFilter but with 4 bit
+   * counters instead of bits, so keys can be removed again. A block of 64
+   * bytes holds 128 counters, a query still touches one cache line. Takes 4
+   * times the memory of a BloomFilter with as many bits per key as this has
+   * counters. A counter reaching 15 sticks, which only costs precision
+   */
+  class CountingBloomFilter {
+
+  public:
+
+    /**
+     * @brief Empty filter, contains nothing
+     */
+    inline CountingBloomFilter();
+
+    /**
+     * @brief Filter sized for the given number of keys
+     */
+    inline explicit CountingBloomFilter(
+      usize expected_keys,
+      usize counters_per_key = 10
+    );
+
+    /**
+     * @brief Adds a key hash (see hash_key)
+     */
+    inline auto add(u64 hash) -> void;
+
+    /**
+     * @brief Removes a key hash, which must have been added
+     */
+    inline auto remove(u64 hash) -> void;
+
+    /**
+     * @brief False if the hash is not in, true if it probably is
+     */
+    [[nodiscard]] inline auto may_contain(u64 hash) const -> bool;
+
+    /**
+     * @brief Keys the filter was sized for, 0 when it has no counters
+     */
+    [[nodiscard]] inline auto capacity() const -> usize;
+
+    /**
+     * @brief Memory used by the counters
+     */
+    [[nodiscard]] inline auto bytes() const -> usize;
+
+  private:
+
+    /**
+     * @brief Counters touched per key
+     */
+    static constexpr u32 PROBES = 6;
+
+    /**
+     * @brief 64 bit words per block (one cache line)
+     */
+    static constexpr usize BLOCK_WORDS = 8;
+
+    /**
+     * @brief 4 bit counters per block, probes take the top 7 bits of a 32
+     * bit generator so a block must hold 128 counters
+     */
+    static constexpr u32 BLOCK_COUNTERS = BLOCK_WORDS * 16;
+
+    /**
+     * @brief Index of the first word of the block of a hash
+     */
+    [[nodiscard]] inline auto block(u64 hash) const -> usize;
+
+    /**
+     * @brief Filter counters, blocks are consecutive groups of BLOCK_WORDS
+     */
+    std::vector<u64> words;
+
+    /**
+     * @brief Number of blocks
+     */
+    usize blocks;
+
+    /**
+     * @brief Keys the filter was sized for
+     */
+    usize keys;
+  };
+} // namespace CS280
+
+#ifndef BLOOM_FILTER_CPP
+#include "bloom-filter.cpp"
+#endif
+#endif
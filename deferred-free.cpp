@@ -0,0 +1,73 @@
+#pragma once
+
+#include <utility>
+
+#ifndef DEFERRED_FREE_H
+#include "deferred-free.h"
+#endif
+
+#ifndef DEFERRED_FREE_CPP
+#define DEFERRED_FREE_CPP
+
+namespace CS280 {
+
+  inline auto DeferredFree::instance() -> DeferredFree& {
+    static DeferredFree reaper;
+    return reaper;
+  }
+
+  inline DeferredFree::DeferredFree():
+      jobs{}, busy{false}, stopping{false}, lock{}, wake{}, idle{}, worker{} {
+    worker = std::thread{&DeferredFree::run, this};
+  }
+
+  inline DeferredFree::~DeferredFree() {
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  inline auto DeferredFree::defer(std::function<void()> job) -> void {
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+  }
+
+  inline auto DeferredFree::wait() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+    idle.wait(guard, [this] { return jobs.empty() and not busy; });
+  }
+
+  inline auto DeferredFree::run() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+
+    for (;;) {
+      wake.wait(guard, [this] { return stopping or not jobs.empty(); });
+
+      if (jobs.empty()) {
+        return;
+      }
+
+      std::function<void()> job = std::move(jobs.front());
+      jobs.pop_front();
+      busy = true;
+
+      // frees run unlocked, request threads keep queueing meanwhile
+      guard.unlock();
+      job();
+      guard.lock();
+
+      busy = false;
+      if (jobs.empty()) {
+        idle.notify_all();
+      }
+    }
+  }
+} // namespace CS280
+
+#endif
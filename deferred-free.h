@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef DEFERRED_FREE_H
+#define DEFERRED_FREE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace CS280 {
+
+  /**
+   * @brief Background thread that runs frees handed off by request threads
+   * (see AVLmap::clear_async), one at a time in the order they were queued.
+   * Started on first use, drains its queue before the program exits
+   */
+  class DeferredFree {
+
+  public:
+
+    /**
+     * @brief The process wide instance
+     */
+    [[nodiscard]] static inline auto instance() -> DeferredFree&;
+
+    /**
+     * @brief Copy constructor
+     */
+    DeferredFree(const DeferredFree&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const DeferredFree&) -> DeferredFree& = delete;
+
+    /**
+     * @brief Destructor, runs what is still queued and stops the thread
+     */
+    inline ~DeferredFree();
+
+    /**
+     * @brief Queues a free, returns at once
+     */
+    inline auto defer(std::function<void()> job) -> void;
+
+    /**
+     * @brief Blocks until every free queued so far has run
+     */
+    inline auto wait() -> void;
+
+  private:
+
+    /**
+     * @brief Starts the thread
+     */
+    inline DeferredFree();
+
+    /**
+     * @brief Body of the thread
+     */
+    inline auto run() -> void;
+
+    /**
+     * @brief Frees not started yet
+     */
+    std::deque<std::function<void()>> jobs;
+
+    /**
+     * @brief Is a free running
+     */
+    bool busy;
+
+    /**
+     * @brief Tells the thread to exit once the queue is empty
+     */
+    bool stopping;
+
+    /**
+     * @brief Guards jobs, busy and stopping
+     */
+    std::mutex lock;
+
+    /**
+     * @brief Wakes the thread
+     */
+    std::condition_variable wake;
+
+    /**
+     * @brief Wakes waiters when the queue runs empty
+     */
+    std::condition_variable idle;
+
+    /**
+     * @brief The thread
+     */
+    std::thread worker;
+  };
+} // namespace CS280
+
+#ifndef DEFERRED_FREE_CPP
+#include "deferred-free.cpp"
+#endif
+#endif
@@ -5,16 +5,30 @@
 
 
 #include "avl-map.h"
+#include "persistent-avl-map.h"
+#include "wal-map.h"
+#include "lsm-map.h"
+#include "radix-map.h"
 #include <iostream>
 #include <vector>
-#include <cstdlib> 
+#include <limits>
+#include <string>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+#include <csignal>
+#include <type_traits> 
+
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 void simple_inserts( CS280::AVLmap<int,int> & map, std::vector<int> const& data ) {
     //insert (using index operator) and perform sanity check each time
     for ( int const & key : data ) {
         map[ key ] = key; //value is not important
         // if you have the method below, uncomment next line
-        // if (!map.sanityCheck()) std::cout << "Error\n";
+        if (!map.sanityCheck()) std::cout << "Error\n";
     }
 }
 
@@ -171,7 +185,7 @@ void simple_deletes( CS280::AVLmap<int,int> & map, std::vector<int> const& data
         } else {
             map.erase( it );
             // if you have the method below, uncomment next line
-            // if (!map.sanityCheck()) std::cout << "Error\n";
+            if (!map.sanityCheck()) std::cout << "Error\n";
         }
     }
 
@@ -256,6 +270,14 @@ void inserts_delete_random( int N, int num_iter,
         }
     }
 
+#ifdef AVLMAP_STATS
+    // structural summary, to catch regressions in rebalancing
+    std::cerr << map.stats() << "\n";
+#endif
+#ifdef AVLMAP_LATENCY
+    map.latency().print_text( std::cerr );
+#endif
+
     if ( perform_checks ) {
         // check all data is in a tree
         for ( int const& el :  data ) {
@@ -609,10 +631,1685 @@ void test17()
 }
 
 
+// node handles - move entries between maps without reallocation
+// expected output - none
+void test18()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 1000;
+    CS280::AVLmap<int,int> active;
+    CS280::AVLmap<int,int> aging;
+    std::vector<int> data( N );   // data to insert
+    std::iota( data.begin(), data.end(), 1 );
+    std::shuffle( data.begin(), data.end(), std::mt19937{std::random_device{}()} );
+    simple_inserts( active, data );
+
+    // move the first half to the aging map
+    for ( int i=0; i<N/2; ++i ) {
+        CS280::AVLmap<int,int>::iterator it = active.find( data[i] );
+        CS280::AVLmap<int,int>::Node * node = &*it;
+        CS280::AVLmap<int,int>::node_type handle = active.extract( it );
+        if ( handle.empty() or handle.key() != data[i] ) {
+            std::cout << "Bad handle\n";
+        }
+        CS280::AVLmap<int,int>::insert_return_type result = aging.insert( std::move( handle ) );
+        if ( not result.inserted or &*result.position != node or result.node ) {
+            std::cout << "Node was not moved\n";
+        }
+    }
+
+    if ( active.size() != static_cast<unsigned>( N - N/2 ) or aging.size() != static_cast<unsigned>( N/2 ) ) {
+        std::cout << "Wrong size\n";
+    }
+
+    for ( int i=0; i<N; ++i ) {
+        bool in_aging = i < N/2;
+        if ( ( active.find( data[i] ) == active.end() ) != in_aging ) {
+            std::cout << "Wrong content in active\n";
+        }
+        if ( ( aging.find( data[i] ) == aging.end() ) == in_aging ) {
+            std::cout << "Wrong content in aging\n";
+        }
+    }
+
+    // change a key in place, inserting a duplicate hands the node back
+    CS280::AVLmap<int,int>::node_type handle = aging.extract( data[0] );
+    handle.key() = data[1];
+    CS280::AVLmap<int,int>::insert_return_type result = aging.insert( std::move( handle ) );
+    if ( result.inserted or result.node.empty() or result.position->Key() != data[1] ) {
+        std::cout << "Duplicate key was inserted\n";
+    }
+    handle = std::move( result.node );
+    handle.key() = N + 1;
+    if ( not aging.insert( std::move( handle ) ).inserted or aging.find( N + 1 ) == aging.end() ) {
+        std::cout << "Renamed key was not inserted\n";
+    }
+
+    if ( not active.extract( N + 2 ).empty() ) {
+        std::cout << "Extracted a missing key\n";
+    }
+}
+
+// binary snapshot - save and load through mmap
+// expected output - none
+// key aligned beyond max_align_t
+struct alignas( 32 ) Wide {
+    int value;
+    bool operator<( Wide const & rhs ) const { return value < rhs.value; }
+    bool operator==( Wide const & rhs ) const { return value == rhs.value; }
+};
+
+void test19()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 1000;
+    CS280::AVLmap<int,int> map;
+    std::vector<int> data( N );   // data to insert
+    std::iota( data.begin(), data.end(), 1 );
+    std::shuffle( data.begin(), data.end(), std::mt19937{std::random_device{}()} );
+    simple_inserts( map, data );
+    // erase some so the snapshot is not a contiguous range
+    simple_deletes( map, std::vector<int>( data.begin(), data.begin() + N/4 ) );
+
+    char const * path = "snapshot19.bin";
+    if ( not map.save( path ) ) {
+        std::cout << "Cannot save snapshot\n";
+    }
+
+    bool ok = false;
+    CS280::AVLmap<int,int> loaded = CS280::AVLmap<int,int>::load_mmap( path, &ok );
+    std::remove( path );
+    if ( not ok or loaded.size() != map.size() ) {
+        std::cout << "Cannot load snapshot\n";
+    }
+
+    CS280::AVLmap<int,int>::iterator it   = map.begin();
+    CS280::AVLmap<int,int>::iterator it_l = loaded.begin();
+    for ( ; it != map.end() and it_l != loaded.end(); ++it, ++it_l ) {
+        if ( it->Key() != it_l->Key() or it->Value() != it_l->Value() ) {
+            std::cout << "Loaded content is wrong\n";
+        }
+    }
+    if ( it != map.end() or it_l != loaded.end() ) {
+        std::cout << "Loaded size is wrong\n";
+    }
+
+    // loaded map is a regular map
+    simple_inserts( loaded, std::vector<int>( data.begin(), data.begin() + N/4 ) );
+    simple_finds( loaded, data );
+
+    CS280::AVLmap<int,int> missing = CS280::AVLmap<int,int>::load_mmap( path, &ok );
+    if ( ok or not missing.empty() ) {
+        std::cout << "Loaded a missing snapshot\n";
+    }
+
+    // keys out of order are rejected
+    map.save( path );
+    if ( std::FILE * file = std::fopen( path, "r+b" ) ) {
+        CS280::SnapshotHeader header{};
+        std::fread( &header, sizeof( header ), 1, file );
+        int const swapped[ 2 ] = { map.begin()->Key() + 1, map.begin()->Key() };
+        std::fseek( file, static_cast<long>( header.key_offset ), SEEK_SET );
+        std::fwrite( swapped, sizeof( swapped ), 1, file );
+        std::fclose( file );
+    }
+    CS280::AVLmap<int,int> unsorted = CS280::AVLmap<int,int>::load_mmap( path, &ok );
+    std::remove( path );
+    if ( ok or not unsorted.empty() ) {
+        std::cout << "Loaded an unsorted snapshot\n";
+    }
+
+    // keys aligned beyond max_align_t are padded with zeros
+    CS280::AVLmap<Wide,int> wide;
+    for ( int i=0; i<10; ++i ) wide[ Wide{ i } ] = i;
+    wide.save( path );
+    CS280::AVLmap<Wide,int> wide_loaded = CS280::AVLmap<Wide,int>::load_mmap( path, &ok );
+    std::remove( path );
+    if ( not ok or wide_loaded.size() != 10 or wide_loaded.find( Wide{ 7 } )->Value() != 7 ) {
+        std::cout << "Cannot load over-aligned snapshot\n";
+    }
+}
+
+// persistent map - content survives closing and reopening the file
+// expected output - none
+void test20()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 2000;
+    char const * path = "persistent20.bin";
+    std::remove( path );
+
+    std::vector<int> data( N );   // data to insert
+    std::iota( data.begin(), data.end(), 1 );
+    std::shuffle( data.begin(), data.end(), std::mt19937{std::random_device{}()} );
+
+    {
+        CS280::PersistentAVLmap<int,int> map;
+        // start small so the file has to grow
+        if ( not map.open( path, 16 ) ) {
+            std::cout << "Cannot create map\n";
+        }
+        for ( int const & key : data ) {
+            map[ key ] = -key;
+        }
+        // erase the first half
+        for ( int i=0; i<N/2; ++i ) {
+            map.erase( map.find( data[i] ) );
+            if ( i % 100 == 0 and not map.sanityCheck() ) {
+                std::cout << "Unbalanced after erase\n";
+            }
+        }
+        if ( not map.sanityCheck() ) {
+            std::cout << "Unbalanced\n";
+        }
+    } // map closed
+
+    CS280::PersistentAVLmap<int,int> map;
+    if ( not map.open( path ) or map.size() != static_cast<unsigned>( N - N/2 ) ) {
+        std::cout << "Cannot reopen map\n";
+    }
+
+    for ( int i=0; i<N; ++i ) {
+        CS280::PersistentAVLmap<int,int>::iterator it = map.find( data[i] );
+        if ( ( it == map.end() ) != ( i < N/2 ) ) {
+            std::cout << "Wrong content\n";
+        } else if ( it != map.end() and it->Value() != -data[i] ) {
+            std::cout << "Wrong value\n";
+        }
+    }
+
+    // in order, and erased nodes are reused
+    std::vector<int> keys;
+    for ( CS280::PersistentAVLmap<int,int>::iterator it = map.begin(); it != map.end(); ++it ) {
+        keys.push_back( it->Key() );
+    }
+    if ( keys.size() != map.size() or not std::is_sorted( keys.begin(), keys.end() ) ) {
+        std::cout << "Wrong order\n";
+    }
+    for ( int i=0; i<N/2; ++i ) {
+        map[ data[i] ] = data[i];
+    }
+    if ( map.size() != static_cast<unsigned>( N ) or not map.sanityCheck() ) {
+        std::cout << "Wrong size\n";
+    }
+
+    map.close();
+    std::remove( path );
+
+    // nothing is mapped, so there is nowhere to put a node
+    try {
+        map[ 1 ] = 1;
+        std::cout << "Inserted into a closed map\n";
+    } catch ( std::logic_error const & ) {
+    }
+}
+
+// write-ahead log - recovery replays the log on top of the last snapshot
+// expected output - none
+void test21()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 1000;
+    std::string path = "wal21";
+    std::remove( ( path + ".snapshot" ).c_str() );
+    std::remove( ( path + ".wal" ).c_str() );
+
+    std::vector<int> data( N );   // data to insert
+    std::iota( data.begin(), data.end(), 1 );
+    std::shuffle( data.begin(), data.end(), std::mt19937{std::random_device{}()} );
+
+    {
+        CS280::WALmap<int,int> map;
+        if ( not map.open( path ) ) {
+            std::cout << "Cannot open log\n";
+        }
+        // first half goes to the snapshot
+        for ( int i=0; i<N/2; ++i ) {
+            map.set( data[i], -data[i] );
+        }
+        if ( not map.checkpoint() ) {
+            std::cout << "Cannot checkpoint\n";
+        }
+        // second half and some erases only live in the log
+        for ( int i=N/2; i<N; ++i ) {
+            map.set( data[i], -data[i] );
+        }
+        for ( int i=0; i<N/4; ++i ) {
+            map.erase( data[i] );
+        }
+        if ( not map.wait_durable( map.set( data[N-1], 0 ) ) ) {
+            std::cout << "Not durable\n";
+        }
+    } // map closed
+
+    CS280::WALmap<int,int> map;
+    if ( not map.open( path ) or map.map().size() != static_cast<unsigned>( N - N/4 ) ) {
+        std::cout << "Wrong size after recovery\n";
+    }
+    for ( int i=0; i<N; ++i ) {
+        CS280::AVLmap<int,int>::const_iterator it = map.map().find( data[i] );
+        int expected = i == N-1 ? 0 : -data[i];
+        if ( ( it == map.map().end() ) != ( i < N/4 ) ) {
+            std::cout << "Wrong content after recovery\n";
+        } else if ( it != map.map().end() and it->Value() != expected ) {
+            std::cout << "Wrong value after recovery\n";
+        }
+    }
+    map.close();
+
+    std::remove( ( path + ".snapshot" ).c_str() );
+    std::remove( ( path + ".wal" ).c_str() );
+
+    // a log that cannot grow: the write is cut short half way into a record
+    // and nothing is reported durable until a checkpoint
+    {
+        CS280::WALmap<int,int> failing;
+        if ( not failing.open( path ) ) {
+            std::cout << "Cannot open log\n";
+        }
+        for ( int i=0; i<10; ++i ) failing.set( i, i );
+        if ( not failing.flush() ) {
+            std::cout << "Cannot flush\n";
+        }
+
+        long const record = 4 * sizeof( int );
+        rlimit limit{};
+        getrlimit( RLIMIT_FSIZE, &limit );
+        rlimit const unlimited = limit;
+        limit.rlim_cur = static_cast<rlim_t>( 10 * record + record / 2 );
+        auto const handler = std::signal( SIGXFSZ, SIG_IGN );
+        setrlimit( RLIMIT_FSIZE, &limit );
+
+        CS280::WALmap<int,int>::lsn const lost = failing.set( 10, 10 );
+        for ( int i=11; i<15; ++i ) failing.set( i, i );
+        if ( failing.wait_durable( lost ) or failing.flush() ) {
+            std::cout << "Failed write reported durable\n";
+        }
+        failing.set( 15, 15 );
+        if ( failing.flush() ) {
+            std::cout << "Log failure not sticky\n";
+        }
+        struct stat info{};
+        if ( stat( ( path + ".wal" ).c_str(), &info ) != 0 or info.st_size != 10 * record + record / 2 ) {
+            std::cout << "Wrong log size " << info.st_size << "\n";
+        }
+
+        setrlimit( RLIMIT_FSIZE, &unlimited );
+        std::signal( SIGXFSZ, handler );
+        if ( not failing.checkpoint() or not failing.flush() or not failing.wait_durable( failing.set( 16, 16 ) ) ) {
+            std::cout << "Checkpoint did not recover the log\n";
+        }
+    }
+
+    CS280::WALmap<int,int> recovered;
+    if ( not recovered.open( path ) or recovered.map().size() != 17 ) {
+        std::cout << "Wrong size after failed log\n";
+    }
+    recovered.close();
+
+    std::remove( ( path + ".snapshot" ).c_str() );
+    std::remove( ( path + ".wal" ).c_str() );
+}
+
+// log structured map - memtable, frozen runs and background merges
+// expected output - none
+void test22()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 20000;
+    // tiny memtable so many runs are frozen and merged
+    CS280::LogStructuredMap<int,int> map( 64, 4 );
+    CS280::AVLmap<int,int> expected;
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 1, N/4 );
+    for ( int i=0; i<N; ++i ) {
+        int key = dis( gen );
+        if ( i % 3 == 0 ) {
+            map.erase( key );
+            expected.erase( expected.find( key ) );
+        } else {
+            map.set( key, i );
+            expected[ key ] = i;
+        }
+    }
+    map.wait_for_merges();
+
+    for ( int key=0; key<=N/4+1; ++key ) {
+        int value = 0;
+        CS280::AVLmap<int,int>::iterator it = expected.find( key );
+        if ( map.find( key, value ) != ( it != expected.end() ) ) {
+            std::cout << "Wrong content\n";
+        } else if ( it != expected.end() and it->Value() != value ) {
+            std::cout << "Wrong value\n";
+        }
+    }
+
+    // ordered scan merges memtable and runs
+    CS280::AVLmap<int,int>::iterator it = expected.begin();
+    map.for_each( [&]( int const & key, int const & value ) {
+        if ( it == expected.end() or it->Key() != key or it->Value() != value ) {
+            std::cout << "Wrong scan\n";
+        } else {
+            ++it;
+        }
+    } );
+    if ( it != expected.end() ) {
+        std::cout << "Short scan\n";
+    }
+}
+
+void test23()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 2000;
+    CS280::AVLmap<int,int,CS280::MerkleDigest> a, b;
+
+    // same entries, different insertion order and so different shapes
+    for ( int i=0; i<N; ++i ) {
+        a[ i ] = i * 7;
+        b[ N-1-i ] = ( N-1-i ) * 7;
+    }
+    if ( a.digest() != b.digest() ) {
+        std::cout << "Different digests of equal maps\n";
+    }
+
+    b[ 10 ] = 0;                  // changed
+    b.erase( b.find( 500 ) );     // only in a
+    b[ N+5 ] = 1;                 // only in b
+    a.find( 1500 )->Value() = 3;  // changed through an iterator
+    if ( a.digest() == b.digest() ) {
+        std::cout << "Equal digests of different maps\n";
+    }
+
+    std::vector<int> keys;
+    CS280::AVLmap<int,int,CS280::MerkleDigest>::diff( a, b, [&]( int const & key, int const * in_a, int const * in_b ) {
+        keys.push_back( key );
+        if ( ( key == 500 ) != ( in_b == nullptr ) or ( key == N+5 ) != ( in_a == nullptr ) ) {
+            std::cout << "Wrong side for " << key << "\n";
+        }
+    } );
+    if ( keys != std::vector<int>{ 10, 500, 1500, N+5 } ) {
+        std::cout << "Wrong diff\n";
+    }
+
+    b[ 10 ] = 10 * 7;
+    b[ 500 ] = 500 * 7;
+    b.erase( b.find( N+5 ) );
+    b[ 1500 ] = 3;
+    if ( a.digest() != b.digest() ) {
+        std::cout << "Different digests after sync\n";
+    }
+
+    // a copy takes the write still pending in b along
+    b[ 1500 ] = 4;
+    CS280::AVLmap<int,int,CS280::MerkleDigest> copy( b );
+    if ( copy.digest() != b.digest() or a.digest() == b.digest()
+         or !copy.sanityCheck() or !b.sanityCheck() ) {
+        std::cout << "Wrong digest of a copy\n";
+    }
+}
+
+// keys in key order, checks that combine keeps the order
+struct KeyOrder {
+    using value_type = std::string;
+    static std::string identity() { return ""; }
+    static std::string lift( int const & key, int const & ) { return std::to_string( key ) + ","; }
+    static std::string combine( std::string const & a, std::string const & b ) { return a + b; }
+};
+
+void test24()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 3000;
+    CS280::AVLmap<int,int,CS280::SumOf<int>> sums;
+    CS280::AVLmap<int,int,CS280::MinOf<int>> mins;
+    CS280::AVLmap<int,int,CS280::MaxOf<int>> maxs;
+    CS280::AVLmap<int,int,KeyOrder> order;
+    CS280::AVLmap<int,int> expected;
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 1, N/3 );
+    for ( int i=0; i<N; ++i ) {
+        int key = dis( gen ), value = dis( gen ) - N/6;
+        if ( i % 4 == 0 ) {
+            sums.erase( sums.find( key ) );
+            mins.erase( mins.find( key ) );
+            maxs.erase( maxs.find( key ) );
+            order.erase( order.find( key ) );
+            expected.erase( expected.find( key ) );
+        } else {
+            sums[ key ] = value;
+            mins[ key ] = value;
+            CS280::AVLmap<int,int,CS280::MaxOf<int>>::iterator it = maxs.find( key );
+            if ( it != maxs.end() ) {
+                it->Value() = value; // changed through an iterator
+            } else {
+                maxs[ key ] = value;
+            }
+            order[ key ] = value;
+            expected[ key ] = value;
+        }
+
+        if ( i % 50 ) {
+            continue;
+        }
+
+        int lo = dis( gen ), hi = lo + dis( gen ) / 4;
+        int sum = 0, min = std::numeric_limits<int>::max(), max = std::numeric_limits<int>::lowest();
+        std::string keys;
+        for ( CS280::AVLmap<int,int>::iterator it = expected.begin(); it != expected.end(); ++it ) {
+            if ( it->Key() < lo or hi < it->Key() ) continue;
+            sum += it->Value();
+            min = std::min( min, it->Value() );
+            max = std::max( max, it->Value() );
+            keys += std::to_string( it->Key() ) + ",";
+        }
+        if ( sums.aggregate( lo, hi ) != sum or mins.aggregate( lo, hi ) != min
+             or maxs.aggregate( lo, hi ) != max or order.aggregate( lo, hi ) != keys
+             or !sums.sanityCheck() or !maxs.sanityCheck() or !order.sanityCheck() ) {
+            std::cout << "Wrong aggregate of [" << lo << ", " << hi << "]\n";
+        }
+    }
+}
+
+// random inserts, erases and node moves under one balancing policy, checked
+// against std::map-like reference contents and the policy invariant
+template< typename Balance >
+void policy_stress( char const * name, int N )
+{
+    using Map = CS280::AVLmap<int,int,CS280::NoAugment,Balance>;
+    Map map, other;
+    std::vector<int> expected( N/2, -1 );
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N/2 - 1 );
+    for ( int i=0; i<N; ++i ) {
+        int key = dis( gen );
+        switch ( i % 5 ) {
+        case 0:
+        case 1:
+            map.erase( map.find( key ) );
+            expected[ key ] = -1;
+            break;
+        case 2: {
+            typename Map::node_type node = map.extract( map.find( key ) );
+            if ( node ) {
+                other.insert( std::move( node ) );
+                node = other.extract( other.find( key ) );
+                map.insert( std::move( node ) );
+            }
+            break;
+        }
+        default:
+            map[ key ] = i;
+            expected[ key ] = i;
+        }
+
+        if ( !map.sanityCheck() or !other.sanityCheck() ) {
+            std::cout << name << ": broken after " << i << " operations\n";
+            return;
+        }
+    }
+
+    Map copy( map );
+    int size = 0;
+    for ( int key=0; key<N/2; ++key ) {
+        typename Map::iterator it = copy.find( key );
+        if ( expected[ key ] == -1 ? it != copy.end() : it == copy.end() or it->Value() != expected[ key ] ) {
+            std::cout << name << ": wrong value of " << key << "\n";
+        }
+        size += expected[ key ] != -1;
+    }
+    if ( !copy.sanityCheck() or copy.size() != static_cast<unsigned>( size ) ) {
+        std::cout << name << ": broken copy\n";
+    }
+}
+
+// every balancing policy keeps its invariant through inserts, erases,
+// extract/insert and copies
+void test25()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    policy_stress<CS280::AVLBalance>( "AVL", 4000 );
+    policy_stress<CS280::RedBlackBalance>( "red-black", 4000 );
+    policy_stress<CS280::WAVLBalance>( "WAVL", 4000 );
+    policy_stress<CS280::TreapBalance>( "treap", 4000 );
+}
+
+// adaptive policy: sequential inserts, skewed finds that restructure the
+// tree, mass erases that shrink it, all keeping the depth bound
+void test26()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    using Map = CS280::AVLmap<int,int,CS280::NoAugment,CS280::AdaptiveBalance>;
+    int N = 5000;
+    Map map;
+    for ( int i=0; i<N; ++i ) {
+        map[ i ] = i;
+    }
+    if ( !map.sanityCheck() ) std::cout << "Error after inserts\n";
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N-1 );
+    for ( int i=0; i<100000; ++i ) {
+        // a few hot keys take most of the finds
+        int key = i % 10 ? dis( gen ) % 16 * 97 : dis( gen );
+        Map::iterator it = map.find( key );
+        if ( it == map.end() or it->Value() != key ) {
+            std::cout << "cannot find value " << key << std::endl;
+            return;
+        }
+        if ( i % 5000 == 0 and !map.sanityCheck() ) std::cout << "Error after finds\n";
+    }
+    if ( !map.sanityCheck() ) std::cout << "Error after finds\n";
+
+    for ( int i=0; i<N; i+=4 ) {
+        map.erase( map.find( i ) );
+        map.erase( map.find( i+1 ) );
+        map.erase( map.find( i+2 ) );
+    }
+    if ( !map.sanityCheck() or map.size() != static_cast<unsigned>( N/4 ) ) std::cout << "Error after erases\n";
+
+    policy_stress<CS280::AdaptiveBalance>( "adaptive", 4000 );
+}
+
+// hot key cache: finds, erases, extract/insert, copies and moves of a cached
+// map agree with an uncached one
+void test27()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 4000;
+    using Map = CS280::TunableAVLmap<int,int>;
+    Map map;
+    CS280::AVLmap<int,int> expected;
+    for ( int i=0; i<N/2; ++i ) {
+        map[ i ] = expected[ i ] = i;
+    }
+    map.cache_lookups( 100 ); // rounded up to 128 slots, so keys collide
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N/2 - 1 );
+    for ( int i=0; i<N; ++i ) {
+        int key = i % 10 ? dis( gen ) % 64 : dis( gen );
+        switch ( i % 7 ) {
+        case 0:
+            map.erase( map.find( key ) );
+            expected.erase( expected.find( key ) );
+            break;
+        case 1: {
+            Map::node_type node = map.extract( key );
+            if ( node and i % 2 ) {
+                node.mapped() = i;
+                map.insert( std::move( node ) );
+                expected[ key ] = i;
+            } else if ( node ) {
+                expected.erase( expected.find( key ) );
+            }
+            break;
+        }
+        case 2:
+            map[ key ] = i;
+            expected[ key ] = i;
+            break;
+        default: {
+            Map::iterator it = map.find( key );
+            CS280::AVLmap<int,int>::iterator want = expected.find( key );
+            if ( ( it == map.end() ) != ( want == expected.end() ) or ( it != map.end() and it->Value() != want->Value() ) ) {
+                std::cout << "wrong find of " << key << "\n";
+                return;
+            }
+        }
+        }
+    }
+
+    Map copy( map );
+    Map moved( std::move( copy ) );
+    Map const & view = moved;
+    for ( int key=0; key<N/2; ++key ) {
+        map.find( key );
+        CS280::AVLmap<int,int>::iterator want = expected.find( key );
+        Map::const_iterator it = view.find( key );
+        if ( ( it == view.end() ) != ( want == expected.end() ) or ( it != view.end() and it->Value() != want->Value() ) ) {
+            std::cout << "wrong find of " << key << " in the copy\n";
+        }
+        if ( moved[ key ] != ( want == expected.end() ? 0 : want->Value() ) ) {
+            std::cout << "wrong operator[] of " << key << " in the copy\n";
+        }
+    }
+    if ( !map.sanityCheck() or !moved.sanityCheck() or map.size() != expected.size() ) std::cout << "Error\n";
+
+    // only maps that ask for the options carry their state
+    if ( sizeof( CS280::AVLmap<int,int> ) != sizeof( void * ) + sizeof( usize ) ) {
+        std::cout << "plain map of " << sizeof( CS280::AVLmap<int,int> ) << " bytes\n";
+    }
+}
+
+// key filter: no false negatives through inserts, erases, extract/insert,
+// growth past its size and copies, and few false positives
+void test28()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 20000;
+    using Map = CS280::TunableAVLmap<int,int>;
+    Map map;
+    std::vector<bool> present( N, false );
+    map.filter_lookups( 100 ); // outgrown many times over
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N-1 );
+    for ( int i=0; i<2*N; ++i ) {
+        int key = dis( gen );
+        switch ( i % 4 ) {
+        case 0:
+            map.erase( map.find( key ) );
+            present[ key ] = false;
+            break;
+        case 1: {
+            Map::node_type node = map.extract( key );
+            if ( node ) {
+                Map other;
+                other.filter_lookups( 1 );
+                other.insert( std::move( node ) );
+                if ( other.find( key ) == other.end() ) std::cout << "filtered out " << key << " after a move\n";
+                node = other.extract( key );
+                map.insert( std::move( node ) );
+            }
+            break;
+        }
+        default:
+            map[ key ] = key;
+            present[ key ] = true;
+        }
+    }
+
+    Map copy( map );
+    Map const & view = copy;
+    for ( int key=0; key<N; ++key ) {
+        if ( present[ key ] and ( map.find( key ) == map.end() or view.find( key ) == view.end() ) ) {
+            std::cout << "filtered out " << key << "\n";
+        }
+        if ( !present[ key ] and map.find( key ) != map.end() ) {
+            std::cout << "found erased " << key << "\n";
+        }
+    }
+
+    // the filter alone: about 1% false positives, and back to empty once
+    // every key is removed again
+    CS280::CountingBloomFilter filter( N );
+    std::mt19937_64 hashes{ 42 };
+    std::vector<u64> added( N );
+    for ( u64 & hash : added ) {
+        hash = hashes();
+        filter.add( hash );
+    }
+    int false_positives = 0;
+    for ( int i=0; i<N; ++i ) {
+        false_positives += filter.may_contain( hashes() );
+    }
+    if ( false_positives > N / 50 ) std::cout << "false positive rate " << false_positives * 100.0 / N << "%\n";
+    for ( u64 hash : added ) {
+        if ( !filter.may_contain( hash ) ) std::cout << "false negative\n";
+        filter.remove( hash );
+    }
+    int left = 0;
+    for ( u64 hash : added ) {
+        left += filter.may_contain( hash );
+    }
+    if ( left > N / 1000 ) std::cout << left << " keys left after removing all\n";
+}
+
+// random operations on maps with 8 inline entries, their size keeps crossing 8
+// (promoted to a tree) and dropping to 0 (inline again), with copies and
+// moves in between which move the inline entries
+template< typename Balance >
+void small_stress( char const * name, int N )
+{
+    using Map = CS280::TunableAVLmap<int,int,CS280::SumOf<int>,Balance,8>;
+    Map map, other;
+    map.cache_lookups( 16 );
+    std::vector<int> expected( 20, -1 );
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, 19 );
+    for ( int i=0; i<N; ++i ) {
+        int key = dis( gen );
+        switch ( i % 9 ) {
+        case 0:
+            map.erase( map.find( key ) );
+            expected[ key ] = -1;
+            break;
+        case 1: {
+            typename Map::node_type node = map.extract( key );
+            if ( node ) {
+                other.insert( std::move( node ) );
+                node = other.extract( key );
+                map.insert( std::move( node ) );
+            }
+            break;
+        }
+        case 2: {
+            Map moved( std::move( map ) );
+            map = std::move( moved );
+            break;
+        }
+        case 3: {
+            Map copy( map );
+            map = copy;
+            break;
+        }
+        case 4:
+            if ( i % 100 == 4 ) {
+                while ( !map.empty() ) map.erase( map.begin() );
+                std::fill( expected.begin(), expected.end(), -1 );
+            }
+            break;
+        default:
+            if ( ( map.find( key ) != map.end() ) != ( expected[ key ] != -1 ) ) {
+                std::cout << name << ": wrong find of " << key << "\n";
+            }
+            map[ key ] = i;
+            expected[ key ] = i;
+        }
+
+        int sum = 0;
+        typename Map::iterator it = map.begin();
+        for ( int k=0; k<20; ++k ) {
+            if ( expected[ k ] == -1 ) continue;
+            if ( it == map.end() or it->Key() != k or it->Value() != expected[ k ] ) {
+                std::cout << name << ": wrong entry at " << k << " after " << i << " operations\n";
+                return;
+            }
+            sum += expected[ k ];
+            ++it;
+        }
+        if ( it != map.end() or !map.sanityCheck() or !other.sanityCheck() or map.aggregate() != sum ) {
+            std::cout << name << ": broken after " << i << " operations\n";
+            return;
+        }
+    }
+}
+
+// small maps: up to N entries sorted side by side in the map itself, no
+// allocations and less memory than nodes take, a balanced tree past that,
+// and no vtable
+void test29()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    if ( std::is_polymorphic< CS280::AVLmap<int,int> >::value ) {
+        std::cout << "AVLmap has a vtable\n";
+    }
+
+    CS280::SmallAVLmap<int,int,16> map;
+    CS280::AVLmap<int,int> plain;
+    for ( int i=0; i<3; ++i ) {
+        map[ 10 - 3*i ] = i;
+        plain[ 10 - 3*i ] = i;
+    }
+    if ( sizeof( map ) > sizeof( plain ) + 16 * sizeof( std::pair<int,int> ) ) {
+        std::cout << "small map is " << sizeof( map ) << " bytes\n";
+    }
+    if ( map.memory_usage().allocator != 0 or map.memory_usage().links != 0 ) {
+        std::cout << "small map allocated\n";
+    }
+    if ( map.memory_usage().total >= plain.memory_usage().total ) {
+        std::cout << "small map takes " << map.memory_usage().total << " bytes, "
+                  << plain.memory_usage().total << " in nodes\n";
+    }
+
+    for ( int i=3; i<16; ++i ) {
+        map[ ( 7 * i ) % 16 + 100 ] = i;
+    }
+    int previous = -1;
+    for ( CS280::SmallAVLmap<int,int,16>::iterator it = map.begin(); it != map.end(); ++it ) {
+        if ( it->Key() <= previous ) {
+            std::cout << "small map out of order\n";
+        }
+        previous = it->Key();
+    }
+    map[ 50 ] = 16;
+    if ( map.size() != 17 or !map.sanityCheck() or map.stats().height != 5
+         or map.find( 50 )->Value() != 16 or map.find( 4 )->Value() != 2 ) {
+        std::cout << "not balanced after the promotion\n";
+    }
+
+    // moving relocates non trivial keys, inline and on the heap
+    CS280::SmallAVLmap<std::string,int,4> names;
+    for ( int i=0; i<12; ++i ) {
+        names[ "name number " + std::to_string( i ) ] = i;
+    }
+    names.erase( names.find( "name number 3" ) );
+    CS280::SmallAVLmap<std::string,int,4> moved( std::move( names ) );
+    names = std::move( moved );
+    int found = 0;
+    for ( int i=0; i<12; ++i ) {
+        CS280::SmallAVLmap<std::string,int,4>::iterator it = names.find( "name number " + std::to_string( i ) );
+        found += it != names.end() and it->Value() == i;
+    }
+    if ( found != 11 or !names.sanityCheck() or !moved.empty() ) {
+        std::cout << "lost entries in a move\n";
+    }
+
+    small_stress<CS280::AVLBalance>( "AVL", 3000 );
+    small_stress<CS280::RedBlackBalance>( "red-black", 3000 );
+    small_stress<CS280::AdaptiveBalance>( "adaptive", 3000 );
+}
+
+// values in a slab: the nodes hold a pointer, values keep their address
+// through inserts and erases of other keys, and survive extract / insert,
+// copies and moves (std::string values so a leak or double free shows)
+template< usize Inline >
+void slab_stress( char const * name, int N )
+{
+    using Map = CS280::AVLmap<int,std::string,CS280::NoAugment,CS280::AVLBalance,Inline,CS280::SlabValues>;
+    Map map, other;
+    std::vector<std::string> expected( N/4 );
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N/4 - 1 );
+    for ( int i=0; i<N; ++i ) {
+        int key = dis( gen );
+        switch ( i % 8 ) {
+        case 0:
+        case 1:
+            map.erase( map.find( key ) );
+            expected[ key ].clear();
+            break;
+        case 2: {
+            typename Map::node_type node = map.extract( key );
+            if ( node ) {
+                node.mapped() += "!";
+                expected[ key ] += "!";
+                other.insert( std::move( node ) );
+                node = other.extract( key );
+                map.insert( std::move( node ) );
+            }
+            break;
+        }
+        case 3:
+            if ( i % 1000 == 3 ) {
+                Map copy( map );
+                Map moved( std::move( map ) );
+                map = std::move( copy );
+                other = moved;
+                other = Map{}; // handles pass through an empty map
+            }
+            break;
+        default:
+            map[ key ] = "value of " + std::to_string( key ) + " written by operation " + std::to_string( i );
+            expected[ key ] = map[ key ];
+        }
+    }
+
+    for ( int key=0; key<N/4; ++key ) {
+        typename Map::iterator it = map.find( key );
+        if ( expected[ key ].empty() ? it != map.end() : it == map.end() or it->Value() != expected[ key ] ) {
+            std::cout << name << ": wrong value of " << key << "\n";
+        }
+    }
+    if ( !map.sanityCheck() ) {
+        std::cout << name << ": broken\n";
+    }
+}
+
+void test30()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    struct Big { u64 words[32]; };
+    using Slab = CS280::AVLmap<int,Big,CS280::NoAugment,CS280::AVLBalance,0,CS280::SlabValues>;
+    if ( sizeof( Slab::Node ) > sizeof( CS280::AVLmap<int,int>::Node ) + sizeof( Big* ) ) {
+        std::cout << "value stored in the node\n";
+    }
+
+    Slab map;
+    map[ 0 ].words[ 0 ] = 42;
+    Big const * first = &map.find( 0 )->Value();
+    for ( int i=1; i<1000; ++i ) {
+        map[ i ].words[ 0 ] = i;
+        if ( i % 3 == 0 ) map.erase( map.find( i / 2 + 1 ) );
+    }
+    if ( &map.find( 0 )->Value() != first or first->words[ 0 ] != 42 ) {
+        std::cout << "value moved\n";
+    }
+    CS280::AVLmapMemory memory = map.memory_usage();
+    // the value is payload, the pointer to it metadata
+    if ( memory.payload != map.size() * ( sizeof( int ) + sizeof( Big ) )
+         or memory.links + memory.metadata != map.size() * ( sizeof( Slab::Node ) - sizeof( int ) ) ) {
+        std::cout << "wrong memory usage\n";
+    }
+
+    slab_stress<0>( "slab", 8000 );
+    slab_stress<8>( "inline slab", 8000 );
+}
+
+// string keys with long shared prefixes, embedded zeros, bytes above 0x7f
+// and keys that are prefixes of others: finds, order and node handles whose
+// key changes must all agree with a reference while the shared prefix of
+// the map shrinks and grows back (sanityCheck checks every window)
+template< usize Inline >
+void prefix_stress( char const * name, int N )
+{
+    using Map = CS280::AVLmap<std::string,int,CS280::NoAugment,CS280::AVLBalance,Inline>;
+    std::vector<std::string> pool;
+    std::string const pieces[] = { "", "a", "ab", std::string( 1, '\0' ), "\xff", "x/y" };
+    for ( std::string const & a : pieces ) {
+        for ( std::string const & b : pieces ) {
+            for ( std::string const & c : pieces ) {
+                pool.push_back( "https://example.com/" + a + "/" + b + c );
+                pool.push_back( "https://example.com/" + a + b + c );
+            }
+        }
+    }
+    std::string const outliers[] = { "", "h", "https", "https://example.com", "zz", "\xff\xff", std::string( 9, '\0' ) };
+    pool.insert( pool.end(), std::begin( outliers ), std::end( outliers ) );
+    std::sort( pool.begin(), pool.end() );
+    pool.erase( std::unique( pool.begin(), pool.end() ), pool.end() );
+
+    Map map;
+    std::vector<int> expected( pool.size(), -1 );
+
+    std::mt19937 gen{std::random_device{}()};
+    for ( int i=0; i<N; ++i ) {
+        // the first quarter only uses keys sharing the long prefix
+        int const key = std::uniform_int_distribution<int>( 0, static_cast<int>( pool.size() ) - 1 )( gen );
+        if ( i < N/4 and ( pool[ key ].size() < 20 or pool[ key ].compare( 0, 20, "https://example.com/" ) != 0 ) ) {
+            continue;
+        }
+        switch ( i % 6 ) {
+        case 0:
+            map.erase( map.find( pool[ key ] ) );
+            expected[ key ] = -1;
+            break;
+        case 1: {
+            // rekeyed to the next key of the pool if that one is missing
+            typename Map::node_type node = map.extract( pool[ key ] );
+            if ( node ) {
+                int const to = ( key + 1 ) % static_cast<int>( pool.size() );
+                if ( expected[ to ] == -1 ) {
+                    node.key() = pool[ to ];
+                    expected[ to ] = node.mapped();
+                    expected[ key ] = -1;
+                }
+                map.insert( std::move( node ) );
+            }
+            break;
+        }
+        case 2:
+            if ( i % 500 == 2 ) {
+                Map copy( map );
+                map = std::move( copy );
+            }
+            if ( i % 2000 == 2 ) {
+                // empty, the prefix starts over
+                map = Map{};
+                std::fill( expected.begin(), expected.end(), -1 );
+            }
+            break;
+        default:
+            map[ pool[ key ] ] = i;
+            expected[ key ] = i;
+        }
+    }
+
+    for ( usize key=0; key<pool.size(); ++key ) {
+        typename Map::iterator it = map.find( pool[ key ] );
+        if ( expected[ key ] == -1 ? it != map.end() : it == map.end() or it->Value() != expected[ key ] ) {
+            std::cout << name << ": wrong value of key " << key << "\n";
+        }
+    }
+    usize key = 0;
+    for ( typename Map::iterator it = map.begin(); it != map.end(); ++it, ++key ) {
+        while ( key < pool.size() and expected[ key ] == -1 ) ++key;
+        if ( key == pool.size() or it->Key() != pool[ key ] ) {
+            std::cout << name << ": out of order\n";
+            break;
+        }
+    }
+    if ( !map.sanityCheck() ) {
+        std::cout << name << ": broken\n";
+    }
+}
+
+void test31()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    // windows order like the strings (unsigned bytes), zero padding leaves
+    // "a" and "a\0" to the full compare
+    using Traits = CS280::KeyTraits<std::string>;
+    if ( Traits::window( "a", 0 ) != Traits::window( std::string( "a\0", 2 ), 0 )
+         or not( Traits::window( "ab", 0 ) > Traits::window( "a", 0 ) ) ) {
+        std::cout << "wrong window\n";
+    }
+    if ( not( Traits::window( "\x7f", 0 ) < Traits::window( "\x80", 0 ) )
+         or Traits::window( "https://ab", 8 ) != Traits::window( "ab", 0 )
+         or Traits::window( "abc", 5 ) != 0
+         or Traits::shared( "https://a", "https://b", 100 ) != 8
+         or Traits::shared( "https://a", "https://b", 4 ) != 4 ) {
+        std::cout << "wrong window\n";
+    }
+
+    prefix_stress<0>( "prefix", 20000 );
+    prefix_stress<8>( "inline prefix", 20000 );
+}
+
+// RadixMap against a reference: keys from lo to hi inserted, erased, found
+// and iterated in order while the buckets widen, through copies and moves
+template< typename K, usize Bits >
+void radix_stress( char const * name, long lo, long hi, int N )
+{
+    using Map = CS280::RadixMap<K,int,Bits>;
+    Map map;
+    std::vector<int> expected( static_cast<usize>( hi - lo + 1 ), -1 );
+
+    std::mt19937 gen{std::random_device{}()};
+    // mostly near the middle, so the range widens over time
+    std::uniform_int_distribution<long> wide( lo, hi );
+    std::uniform_int_distribution<long> near( -20, 20 );
+    long const middle = lo + ( hi - lo ) / 2;
+    for ( int i=0; i<N; ++i ) {
+        long const key = i % 10 == 0 ? wide( gen ) : middle + near( gen ) * ( 1 + i / 1000 ) % ( ( hi - lo ) / 2 );
+        int & slot = expected[ static_cast<usize>( key - lo ) ];
+        switch ( i % 5 ) {
+        case 0:
+            map.erase( map.find( static_cast<K>( key ) ) );
+            slot = -1;
+            break;
+        case 1:
+            if ( i % 700 == 1 ) {
+                Map copy( map );
+                Map moved( std::move( map ) );
+                if ( !map.empty() or map.begin() != map.end() or moved.size() != copy.size() ) {
+                    std::cout << name << ": moved from not empty\n";
+                }
+                map = copy;
+            }
+            break;
+        default:
+            map[ static_cast<K>( key ) ] = i;
+            slot = i;
+        }
+    }
+
+    Map const & view = map;
+    usize present = 0;
+    for ( long key=lo; key<=hi; ++key ) {
+        int const value = expected[ static_cast<usize>( key - lo ) ];
+        typename Map::const_iterator it = view.find( static_cast<K>( key ) );
+        if ( value == -1 ? it != view.end() : it == view.end() or it->Value() != value ) {
+            std::cout << name << ": wrong value of " << key << "\n";
+        }
+        present += value != -1;
+    }
+    long last = lo - 1;
+    usize seen = 0;
+    for ( typename Map::iterator it = map.begin(); it != map.end(); ++it, ++seen ) {
+        if ( static_cast<long>( it->Key() ) <= last ) {
+            std::cout << name << ": out of order\n";
+            break;
+        }
+        last = static_cast<long>( it->Key() );
+    }
+    if ( seen != present or map.size() != present or !map.sanityCheck() ) {
+        std::cout << name << ": broken\n";
+    }
+}
+
+void test32()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    radix_stress<int,8>( "int", -100000, 100000, 40000 );
+    radix_stress<long,12>( "long", -3, 3000000, 40000 );
+    radix_stress<unsigned char,12>( "byte", 0, 255, 5000 );
+    radix_stress<short,4>( "short", -32768, 32767, 20000 );
+
+    // dense keys settle at about n / 2^Bits per bucket
+    CS280::RadixMap<u64,u64> dense;
+    for ( u64 key=0; key<100000; ++key ) {
+        dense[ key ] = key;
+    }
+    if ( dense.bucket_bits() != 5 or !dense.sanityCheck() ) {
+        std::cout << "dense keys in " << dense.bucket_bits() << " bit buckets\n";
+    }
+    // the extremes of the key type fit too
+    dense[ std::numeric_limits<u64>::max() ] = 1;
+    dense[ 0 ] = 2;
+    if ( dense.find( std::numeric_limits<u64>::max() ) == dense.end() or dense.find( 0 )->Value() != 2
+         or dense.size() != 100001 or !dense.sanityCheck() ) {
+        std::cout << "extremes lost\n";
+    }
+}
+
+// keys of the fixtures below: ints, and strings sharing a long prefix
+int int_key( int key ) { return key; }
+std::string text_key( int key ) { return "/srv/key " + std::to_string( key ); }
+
+template< typename Map >
+struct MapOf { using type = Map; };
+
+// runs fixture( MapOf<Map>{}, name, key_of, N ) on each balancing policy,
+// on inline entries (kept small, and in a tree with values in the slab)
+// and on string keys
+template< typename Fixture >
+void for_each_policy( Fixture fixture, int N )
+{
+    fixture( MapOf<CS280::TunableAVLmap<int,int>>{}, "AVL", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::RedBlackBalance>>{}, "red-black", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::WAVLBalance>>{}, "WAVL", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::TreapBalance>>{}, "treap", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::AdaptiveBalance>>{}, "adaptive", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::AVLBalance,16>>{}, "inline small", int_key, 12 );
+    fixture( MapOf<CS280::TunableAVLmap<int,int,CS280::NoAugment,CS280::AVLBalance,16,CS280::SlabValues>>{}, "inline slab", int_key, N );
+    fixture( MapOf<CS280::TunableAVLmap<std::string,int,CS280::NoAugment,CS280::RedBlackBalance>>{}, "string red-black", text_key, N );
+}
+
+// N inserts of random keys out of 2N, a third of them followed by an erase
+template< typename Map, typename KeyOf >
+void fill_random( Map & map, KeyOf key_of, int N, std::mt19937 & gen )
+{
+    std::uniform_int_distribution<int> dis( 0, 2 * N - 1 );
+    for ( int i=0; i<N; ++i ) {
+        map[ key_of( dis( gen ) ) ] = i;
+        if ( i % 3 == 0 ) map.erase( map.find( key_of( dis( gen ) ) ) );
+    }
+}
+
+// compact between inserts, erases, node handles and copies: values, order
+// and the policy must survive it, and afterwards the nodes must fill one
+// block (in key order, or with the root first for van Emde Boas)
+template< typename Map, typename KeyOf >
+void compact_stress( char const * name, KeyOf key_of, int N )
+{
+    Map map, other;
+    map.cache_lookups( 64 );
+    std::vector<int> expected( N/4, -1 );
+
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, N/4 - 1 );
+    for ( int i=0; i<N; ++i ) {
+        int const key = dis( gen );
+        switch ( i % 8 ) {
+        case 0:
+            map.erase( map.find( key_of( key ) ) );
+            expected[ key ] = -1;
+            break;
+        case 1: {
+            typename Map::node_type node = map.extract( key_of( key ) );
+            if ( node ) {
+                other.insert( std::move( node ) );
+                map.insert( other.extract( key_of( key ) ) );
+            }
+            break;
+        }
+        case 2:
+            if ( i % 997 == 2 ) {
+                map.compact( i % 2 ? CS280::NodeLayout::VanEmdeBoas : CS280::NodeLayout::InOrder );
+                if ( !map.sanityCheck() ) {
+                    std::cout << name << ": broken by compact\n";
+                }
+            }
+            break;
+        case 3:
+            if ( i % 1500 == 3 ) {
+                Map copy( map );
+                map = std::move( copy );
+            }
+            break;
+        default:
+            map[ key_of( key ) ] = i;
+            expected[ key ] = i;
+        }
+    }
+    for ( CS280::NodeLayout layout : { CS280::NodeLayout::InOrder, CS280::NodeLayout::VanEmdeBoas } ) {
+        map.compact( layout );
+
+        for ( int key=0; key<N/4; ++key ) {
+            typename Map::iterator it = map.find( key_of( key ) );
+            if ( expected[ key ] == -1 ? it != map.end() : it == map.end() or it->Value() != expected[ key ] ) {
+                std::cout << name << ": wrong value of " << key << "\n";
+            }
+        }
+        if ( !map.sanityCheck() or map.memory_usage().allocator != 0 ) {
+            std::cout << name << ": broken\n";
+        }
+        if ( map.memory_usage().links == 0 ) {
+            continue; // small, no nodes to lay out
+        }
+
+        std::vector<char const *> addresses;
+        for ( typename Map::iterator it = map.begin(); it != map.end(); ++it ) {
+            addresses.push_back( reinterpret_cast<char const *>( &*it ) );
+        }
+        char const * const median = addresses[ addresses.size() / 2 ];
+        bool const in_order = std::is_sorted( addresses.begin(), addresses.end() );
+        std::sort( addresses.begin(), addresses.end() );
+        for ( usize i=1; i<addresses.size(); ++i ) {
+            if ( addresses[ i ] - addresses[ i - 1 ] != sizeof( typename Map::Node ) ) {
+                std::cout << name << ": nodes not side by side\n";
+                break;
+            }
+        }
+        if ( layout == CS280::NodeLayout::InOrder ? !in_order : median != addresses.front() ) {
+            std::cout << name << ": wrong layout\n";
+        }
+    }
+}
+
+void test33()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    using CS280::NodeLayout;
+    for_each_policy( []( auto map, char const * name, auto key_of, int N ) {
+        compact_stress<typename decltype( map )::type>( name, key_of, N );
+    }, 20000 );
+
+    // sums are recomputed for the new shape, erased slots are reused
+    CS280::TunableAVLmap<int,int,CS280::SumOf<int>> sums;
+    for ( int i=0; i<1000; ++i ) {
+        sums[ i ] = i;
+    }
+    sums.compact( NodeLayout::VanEmdeBoas );
+    for ( int i=0; i<1000; i+=2 ) {
+        sums.erase( sums.find( i ) );
+    }
+    for ( int i=0; i<1000; i+=2 ) {
+        sums[ i ] = 1;
+    }
+    if ( sums.aggregate() != 250000 + 500 or sums.memory_usage().allocator != 0 or !sums.sanityCheck() ) {
+        std::cout << "wrong sums " << sums.aggregate() << "\n";
+    }
+}
+
+// value that counts its live instances, frees may happen on another thread
+struct Counted {
+    static std::atomic<int> live;
+    int value = 0;
+    Counted() { ++live; }
+    Counted( Counted const & rhs ) : value( rhs.value ) { ++live; }
+    Counted( Counted && rhs ) : value( rhs.value ) { ++live; }
+    Counted & operator=( Counted const & ) = default;
+    Counted & operator=( Counted && ) = default;
+    ~Counted() { --live; }
+    operator int() const { return value; } // summed by SumOf<int>
+};
+std::atomic<int> Counted::live{ 0 };
+
+// clear, clear_async and deferred frees through the destructor and both
+// assignments: every value is destroyed exactly once, and the map works
+// on while the old nodes are freed
+template< typename Map >
+void deferred_stress( char const * name )
+{
+    Counted::live = 0;
+    {
+        Map map;
+        map.cache_lookups( 32 );
+        map.filter_lookups( 64 );
+        for ( int i=0; i<5000; ++i ) map[ i ].value = i;
+        map.clear_async();
+        for ( int i=0; i<100; ++i ) map[ i * 3 ].value = i;
+        if ( map.size() != 100 or map.find( 3 ) == map.end() or map.find( 3 )->Value().value != 1
+             or map.find( 4 ) != map.end() or !map.sanityCheck() ) {
+            std::cout << name << ": wrong after clear_async\n";
+        }
+        map.clear();
+        if ( !map.empty() or map.begin() != map.end() ) {
+            std::cout << name << ": wrong after clear\n";
+        }
+
+        map.defer_frees( true );
+        for ( int i=0; i<3000; ++i ) map[ i ].value = i;
+        Map copy( map );
+        Map other;
+        other[ -1 ];
+        other = copy;        // freed at once, other does not defer
+        copy = Map{};        // the constructor took the setting over
+        map = other;
+        if ( map.size() != 3000 or map.find( 2999 )->Value().value != 2999 or !map.sanityCheck() ) {
+            std::cout << name << ": wrong after deferred assignments\n";
+        }
+    }                        // map and copy deferred, other not
+    CS280::DeferredFree::instance().wait();
+    if ( Counted::live != 0 ) {
+        std::cout << name << ": " << Counted::live << " values not destroyed\n";
+    }
+}
+
+void test34()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    deferred_stress<CS280::TunableAVLmap<int,Counted>>( "plain" );
+    deferred_stress<CS280::TunableAVLmap<int,Counted,CS280::SumOf<int>,CS280::RedBlackBalance>>( "red-black" );
+    deferred_stress<CS280::TunableAVLmap<int,Counted,CS280::NoAugment,CS280::AVLBalance,16,CS280::SlabValues>>( "inline slab" );
+
+    // copies and frees of a big map, then of a compacted one
+    CS280::TunableAVLmap<int,int> big;
+    for ( int i=0; i<1000000; ++i ) big[ i ] = i;
+    CS280::TunableAVLmap<int,int> copy( big );
+    big.compact( CS280::NodeLayout::VanEmdeBoas );
+    copy = big;
+    if ( copy.size() != big.size() or !copy.sanityCheck() or copy.find( 777777 )->Value() != 777777 ) {
+        std::cout << "wrong copy\n";
+    }
+}
+
+// a value whose copy throws once the countdown runs out
+struct Fragile : Counted {
+    static std::atomic<int> copies_left;
+    Fragile() = default;
+    Fragile( Fragile const & rhs ) : Counted( rhs ) {
+        if ( --copies_left == 0 ) throw std::runtime_error( "copy failed" );
+    }
+    Fragile( Fragile && rhs ) = default;
+    Fragile & operator=( Fragile const & ) = default;
+    Fragile & operator=( Fragile && ) = default;
+};
+std::atomic<int> Fragile::copies_left{ 0 };
+
+// maps whose copies stay on one thread, as their values go to one slab
+template< typename Map >
+struct CopiedSerially : std::false_type {};
+
+template< typename K, typename V, typename A, typename B, usize N, typename O >
+struct CopiedSerially<CS280::AVLmap<K,V,A,B,N,CS280::SlabValues,O>> : std::true_type {};
+
+// parallel copies of a map shaped by erases: same entries and shape, one
+// block of nodes, and both maps change independently afterwards
+template< typename Map, typename KeyOf >
+void parallel_stress( char const * name, KeyOf key_of, int N )
+{
+    Map map;
+    map.parallel_copies( 4 );
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, 2 * N - 1 );
+    fill_random( map, key_of, N, gen );
+
+    Map copy( map );
+    Map other;
+    other = copy;
+    for ( Map * const to : { &copy, &other } ) {
+        bool same = to->size() == map.size() and to->sanityCheck() and to->stats().height == map.stats().height
+                    and ( CopiedSerially<Map>::value or to->memory_usage().allocator == 0 );
+        for ( typename Map::iterator a = map.begin(), b = to->begin(); same and a != map.end(); ++a, ++b ) {
+            same = a->Key() == b->Key() and a->Value() == b->Value() and &*a != &*b;
+        }
+        if ( !same ) {
+            std::cout << name << ": wrong copy\n";
+        }
+    }
+
+    usize const size = map.size();
+    for ( int i=0; i<N; ++i ) {
+        copy.erase( copy.find( key_of( dis( gen ) ) ) );
+        copy[ key_of( dis( gen ) ) ] = i;
+    }
+    copy.clear();
+    if ( map.size() != size or !map.sanityCheck() or !other.sanityCheck() ) {
+        std::cout << name << ": copies not independent\n";
+    }
+}
+
+void test35()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    for_each_policy( []( auto map, char const * name, auto key_of, int N ) {
+        parallel_stress<typename decltype( map )::type>( name, key_of, N );
+    }, 100000 );
+    if ( CS280::TaskPool::instance().size() != 3 ) {
+        std::cout << "copies did not reuse the threads of the pool\n";
+    }
+
+    // the sums of the copy are its own
+    CS280::TunableAVLmap<int,int,CS280::SumOf<int>> sums;
+    sums.parallel_copies( 0 );
+    for ( int i=0; i<100000; ++i ) sums[ i ] = 1;
+    CS280::TunableAVLmap<int,int,CS280::SumOf<int>> copy( sums );
+    copy[ 5 ] = 11;
+    if ( sums.aggregate() != 100000 or copy.aggregate() != 100010 ) {
+        std::cout << "wrong sums\n";
+    }
+
+    // a copy that throws half way frees what it built and leaves the
+    // assigned to map empty
+    Counted::live = 0;
+    {
+        CS280::TunableAVLmap<int,Fragile> fragile;
+        fragile.parallel_copies( 4 );
+        for ( int i=0; i<100000; ++i ) fragile[ i ].value = i;
+        CS280::TunableAVLmap<int,Fragile> target;
+        for ( int copies : { 3, 50000, 99999 } ) {
+            Fragile::copies_left = copies;
+            try {
+                target = fragile;
+                std::cout << "copy did not throw\n";
+            } catch ( std::runtime_error const & ) {
+            }
+            Fragile::copies_left = 0;
+            if ( !target.empty() or Counted::live != 100000 ) {
+                std::cout << "copy leaked " << Counted::live - 100000 << "\n";
+            }
+        }
+    }
+    if ( Counted::live != 0 ) {
+        std::cout << Counted::live << " values not destroyed\n";
+    }
+}
+
+// copy assignment refreshing a replica from a master: the replica keeps its
+// nodes, allocating only when the master outgrew it
+template< typename Map, typename KeyOf >
+void refresh_stress( char const * name, KeyOf key_of, int N )
+{
+    Map master, replica;
+    for ( int i=0; i<N; ++i ) master[ key_of( i * 7 % N ) ] = i;
+    replica = master;
+
+    auto nodes_of = []( Map & map ) {
+        std::vector<typename Map::Entry *> nodes;
+        for ( typename Map::iterator it = map.begin(); it != map.end(); ++it ) nodes.push_back( &*it );
+        return nodes;
+    };
+    auto same = [&]() {
+        bool equal = replica.size() == master.size() and replica.sanityCheck();
+        for ( typename Map::iterator a = master.begin(), b = replica.begin(); equal and a != master.end(); ++a, ++b ) {
+            equal = a->Key() == b->Key() and a->Value() == b->Value();
+        }
+        return equal;
+    };
+
+    // new values, same shape: every key stays in its node
+    std::vector<typename Map::Entry *> const before = nodes_of( replica );
+    for ( int i=0; i<N; i+=3 ) master[ key_of( i ) ] = -i;
+    replica = master;
+    if ( !same() or nodes_of( replica ) != before ) {
+        std::cout << name << ": nodes moved on refresh\n";
+    }
+
+    // churn, the master as big as before: no node allocated
+    for ( int i=0; i<N; i+=5 ) master.erase( master.find( key_of( i ) ) );
+    for ( int i=0; i<N; i+=5 ) master[ key_of( N + i ) ] = i;
+    replica = master;
+    std::vector<typename Map::Entry *> after = nodes_of( replica );
+    std::vector<typename Map::Entry *> sorted = before;
+    std::sort( sorted.begin(), sorted.end() );
+    std::sort( after.begin(), after.end() );
+    if ( !same() or after != sorted ) {
+        std::cout << name << ": nodes allocated on refresh\n";
+    }
+
+    // bigger, then smaller
+    for ( int i=0; i<N/2; ++i ) master[ key_of( 2 * N + i ) ] = i;
+    replica = master;
+    bool const grew = same();
+    for ( int i=0; i<N; ++i ) master.erase( master.find( key_of( 2 * N + i ) ) );
+    replica = master;
+    if ( !grew or !same() ) {
+        std::cout << name << ": wrong after resize\n";
+    }
+}
+
+void test36()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    for_each_policy( []( auto map, char const * name, auto key_of, int N ) {
+        refresh_stress<typename decltype( map )::type>( name, key_of, N );
+    }, 3000 );
+
+    // sums are recomputed, nodes of a compacted block are reused
+    CS280::TunableAVLmap<int,int,CS280::SumOf<int>> master, replica;
+    for ( int i=0; i<1000; ++i ) master[ i ] = 1;
+    replica = master;
+    replica.compact();
+    master[ 5 ] = 11;
+    replica = master;
+    if ( replica.aggregate() != 1010 or replica.memory_usage().allocator != 0 or !replica.sanityCheck() ) {
+        std::cout << "wrong sums " << replica.aggregate() << "\n";
+    }
+
+    // a refresh that throws half way leaves the replica empty, nothing leaks
+    Counted::live = 0;
+    {
+        CS280::AVLmap<int,Fragile> fragile, target;
+        for ( int i=0; i<1000; ++i ) fragile[ i ].value = i;
+        for ( int i=0; i<900; ++i ) target[ i ].value = i;
+        Fragile::copies_left = 50;
+        try {
+            target = fragile;
+            std::cout << "refresh did not throw\n";
+        } catch ( std::runtime_error const & ) {
+        }
+        Fragile::copies_left = 0;
+        if ( !target.empty() or !target.sanityCheck() or Counted::live != 1000 ) {
+            std::cout << "refresh leaked " << Counted::live - 1000 << "\n";
+        }
+        target = fragile;
+        if ( target.size() != 1000 or target.find( 999 )->Value().value != 999 ) {
+            std::cout << "wrong refresh after throw\n";
+        }
+    }
+    if ( Counted::live != 0 ) {
+        std::cout << Counted::live << " values not destroyed\n";
+    }
+}
+
+// columns of the whole map and of ranges against a walk with iterators,
+// on one thread and on four
+template< typename Map, typename KeyOf >
+void export_stress( char const * name, KeyOf key_of, int N )
+{
+    using Key = std::decay_t<decltype( key_of( 0 ) )>;
+    Map map;
+    std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<int> dis( 0, 2 * N - 1 );
+    fill_random( map, key_of, N, gen );
+
+    auto check = [&]( Key const * lo, Key const * hi ) {
+        std::vector<Key> keys( 3, key_of( -1 ) );
+        std::vector<int> values( 5, -1 );
+        if ( lo ) map.export_columns( *lo, *hi, keys, values );
+        else map.export_columns( keys, values );
+
+        usize i = 0;
+        bool right = keys.size() == values.size();
+        for ( typename Map::iterator it = map.begin(); right and it != map.end(); ++it ) {
+            if ( lo and ( it->Key() < *lo or *hi < it->Key() ) ) continue;
+            right = i < keys.size() and keys[ i ] == it->Key() and values[ i ] == it->Value();
+            ++i;
+        }
+        if ( !right or i != keys.size() ) {
+            std::cout << name << ": wrong columns\n";
+        }
+    };
+
+    for ( usize threads : { 1, 4 } ) {
+        map.parallel_copies( threads );
+        check( nullptr, nullptr );
+        for ( int i=0; i<20; ++i ) {
+            Key const lo = key_of( dis( gen ) - N / 10 );
+            Key const hi = key_of( i % 2 ? dis( gen ) : dis( gen ) + N );
+            check( &lo, &hi );
+        }
+    }
+}
+
+void test37()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    for_each_policy( []( auto map, char const * name, auto key_of, int N ) {
+        export_stress<typename decltype( map )::type>( name, key_of, N );
+    }, 100000 );
+
+    // an empty map and an empty range
+    CS280::AVLmap<int,int> empty;
+    std::vector<int> keys{ 1, 2 }, values{ 3 };
+    empty.export_columns( keys, values );
+    if ( !keys.empty() or !values.empty() ) {
+        std::cout << "columns of an empty map\n";
+    }
+    empty[ 1 ] = 2;
+    empty.export_columns( 5, 3, keys, values );
+    if ( !keys.empty() or !values.empty() ) {
+        std::cout << "columns of an empty range\n";
+    }
+}
+
+void test38()
+{
+    std::cout << "-------- " << __func__ << " --------\n";
+    int N = 20000;
+    CS280::AVLmap<int,int,CS280::MerkleDigest> a, b;
+    CS280::AVLmap<int,long,CS280::SumOf<long>> sums;
+    for ( int i=0; i<N; ++i ) {
+        a[ i ] = i;
+        b[ i ] = i;
+        sums[ i ] = i;
+    }
+    u64 digest = a.digest();
+    long sum = sums.aggregate( 100, 199 );
+
+    // the last values written are still pending, the const queries below
+    // fold them in without writing to the maps
+    a[ 7 ] = 8;
+    a[ 7 ] = 7;
+    b[ N ] = N;
+    sums[ 150 ] = 1000;
+    sum += 1000 - 150;
+
+    CS280::AVLmap<int,int,CS280::MerkleDigest> const & ca = a;
+    CS280::AVLmap<int,int,CS280::MerkleDigest> const & cb = b;
+    CS280::AVLmap<int,long,CS280::SumOf<long>> const & csums = sums;
+    std::atomic<int> wrong{ 0 };
+    auto read = [&] {
+        for ( int round=0; round<20; ++round ) {
+            int differences = 0;
+            CS280::AVLmap<int,int,CS280::MerkleDigest>::diff( ca, cb, [&]( int const &, int const *, int const * ) {
+                ++differences;
+            } );
+            if ( ca.digest() != digest or csums.aggregate( 100, 199 ) != sum or differences != 1 ) {
+                ++wrong;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for ( int t=0; t<4; ++t ) {
+        threads.emplace_back( read );
+    }
+    for ( std::thread & thread : threads ) {
+        thread.join();
+    }
+    if ( wrong != 0 ) {
+        std::cout << "wrong const queries " << wrong << "\n";
+    }
+    sums[ N ] = 0; // settles the pending write
+    if ( a.digest() != digest or sums.aggregate( 100, 199 ) != sum or !a.sanityCheck() or !sums.sanityCheck() ) {
+        std::cout << "wrong settled queries\n";
+    }
+}
+
 void (*pTests[])(void) = 
 {
     test0,test1,test2,test3,test4,test5,test6,test7,test8,test9,test10,test11,test12,test13,
-    test14,test15,test16,test17
+    test14,test15,test16,test17,test18,test19,test20,test21,test22,test23,test24,test25,test26,test27,test28,test29,test30,
+    test31,test32,test33,test34,test35,test36,test37,test38
 };
 
 int main(int argc, char **argv) 
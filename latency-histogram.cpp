@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+
+#ifndef LATENCY_HISTOGRAM_H
+#include "latency-histogram.h"
+#endif
+
+#ifndef LATENCY_HISTOGRAM_CPP
+#define LATENCY_HISTOGRAM_CPP
+
+namespace CS280 {
+
+  inline LatencyHistogram::LatencyHistogram(): counts{}, total{0}, largest{0} {}
+
+  inline auto LatencyHistogram::record(u64 nanoseconds) -> void {
+    counts[bucket(nanoseconds)]++;
+    total++;
+    largest = std::max(largest, nanoseconds);
+  }
+
+  inline auto LatencyHistogram::merge(const LatencyHistogram& other) -> void {
+    for (usize i = 0; i < BUCKETS; i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    largest = std::max(largest, other.largest);
+  }
+
+  inline auto LatencyHistogram::reset() -> void {
+    std::fill(counts, counts + BUCKETS, 0);
+    total = 0;
+    largest = 0;
+  }
+
+  inline auto LatencyHistogram::count() const -> u64 {
+    return total;
+  }
+
+  inline auto LatencyHistogram::max() const -> u64 {
+    return largest;
+  }
+
+  inline auto LatencyHistogram::percentile(double fraction) const
+    -> u64 {
+    if (total == 0) {
+      return 0;
+    }
+
+    const double wanted = fraction * static_cast<double>(total);
+    u64 seen = 0;
+
+    for (usize i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+
+      if (counts[i] and static_cast<double>(seen) >= wanted) {
+        return std::min(upper_bound(i), largest);
+      }
+    }
+
+    return largest;
+  }
+
+  inline auto LatencyHistogram::print_text(std::ostream& os) const -> void {
+    os << "count " << total << " p50 " << percentile(0.5) << "ns p99 "
+       << percentile(0.99) << "ns p99.9 " << percentile(0.999) << "ns max "
+       << largest << "ns";
+  }
+
+  inline auto LatencyHistogram::print_json(std::ostream& os) const -> void {
+    os << "{\"count\":" << total << ",\"p50\":" << percentile(0.5)
+       << ",\"p99\":" << percentile(0.99) << ",\"p99.9\":" << percentile(0.999)
+       << ",\"max\":" << largest << "}";
+  }
+
+  inline auto LatencyHistogram::bucket(u64 value) -> usize {
+    if (value < (u64{1} << SUB_BITS)) {
+      return static_cast<usize>(value);
+    }
+
+    // position of the highest set bit
+    unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+
+    if (exponent >= MAX_EXPONENT) {
+      return BUCKETS - 1;
+    }
+
+    const u64 sub = (value >> (exponent - SUB_BITS))
+                            & ((u64{1} << SUB_BITS) - 1);
+
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+  }
+
+  inline auto LatencyHistogram::upper_bound(usize index)
+    -> u64 {
+    if (index < (usize{1} << SUB_BITS)) {
+      return index;
+    }
+
+    const unsigned exponent = static_cast<unsigned>(index >> SUB_BITS)
+                            + SUB_BITS - 1;
+    const u64 sub = index & ((usize{1} << SUB_BITS) - 1);
+    const u64 width = u64{1} << (exponent - SUB_BITS);
+
+    return (u64{1} << exponent) + (sub + 1) * width - 1;
+  }
+
+  inline auto AVLmapLatency::reset() -> void {
+    insert.reset();
+    find.reset();
+    erase.reset();
+  }
+
+  inline auto AVLmapLatency::print_text(std::ostream& os) const -> void {
+    os << "operator[] ";
+    insert.print_text(os);
+    os << "\nfind       ";
+    find.print_text(os);
+    os << "\nerase      ";
+    erase.print_text(os);
+    os << "\n";
+  }
+
+  inline auto AVLmapLatency::print_json(std::ostream& os) const -> void {
+    os << "{\"insert\":";
+    insert.print_json(os);
+    os << ",\"find\":";
+    find.print_json(os);
+    os << ",\"erase\":";
+    erase.print_json(os);
+    os << "}";
+  }
+
+  inline auto thread_latency() -> AVLmapLatency& {
+    thread_local AVLmapLatency latency{};
+    return latency;
+  }
+
+  inline LatencyTimer::LatencyTimer(
+    LatencyHistogram& map,
+    LatencyHistogram& thread
+  ):
+      map{&map}, thread{thread}, start{std::chrono::steady_clock::now()} {}
+
+  inline LatencyTimer::LatencyTimer(LatencyHistogram& thread):
+      map{nullptr}, thread{thread}, start{std::chrono::steady_clock::now()} {}
+
+  inline LatencyTimer::~LatencyTimer() {
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto nanoseconds = static_cast<u64>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+    );
+
+    if (map) {
+      map->record(nanoseconds);
+    }
+    thread.record(nanoseconds);
+  }
+} // namespace CS280
+
+#endif
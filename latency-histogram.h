@@ -0,0 +1,208 @@
+#pragma once
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <chrono>
+#include <ostream>
+
+#include "int-types.h"
+
+namespace CS280 {
+
+  /**
+   * @brief HDR style histogram of latencies in nanoseconds. Values below 16
+   * get a bucket each, above that every power of two is split into 16 linear
+   * buckets, so any recorded value is known to within 1/16 (~6%). Recording
+   * is an increment in a fixed array, no allocation or locking
+   */
+  class LatencyHistogram {
+
+  public:
+
+    /**
+     * @brief Empty histogram
+     */
+    LatencyHistogram();
+
+    /**
+     * @brief Records one latency
+     */
+    auto record(u64 nanoseconds) -> void;
+
+    /**
+     * @brief Adds the counts of another histogram (eg. of another thread)
+     */
+    auto merge(const LatencyHistogram& other) -> void;
+
+    /**
+     * @brief Zeroes all counts
+     */
+    auto reset() -> void;
+
+    /**
+     * @brief Number of recorded values
+     */
+    [[nodiscard]] auto count() const -> u64;
+
+    /**
+     * @brief Biggest recorded value
+     */
+    [[nodiscard]] auto max() const -> u64;
+
+    /**
+     * @brief Value at or below which the given fraction (0..1) of the
+     * recorded values are, reported as the upper bound of its bucket
+     */
+    [[nodiscard]] auto percentile(double fraction) const -> u64;
+
+    /**
+     * @brief Prints "count p50 p99 p99.9 max" in nanoseconds
+     */
+    auto print_text(std::ostream& os) const -> void;
+
+    /**
+     * @brief Prints a JSON object with the same fields as print_text
+     */
+    auto print_json(std::ostream& os) const -> void;
+
+  private:
+
+    /**
+     * @brief Linear buckets per power of two (as a shift)
+     */
+    static constexpr unsigned SUB_BITS = 4;
+
+    /**
+     * @brief Values at or above 2^MAX_EXPONENT (~140 s) share the last bucket
+     */
+    static constexpr unsigned MAX_EXPONENT = 47;
+
+    /**
+     * @brief Number of buckets
+     */
+    static constexpr usize BUCKETS = (MAX_EXPONENT - SUB_BITS + 1)
+                                         << SUB_BITS;
+
+    /**
+     * @brief Bucket a value falls in
+     */
+    [[nodiscard]] static auto bucket(u64 value) -> usize;
+
+    /**
+     * @brief Biggest value falling in a bucket
+     */
+    [[nodiscard]] static auto upper_bound(usize bucket) -> u64;
+
+    /**
+     * @brief Count per bucket
+     */
+    u64 counts[BUCKETS];
+
+    /**
+     * @brief Number of recorded values
+     */
+    u64 total;
+
+    /**
+     * @brief Biggest recorded value
+     */
+    u64 largest;
+  };
+
+  /**
+   * @brief Latencies of the AVLmap operations (see AVLMAP_LATENCY)
+   */
+  struct AVLmapLatency {
+    /**
+     * @brief operator[] (lookup or insert)
+     */
+    LatencyHistogram insert;
+
+    /**
+     * @brief find
+     */
+    LatencyHistogram find;
+
+    /**
+     * @brief erase
+     */
+    LatencyHistogram erase;
+
+    /**
+     * @brief Zeroes all histograms
+     */
+    auto reset() -> void;
+
+    /**
+     * @brief Prints one text line per operation
+     */
+    auto print_text(std::ostream& os) const -> void;
+
+    /**
+     * @brief Prints a JSON object with one member per operation
+     */
+    auto print_json(std::ostream& os) const -> void;
+  };
+
+  /**
+   * @brief Latencies of every AVLmap operation made by the calling thread
+   */
+  inline auto thread_latency() -> AVLmapLatency&;
+
+  /**
+   * @class LatencyTimer
+   * @brief Records the time from construction to destruction into a per map
+   * and a per thread histogram, or only the per thread one
+   */
+  class LatencyTimer {
+  public:
+
+    /**
+     * @brief Starts timing
+     */
+    LatencyTimer(LatencyHistogram& map, LatencyHistogram& thread);
+
+    /**
+     * @brief Starts timing for the per thread histogram only
+     */
+    explicit LatencyTimer(LatencyHistogram& thread);
+
+    /**
+     * @brief Copy constructor
+     */
+    LatencyTimer(const LatencyTimer&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const LatencyTimer&) -> LatencyTimer& = delete;
+
+    /**
+     * @brief Stops timing and records
+     */
+    ~LatencyTimer();
+
+  private:
+
+    /**
+     * @brief Histogram of the map, null when only the thread records
+     */
+    LatencyHistogram* map;
+
+    /**
+     * @brief Histogram of the thread
+     */
+    LatencyHistogram& thread;
+
+    /**
+     * @brief When timing started
+     */
+    std::chrono::steady_clock::time_point start;
+  };
+} // namespace CS280
+
+#ifndef LATENCY_HISTOGRAM_CPP
+#include "latency-histogram.cpp"
+#endif
+#endif
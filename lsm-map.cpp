@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#ifndef LSM_MAP_H
+#include "lsm-map.h"
+#endif
+
+#ifndef LSM_MAP_CPP
+#define LSM_MAP_CPP
+
+namespace CS280 {
+
+  template<typename K, typename V>
+  LogStructuredMap<K, V>::LogStructuredMap(
+    usize memtable_limit,
+    usize max_runs
+  ):
+      memtable{},
+      memtable_limit{std::max<usize>(memtable_limit, 1)},
+      max_runs{std::max<usize>(max_runs, 1)},
+      frozen{},
+      merging{false},
+      stopping{false},
+      lock{},
+      wake{},
+      merged{},
+      merger{} {
+    merger = std::thread{&LogStructuredMap::run_merges, this};
+  }
+
+  template<typename K, typename V>
+  LogStructuredMap<K, V>::~LogStructuredMap() {
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      stopping = true;
+    }
+    wake.notify_one();
+    merger.join();
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::set(const K& key, const V& value) -> void {
+    memtable[key] = Slot{value, true};
+
+    if (memtable.size() >= memtable_limit) {
+      freeze();
+    }
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::erase(const K& key) -> void {
+    bool shadows = false;
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      shadows = not frozen.empty();
+    }
+
+    // a tombstone is only needed to hide the key in older runs
+    if (not shadows) {
+      memtable.erase(memtable.find(key));
+      return;
+    }
+
+    memtable[key] = Slot{V{}, false};
+
+    if (memtable.size() >= memtable_limit) {
+      freeze();
+    }
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::find(const K& key, V& value) const -> bool {
+    typename AVLmap<K, Slot>::const_iterator it = memtable.find(key);
+
+    if (it != memtable.end()) {
+      if (it->Value().live) {
+        value = it->Value().value;
+      }
+      return it->Value().live;
+    }
+
+    const u64 hash = hash_key(key);
+
+    std::lock_guard<std::mutex> guard{lock};
+
+    for (const run_ptr& run : frozen) {
+      const Slot* const slot = lookup(*run, key, hash);
+
+      if (slot) {
+        if (slot->live) {
+          value = slot->value;
+        }
+        return slot->live;
+      }
+    }
+
+    return false;
+  }
+
+  template<typename K, typename V>
+  template<typename Fn>
+  auto LogStructuredMap<K, V>::for_each(Fn fn) const -> void {
+    std::vector<run_ptr> runs{};
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      runs = frozen;
+    }
+
+    typename AVLmap<K, Slot>::const_iterator it = memtable.begin();
+
+    // runs[i] is source i + 1, the memtable is source 0 (the newest)
+    std::vector<usize> positions(runs.size(), 0);
+
+    auto key_of = [&](usize source) -> const K& {
+      return source == 0 ? it->Key()
+                         : runs[source - 1]->keys[positions[source - 1]];
+    };
+
+    auto slot_of = [&](usize source) -> const Slot& {
+      return source == 0 ? it->Value()
+                         : runs[source - 1]->slots[positions[source - 1]];
+    };
+
+    auto advance = [&](usize source) -> bool {
+      if (source == 0) {
+        return ++it != memtable.end();
+      }
+      return ++positions[source - 1] < runs[source - 1]->keys.size();
+    };
+
+    // smallest key first, the newest source first among equal keys
+    auto later = [&](usize a, usize b) {
+      return key_of(b) < key_of(a) or (not(key_of(a) < key_of(b)) and a > b);
+    };
+
+    std::priority_queue<usize, std::vector<usize>, decltype(later)> heap{
+      later
+    };
+
+    if (it != memtable.end()) {
+      heap.push(0);
+    }
+    for (usize i = 0; i < runs.size(); i++) {
+      if (not runs[i]->keys.empty()) {
+        heap.push(i + 1);
+      }
+    }
+
+    while (not heap.empty()) {
+      const usize newest = heap.top();
+      heap.pop();
+
+      const Slot& slot = slot_of(newest);
+      if (slot.live) {
+        fn(key_of(newest), slot.value);
+      }
+
+      // skip the shadowed entries of the same key in older sources
+      while (not heap.empty()
+             and not(key_of(newest) < key_of(heap.top()))) {
+        const usize older = heap.top();
+        heap.pop();
+        if (advance(older)) {
+          heap.push(older);
+        }
+      }
+
+      if (advance(newest)) {
+        heap.push(newest);
+      }
+    }
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::freeze() -> void {
+    if (memtable.empty()) {
+      return;
+    }
+
+    auto run = std::make_shared<Run>();
+    run->keys.reserve(memtable.size());
+    run->slots.reserve(memtable.size());
+    run->filter = BloomFilter{memtable.size()};
+
+    for (typename AVLmap<K, Slot>::iterator it = memtable.begin();
+         it != memtable.end();
+         ++it) {
+      run->filter.add(hash_key(it->Key()));
+      run->keys.push_back(it->Key());
+      run->slots.push_back(std::move(it->Value()));
+    }
+
+    memtable = AVLmap<K, Slot>{};
+
+    bool full = false;
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      frozen.insert(frozen.begin(), std::move(run));
+      full = frozen.size() > max_runs;
+    }
+
+    if (full) {
+      wake.notify_one();
+    }
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::wait_for_merges() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+    merged.wait(guard, [&] {
+      return not merging and frozen.size() <= max_runs;
+    });
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::runs() const -> usize {
+    std::lock_guard<std::mutex> guard{lock};
+    return frozen.size();
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::merge(
+    const std::vector<run_ptr>& inputs,
+    bool drop_tombstones
+  ) -> run_ptr {
+    usize total = 0;
+    for (const run_ptr& input : inputs) {
+      total += input->keys.size();
+    }
+
+    auto run = std::make_shared<Run>();
+    run->keys.reserve(total);
+    run->slots.reserve(total);
+
+    std::vector<usize> positions(inputs.size(), 0);
+
+    auto key_of = [&](usize i) -> const K& {
+      return inputs[i]->keys[positions[i]];
+    };
+
+    // smallest key first, the newest input first among equal keys
+    auto later = [&](usize a, usize b) {
+      return key_of(b) < key_of(a) or (not(key_of(a) < key_of(b)) and a > b);
+    };
+
+    std::priority_queue<usize, std::vector<usize>, decltype(later)> heap{
+      later
+    };
+
+    for (usize i = 0; i < inputs.size(); i++) {
+      if (not inputs[i]->keys.empty()) {
+        heap.push(i);
+      }
+    }
+
+    while (not heap.empty()) {
+      const usize newest = heap.top();
+      heap.pop();
+
+      const Slot& slot = inputs[newest]->slots[positions[newest]];
+      if (slot.live or not drop_tombstones) {
+        run->keys.push_back(key_of(newest));
+        run->slots.push_back(slot);
+      }
+
+      while (not heap.empty()
+             and not(key_of(newest) < key_of(heap.top()))) {
+        const usize older = heap.top();
+        heap.pop();
+        if (++positions[older] < inputs[older]->keys.size()) {
+          heap.push(older);
+        }
+      }
+
+      if (++positions[newest] < inputs[newest]->keys.size()) {
+        heap.push(newest);
+      }
+    }
+
+    run->filter = BloomFilter{run->keys.size()};
+    for (const K& key : run->keys) {
+      run->filter.add(hash_key(key));
+    }
+
+    return run;
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::lookup(const Run& run, const K& key, u64 hash)
+    -> const Slot* {
+    if (not run.filter.may_contain(hash)) {
+      return nullptr;
+    }
+
+    auto it = std::lower_bound(run.keys.begin(), run.keys.end(), key);
+
+    if (it == run.keys.end() or key < *it) {
+      return nullptr;
+    }
+
+    return &run.slots[static_cast<usize>(it - run.keys.begin())];
+  }
+
+  template<typename K, typename V>
+  auto LogStructuredMap<K, V>::run_merges() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+
+    while (true) {
+      wake.wait(guard, [&] { return stopping or frozen.size() > max_runs; });
+
+      if (stopping) {
+        return;
+      }
+
+      // size tiered: merge the newest runs while the next older run is not
+      // much bigger than what has been gathered, so big runs are rewritten
+      // rarely. At least two runs are merged so the count goes down
+      usize gathered = frozen[0]->keys.size();
+      usize count = 1;
+
+      while (count < frozen.size()
+             and frozen[count]->keys.size() <= 2 * gathered) {
+        gathered += frozen[count]->keys.size();
+        count++;
+      }
+      count = std::max<usize>(count, 2);
+
+      const std::vector<run_ptr> inputs{
+        frozen.begin(),
+        frozen.begin() + static_cast<std::ptrdiff_t>(count)
+      };
+      const bool oldest = count == frozen.size();
+      merging = true;
+
+      guard.unlock();
+      run_ptr result = merge(inputs, oldest);
+      guard.lock();
+
+      // runs frozen during the merge went in front of the inputs
+      auto first = std::find(frozen.begin(), frozen.end(), inputs.front());
+      first = frozen.erase(first, first + static_cast<std::ptrdiff_t>(count));
+      frozen.insert(first, std::move(result));
+
+      merging = false;
+      merged.notify_all();
+    }
+  }
+} // namespace CS280
+
+#endif
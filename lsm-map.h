@@ -0,0 +1,217 @@
+#pragma once
+
+#ifndef LSM_MAP_H
+#define LSM_MAP_H
+
+#include "avl-map.h"
+#include "bloom-filter.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CS280 {
+
+  /**
+   * @brief Write optimized ordered map. Writes go to a small AVLmap (the
+   * memtable), which stays shallow and cache resident. When it is full it is
+   * frozen into an immutable sorted array run with its own Bloom filter. Once
+   * there are too many runs a background thread k-way merges them into one.
+   * Lookups check the memtable and then the runs from newest to oldest,
+   * skipping runs whose filter rules the key out.
+   *
+   * Calls are made from one thread, only the run list is shared with the
+   * merge thread.
+   *
+   * @tparam K Key
+   * @tparam V Value
+   */
+  template<typename K, typename V>
+  class LogStructuredMap {
+
+  public:
+
+    /**
+     * @brief Constructor
+     *
+     * @param memtable_limit entries in the memtable before it is frozen
+     * @param max_runs runs kept before a background merge is started
+     */
+    explicit LogStructuredMap(usize memtable_limit = 4096, usize max_runs = 8);
+
+    /**
+     * @brief Copy constructor
+     */
+    LogStructuredMap(const LogStructuredMap&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const LogStructuredMap&) -> LogStructuredMap& = delete;
+
+    /**
+     * @brief Destructor, stops the merge thread
+     */
+    ~LogStructuredMap();
+
+    /**
+     * @brief Sets the value of a key
+     */
+    auto set(const K& key, const V& value) -> void;
+
+    /**
+     * @brief Erases a key (writes a tombstone)
+     */
+    auto erase(const K& key) -> void;
+
+    /**
+     * @brief Copies the value of the key into value, false if it is not in
+     * the map
+     */
+    auto find(const K& key, V& value) const -> bool;
+
+    /**
+     * @brief Calls fn(key, value) for every entry in key order
+     */
+    template<typename Fn>
+    auto for_each(Fn fn) const -> void;
+
+    /**
+     * @brief Freezes the memtable into a run even if it is not full
+     */
+    auto freeze() -> void;
+
+    /**
+     * @brief Blocks until no background merge is pending or running
+     */
+    auto wait_for_merges() -> void;
+
+    /**
+     * @brief Number of frozen runs
+     */
+    [[nodiscard]] auto runs() const -> usize;
+
+  private:
+
+    /**
+     * @struct Slot
+     * @brief Memtable value, erased keys are kept as tombstones so they
+     * shadow older runs
+     */
+    struct Slot {
+      /**
+       * @brief Value data
+       */
+      V value;
+
+      /**
+       * @brief False for a tombstone
+       */
+      bool live;
+    };
+
+    /**
+     * @struct Run
+     * @brief Immutable sorted arrays of one frozen memtable (or a merge)
+     */
+    struct Run {
+      /**
+       * @brief Sorted keys
+       */
+      std::vector<K> keys{};
+
+      /**
+       * @brief Slots of the keys at the same index
+       */
+      std::vector<Slot> slots{};
+
+      /**
+       * @brief Filter over keys
+       */
+      BloomFilter filter{};
+    };
+
+    /**
+     * @brief Shared so lookups and merges can keep using a run that is being
+     * replaced
+     */
+    using run_ptr = std::shared_ptr<const Run>;
+
+    /**
+     * @brief Merges runs (newest first) into one, the newest entry of a key
+     * wins. Tombstones are dropped when the oldest run takes part
+     */
+    [[nodiscard]] static auto merge(
+      const std::vector<run_ptr>& inputs,
+      bool drop_tombstones
+    ) -> run_ptr;
+
+    /**
+     * @brief Looks the key up in one run
+     */
+    [[nodiscard]] static auto lookup(const Run& run, const K& key, u64 hash)
+      -> const Slot*;
+
+    /**
+     * @brief Body of the merge thread
+     */
+    auto run_merges() -> void;
+
+    /**
+     * @brief Mutable part of the map
+     */
+    AVLmap<K, Slot> memtable;
+
+    /**
+     * @brief Memtable size that triggers a freeze
+     */
+    usize memtable_limit;
+
+    /**
+     * @brief Run count that triggers a merge
+     */
+    usize max_runs;
+
+    /**
+     * @brief Frozen runs, newest first
+     */
+    std::vector<run_ptr> frozen;
+
+    /**
+     * @brief Is the merge thread merging
+     */
+    bool merging;
+
+    /**
+     * @brief Tells the merge thread to exit
+     */
+    bool stopping;
+
+    /**
+     * @brief Guards frozen, merging and stopping
+     */
+    mutable std::mutex lock;
+
+    /**
+     * @brief Wakes the merge thread
+     */
+    std::condition_variable wake;
+
+    /**
+     * @brief Signals that a merge finished
+     */
+    std::condition_variable merged;
+
+    /**
+     * @brief Merge thread
+     */
+    std::thread merger;
+  };
+} // namespace CS280
+
+#ifndef LSM_MAP_CPP
+#include "lsm-map.cpp"
+#endif
+#endif
@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef PERSISTENT_AVLMAP_H
+#include "persistent-avl-map.h"
+#endif
+
+#ifndef PERSISTENT_AVLMAP_CPP
+#define PERSISTENT_AVLMAP_CPP
+
+namespace CS280 {
+
+  template<typename K, typename V>
+  PersistentAVLmap<K, V>::Link::Link():
+      distance{0} {}
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::Link::operator=(const Link& rhs) -> Link& {
+    return *this = static_cast<Node*>(rhs);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::Link::operator=(Node* node) -> Link& {
+    distance = node ? reinterpret_cast<const char*>(node)
+                        - reinterpret_cast<const char*>(this)
+                    : 0;
+    return *this;
+  }
+
+  template<typename K, typename V>
+  PersistentAVLmap<K, V>::Link::operator Node*() const {
+    if (distance == 0) {
+      return nullptr;
+    }
+
+    // the link and the node are in the same mapping
+    return reinterpret_cast<Node*>(
+      const_cast<char*>(reinterpret_cast<const char*>(this)) + distance
+    );
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::Link::operator->() const -> Node* {
+    return *this;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::Node::Key() const -> const K& {
+    return key;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::Node::Value() -> V& {
+    return value;
+  }
+
+  template<typename K, typename V>
+  PersistentAVLmap<K, V>::iterator::iterator(
+    PersistentAVLmap* map,
+    offset node
+  ):
+      map{map}, node{node} {}
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator++() -> iterator& {
+    if (node == 0) {
+      return *this;
+    }
+
+    node = map->offset_of(map->successor(&map->at(node)));
+
+    return *this;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator++(int) -> iterator {
+    iterator iter{*this};
+    operator++();
+    return iter;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator*() const -> Node& {
+    return map->at(node);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator->() const -> Node* {
+    return &map->at(node);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator!=( //
+    const iterator& rhs
+  ) const -> bool {
+    return node != rhs.node;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::iterator::operator==( //
+    const iterator& rhs
+  ) const -> bool {
+    return node == rhs.node;
+  }
+
+  template<typename K, typename V>
+  PersistentAVLmap<K, V>::PersistentAVLmap():
+      base{nullptr}, length{0}, fd{-1} {
+    static_assert(
+      std::is_trivially_copyable<K>::value
+        and std::is_trivially_copyable<V>::value,
+      "Nodes are stored as raw bytes in the file"
+    );
+  }
+
+  template<typename K, typename V>
+  PersistentAVLmap<K, V>::~PersistentAVLmap() {
+    close();
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::open(const char* path, usize initial_capacity)
+    -> bool {
+    close();
+
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat info{};
+    if (::fstat(fd, &info) != 0) {
+      close();
+      return false;
+    }
+
+    // the header is padded so that nodes start aligned
+    const usize first_node = ((sizeof(Header) + alignof(Node) - 1)
+                              / alignof(Node))
+                           * alignof(Node);
+
+    const bool created = info.st_size == 0;
+
+    length = created
+             ? first_node + std::max<usize>(initial_capacity, 1) * sizeof(Node)
+             : static_cast<usize>(info.st_size);
+
+    if (length < sizeof(Header)
+        or (created and ::ftruncate(fd, static_cast<off_t>(length)) != 0)) {
+      close();
+      return false;
+    }
+
+    void* const mapped = ::mmap(
+      nullptr,
+      length,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      0
+    );
+
+    if (mapped == MAP_FAILED) {
+      base = nullptr;
+      close();
+      return false;
+    }
+
+    base = static_cast<char*>(mapped);
+
+    // "PAVL" read as a little endian integer
+    constexpr u32 MAGIC = 0x4C564150;
+    // 2: self-relative links, rank and balance kept by AVLBalance
+    constexpr u32 VERSION = 2;
+
+    Header& head = header();
+
+    if (created) {
+      head.magic = MAGIC;
+      head.version = VERSION;
+      head.node_size = sizeof(Node);
+      head.key_size = sizeof(K);
+      head.count = 0;
+      head.root = nullptr;
+      head.free = nullptr;
+      head.used = first_node;
+      return true;
+    }
+
+    if (head.magic != MAGIC or head.version != VERSION
+        or head.node_size != sizeof(Node) or head.key_size != sizeof(K)
+        or head.used > length) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::close() -> void {
+    if (base) {
+      ::msync(base, length, MS_SYNC);
+      ::munmap(base, length);
+    }
+
+    if (fd >= 0) {
+      ::close(fd);
+    }
+
+    base = nullptr;
+    length = 0;
+    fd = -1;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::sync() -> bool {
+    return base and ::msync(base, length, MS_SYNC) == 0;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::is_open() const -> bool {
+    return base != nullptr;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::size() const -> usize {
+    return base ? header().count : 0;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::empty() const -> bool {
+    return size() == 0;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::operator[](const K& key) -> V& {
+    if (not is_open()) {
+      throw std::logic_error{"PersistentAVLmap: no file is open"};
+    }
+
+    Node* const found = index(key);
+
+    // proper node found
+    if (found and found->key == key) {
+      return found->value;
+    }
+
+    // allocation may remap, so only offsets are held across it
+    const offset parent = offset_of(found);
+    Node& created = at(allocate());
+    Node* const above = parent ? &at(parent) : nullptr;
+
+    created.key = key;
+    created.value = V{};
+    created.parent = above;
+    created.left = nullptr;
+    created.right = nullptr;
+
+    if (above == nullptr) {
+      header().root = &created;
+    } else if (key < above->key) {
+      above->left = &created;
+    } else {
+      above->right = &created;
+    }
+
+    header().count++;
+    AVLBalance::linked(*this, &created);
+
+    return created.value;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::begin() -> iterator {
+    Node* const root = base ? static_cast<Node*>(header().root) : nullptr;
+    return iterator{this, root ? offset_of(first(root)) : 0};
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::end() -> iterator {
+    return iterator{this, 0};
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::find(const K& key) -> iterator {
+    Node* const node = index(key);
+    return (node and node->key == key) ? iterator{this, offset_of(node)}
+                                       : end();
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::erase(iterator it) -> void {
+    if (it == end()) {
+      return;
+    }
+
+    Node* const erased = &at(it.node);
+    Node* parent = erased->parent;
+    bool left = parent and parent->left == erased;
+
+    if (erased->left == nullptr) {
+      transplant(erased, erased->right);
+    } else if (erased->right == nullptr) {
+      transplant(erased, erased->left);
+    } else {
+      // relink the successor into the erased position so that iterators to
+      // every other node stay valid
+      Node* const successor = first(erased->right);
+
+      if (successor->parent == erased) {
+        parent = successor;
+        left = false;
+      } else {
+        parent = successor->parent;
+        left = true;
+        transplant(successor, successor->right);
+        successor->right = erased->right;
+        successor->right->parent = successor;
+      }
+
+      // the successor takes the height of the place too, so the retrace
+      // can stop below it
+      transplant(erased, successor);
+      successor->rank = erased->rank;
+      successor->balance = erased->balance;
+      successor->left = erased->left;
+      successor->left->parent = successor;
+    }
+
+    AVLBalance::unlinked(*this, parent, left, *erased);
+
+    erased->parent = header().free;
+    header().free = erased;
+    header().count--;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::at(offset node) const -> Node& {
+    return *reinterpret_cast<Node*>(base + node);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::offset_of(const Node* node) const -> offset {
+    return node ? static_cast<offset>(reinterpret_cast<const char*>(node) - base)
+                : 0;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::header() const -> Header& {
+    return *reinterpret_cast<Header*>(base);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::index(const K& key) const -> Node* {
+    Node* node = base ? static_cast<Node*>(header().root) : nullptr;
+
+    while (node) {
+      if (node->key == key) {
+        return node;
+      }
+
+      Node* const next = key < node->key ? node->left : node->right;
+
+      // no child on that side, this is the parent
+      if (next == nullptr) {
+        return node;
+      }
+
+      node = next;
+    }
+
+    return nullptr;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::allocate() -> offset {
+    Header& head = header();
+
+    if (Node* const reused = head.free) {
+      head.free = reused->parent;
+      return offset_of(reused);
+    }
+
+    // out of file space is treated like being out of memory
+    if (head.used + sizeof(Node) > length
+        and not grow(std::max(length * 2, head.used + sizeof(Node)))) {
+      throw std::bad_alloc{};
+    }
+
+    const offset node = header().used;
+    header().used += sizeof(Node);
+
+    return node;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::grow(usize new_length) -> bool {
+    if (::ftruncate(fd, static_cast<off_t>(new_length)) != 0) {
+      return false;
+    }
+
+    void* const mapped = ::mremap(base, length, new_length, MREMAP_MAYMOVE);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+
+    base = static_cast<char*>(mapped);
+    length = new_length;
+
+    return true;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::transplant(Node* node, Node* with) -> void {
+    Node* const parent = node->parent;
+
+    if (parent == nullptr) {
+      header().root = with;
+    } else if (parent->left == node) {
+      parent->left = with;
+    } else {
+      parent->right = with;
+    }
+
+    if (with) {
+      with->parent = parent;
+    }
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::rotate_left(Node* node) -> Node* {
+    Node* const pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left) {
+      pivot->left->parent = node;
+    }
+
+    transplant(node, pivot);
+
+    pivot->left = node;
+    node->parent = pivot;
+
+    return pivot;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::rotate_right(Node* node) -> Node* {
+    Node* const pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right) {
+      pivot->right->parent = node;
+    }
+
+    transplant(node, pivot);
+
+    pivot->right = node;
+    node->parent = pivot;
+
+    return pivot;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::rotate_left_right(Node* node) -> Node* {
+    rotate_left(node->left);
+    return rotate_right(node);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::rotate_right_left(Node* node) -> Node* {
+    rotate_right(node->right);
+    return rotate_left(node);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::sanityCheck() -> bool {
+    if (base == nullptr) {
+      return true;
+    }
+
+    Node* const root = header().root;
+    usize n = 0;
+    for (Node* node = root ? first(root) : nullptr; node;
+         node = successor(node)) {
+      n++;
+    }
+
+    return n == header().count
+       and (root == nullptr or root->parent == nullptr)
+       and valid(root, nullptr, nullptr);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::valid(
+    const Node* node,
+    const K* lo,
+    const K* hi
+  ) const -> bool {
+    if (node == nullptr) {
+      return true;
+    }
+
+    const Node* const left = node->left;
+    const Node* const right = node->right;
+    const u64 left_rank = left ? left->rank : 0;
+    const u64 right_rank = right ? right->rank : 0;
+    const i64 bal = static_cast<i64>(left_rank) - static_cast<i64>(right_rank);
+
+    return not(lo and not(*lo < node->key))
+       and not(hi and not(node->key < *hi))
+       and (left == nullptr or left->parent == node)
+       and (right == nullptr or right->parent == node)
+       and node->rank == std::max(left_rank, right_rank) + 1
+       and node->balance == bal and bal >= -1 and bal <= 1
+       and valid(left, lo, &node->key)
+       and valid(right, &node->key, hi);
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::first(Node* node) const -> Node* {
+    while (node->left) {
+      node = node->left;
+    }
+
+    return node;
+  }
+
+  template<typename K, typename V>
+  auto PersistentAVLmap<K, V>::successor(Node* node) const -> Node* {
+    if (node->right) {
+      return first(node->right);
+    }
+
+    Node* parent = node->parent;
+
+    while (parent and node == parent->right) {
+      node = parent;
+      parent = parent->parent;
+    }
+
+    return parent;
+  }
+} // namespace CS280
+
+#endif
@@ -0,0 +1,423 @@
+#pragma once
+
+#ifndef PERSISTENT_AVLMAP_H
+#define PERSISTENT_AVLMAP_H
+
+#include "avl-map.h"
+
+namespace CS280 {
+
+  /**
+   * @brief AVL map whose nodes live in a memory mapped file. Links are stored
+   * relative to where they live instead of as pointers, so the file can be
+   * mapped at any address. Opening does not read the tree, pages are faulted
+   * in lazily as they are touched and cached by the OS page cache.
+   *
+   * The links read as Node*, so balancing is AVLmap's AVLBalance policy run
+   * directly on the mapped nodes.
+   *
+   * Keys and values are stored as raw bytes and must be trivially copyable.
+   * Growing the file may move the mapping, which invalidates references
+   * returned by operator[] and Value() (iterators stay valid).
+   *
+   * @tparam K Key
+   * @tparam V Value
+   */
+  template<typename K, typename V>
+  class PersistentAVLmap {
+
+  public:
+
+    /**
+     * @brief Offset of a node from the start of the mapping, 0 is null
+     */
+    using offset = u64;
+
+    class iterator;
+
+    class Node;
+
+    /**
+     * @class Link
+     * @brief Pointer to a node stored as the distance from the link itself,
+     * 0 is null. Reads and writes as a Node*, and stays valid wherever the
+     * file is mapped
+     */
+    class Link {
+    public:
+
+      /**
+       * @brief Null link
+       */
+      Link();
+
+      /**
+       * @brief Copy constructor, a distance means nothing away from its link
+       */
+      Link(const Link&) = delete;
+
+      /**
+       * @brief Points this link at the node the other one points at
+       */
+      auto operator=(const Link& rhs) -> Link&;
+
+      /**
+       * @brief Points this link at node
+       */
+      auto operator=(Node* node) -> Link&;
+
+      /**
+       * @brief Gets the node pointed at, null if none
+       */
+      operator Node*() const;
+
+      /**
+       * @brief Gets the node pointed at
+       */
+      auto operator->() const -> Node*;
+
+    private:
+
+      /**
+       * @brief Bytes from this link to the node
+       */
+      i64 distance;
+    };
+
+    /**
+     * @class Node
+     * @brief BST Node as laid out in the file
+     */
+    class Node {
+    public:
+
+      /**
+       * @brief Gets the key stored
+       */
+      [[nodiscard]] auto Key() const -> const K&;
+
+      /**
+       * @brief Gets the value stored
+       */
+      [[nodiscard]] auto Value() -> V&;
+
+    private:
+
+      /**
+       * @brief Key data
+       */
+      K key;
+
+      /**
+       * @brief Value data
+       */
+      V value;
+
+      /**
+       * @brief Parent (next free node while on the free list)
+       */
+      Link parent;
+
+      /**
+       * @brief Left child
+       */
+      Link left;
+
+      /**
+       * @brief Right child
+       */
+      Link right;
+
+      /**
+       * @brief Height of the subtree, 1 for a leaf (kept by AVLBalance)
+       */
+      u64 rank;
+
+      /**
+       * @brief Left minus right height (kept by AVLBalance)
+       */
+      i32 balance;
+
+      friend class PersistentAVLmap;
+      friend AVLBalance;
+    };
+
+    /**
+     * @class iterator
+     * @brief In-order iterator, holds an offset so it survives remapping
+     */
+    class iterator {
+    public:
+
+      /**
+       * @brief Default / normal constructor
+       */
+      iterator(PersistentAVLmap* map = nullptr, offset node = 0);
+
+      /**
+       * @brief Pre-increment, move to the next
+       */
+      auto operator++() -> iterator&;
+
+      /**
+       * @brief Post-increment, returns the current and after move to the next
+       */
+      auto operator++(int) -> iterator;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator*() const -> Node&;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator->() const -> Node*;
+
+      /**
+       * @brief Checks if this and another iterator are not equal
+       */
+      [[nodiscard]] auto operator!=(const iterator& rhs) const -> bool;
+
+      /**
+       * @brief Checks if this and another iterator are equal
+       */
+      [[nodiscard]] auto operator==(const iterator& rhs) const -> bool;
+
+      friend class PersistentAVLmap;
+
+    private:
+
+      /**
+       * @brief Map the node lives in
+       */
+      PersistentAVLmap* map;
+
+      /**
+       * @brief Offset of the node
+       */
+      offset node;
+    };
+
+    /**
+     * @brief Default constructor, no file is open
+     */
+    PersistentAVLmap();
+
+    /**
+     * @brief Copy constructor
+     */
+    PersistentAVLmap(const PersistentAVLmap&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const PersistentAVLmap&) -> PersistentAVLmap& = delete;
+
+    /**
+     * @brief Destructor, flushes and unmaps the file
+     */
+    ~PersistentAVLmap();
+
+    /**
+     * @brief Maps the given file, creating it with room for the given number
+     * of nodes if it does not exist. Returns false if the file cannot be
+     * mapped or was written with a different key / value layout
+     */
+    auto open(const char* path, usize initial_capacity = 1024) -> bool;
+
+    /**
+     * @brief Flushes and unmaps the file
+     */
+    auto close() -> void;
+
+    /**
+     * @brief Synchronously writes dirty pages back to the file
+     */
+    auto sync() -> bool;
+
+    /**
+     * @brief Is a file mapped
+     */
+    [[nodiscard]] auto is_open() const -> bool;
+
+    /**
+     * @brief How many elements are in the tree
+     */
+    [[nodiscard]] auto size() const -> usize;
+
+    /**
+     * @brief Is the size 0
+     */
+    [[nodiscard]] auto empty() const -> bool;
+
+    /**
+     * @brief Value getter and setter, creates key if it does not exist.
+     * Throws std::logic_error if no file is open
+     */
+    auto operator[](const K& key) -> V&;
+
+    /**
+     * @brief Beginning iterator
+     */
+    auto begin() -> iterator;
+
+    /**
+     * @brief End iterator
+     */
+    auto end() -> iterator;
+
+    /**
+     * @brief Attempts to find an iterator pointing to a node that has the
+     * given key
+     */
+    auto find(const K& key) -> iterator;
+
+    /**
+     * @brief Erases the node represented by the given iterator, the node is
+     * kept in the file on a free list for reuse
+     */
+    auto erase(iterator it) -> void;
+
+    /**
+     * @brief Checks the order of the keys, the parent links, the heights and
+     * that every node is balanced
+     */
+    auto sanityCheck() -> bool;
+
+  private:
+
+    /**
+     * @struct Header
+     * @brief Lives at offset 0 of the file
+     */
+    struct Header {
+      /**
+       * @brief Identifies the file format
+       */
+      u32 magic;
+
+      /**
+       * @brief Format version
+       */
+      u32 version;
+
+      /**
+       * @brief sizeof the node type the file was written with
+       */
+      u32 node_size;
+
+      /**
+       * @brief sizeof the key type the file was written with
+       */
+      u32 key_size;
+
+      /**
+       * @brief Number of elements
+       */
+      u64 count;
+
+      /**
+       * @brief Root
+       */
+      Link root;
+
+      /**
+       * @brief First free node
+       */
+      Link free;
+
+      /**
+       * @brief End of the region handed out to nodes so far
+       */
+      u64 used;
+    };
+
+    /**
+     * @brief Resolves an offset to the node
+     */
+    [[nodiscard]] auto at(offset node) const -> Node&;
+
+    /**
+     * @brief Offset of a (possibly null) node, what survives a remap
+     */
+    [[nodiscard]] auto offset_of(const Node* node) const -> offset;
+
+    /**
+     * @brief Gets the mapped header
+     */
+    [[nodiscard]] auto header() const -> Header&;
+
+    /**
+     * @brief Gets the node with the given key, or what its parent should be
+     */
+    [[nodiscard]] auto index(const K& key) const -> Node*;
+
+    /**
+     * @brief Takes a node from the free list or the end of the file, growing
+     * the file when needed (may remap)
+     */
+    [[nodiscard]] auto allocate() -> offset;
+
+    /**
+     * @brief Grows the file and the mapping to at least the given size
+     */
+    auto grow(usize length) -> bool;
+
+    /**
+     * @brief Replaces the subtree at node with the subtree at with
+     */
+    auto transplant(Node* node, Node* with) -> void;
+
+    /**
+     * @brief Rotations for AVLBalance, only relink and return the new root
+     * of the rotated subtree
+     */
+    auto rotate_left(Node* node) -> Node*;
+
+    auto rotate_right(Node* node) -> Node*;
+
+    auto rotate_left_right(Node* node) -> Node*;
+
+    auto rotate_right_left(Node* node) -> Node*;
+
+    /**
+     * @brief Checks a subtree for sanityCheck, keys between the bounds (none
+     * if null)
+     */
+    [[nodiscard]] auto valid(const Node* node, const K* lo, const K* hi) const
+      -> bool;
+
+    /**
+     * @brief Gets the leftmost node of a subtree
+     */
+    [[nodiscard]] auto first(Node* node) const -> Node*;
+
+    /**
+     * @brief Gets the in-order successor
+     */
+    [[nodiscard]] auto successor(Node* node) const -> Node*;
+
+    /**
+     * @brief Start of the mapping
+     */
+    char* base;
+
+    /**
+     * @brief Size of the mapping
+     */
+    usize length;
+
+    /**
+     * @brief File descriptor of the mapped file
+     */
+    int fd;
+
+    friend AVLBalance;
+  };
+} // namespace CS280
+
+#ifndef PERSISTENT_AVLMAP_CPP
+#include "persistent-avl-map.cpp"
+#endif
+#endif
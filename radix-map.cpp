@@ -0,0 +1,429 @@
+#pragma once
+
+#include <utility>
+
+#ifndef RADIX_MAP_H
+#include "radix-map.h"
+#endif
+
+#ifndef RADIX_MAP_CPP
+#define RADIX_MAP_CPP
+
+namespace CS280 {
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::iterator::iterator():
+      map{nullptr}, bucket{BUCKETS}, it{} {}
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::iterator::iterator(
+    RadixMap* map,
+    usize bucket,
+    typename Bucket::iterator it
+  ):
+      map{map}, bucket{bucket}, it{it} {}
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator++() -> iterator& {
+    ++it;
+
+    // past the last entry of the bucket (a null node, as AVLmap::end), on
+    // to the next bucket in use
+    if (it == typename Bucket::iterator{}) {
+      bucket = map->next_bucket(bucket + 1);
+
+      if (bucket == BUCKETS) {
+        *this = iterator{};
+      } else {
+        it = map->directory[bucket]->begin();
+      }
+    }
+
+    return *this;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator++(int) -> iterator {
+    iterator copy = *this;
+    ++*this;
+    return copy;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator*() const -> Node& {
+    return *it;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator->() const -> Node* {
+    return it.operator->();
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator!=(const iterator& rhs) const
+    -> bool {
+    return not(*this == rhs);
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::iterator::operator==(const iterator& rhs) const
+    -> bool {
+    return bucket == rhs.bucket and it == rhs.it;
+  }
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::const_iterator::const_iterator():
+      map{nullptr}, bucket{BUCKETS}, it{} {}
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::const_iterator::const_iterator(
+    const RadixMap* map,
+    usize bucket,
+    typename Bucket::const_iterator it
+  ):
+      map{map}, bucket{bucket}, it{it} {}
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator++() -> const_iterator& {
+    ++it;
+
+    if (it == typename Bucket::const_iterator{}) {
+      bucket = map->next_bucket(bucket + 1);
+
+      if (bucket == BUCKETS) {
+        *this = const_iterator{};
+      } else {
+        it = static_cast<const Bucket&>(*map->directory[bucket]).begin();
+      }
+    }
+
+    return *this;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator++(int)
+    -> const_iterator {
+    const_iterator copy = *this;
+    ++*this;
+    return copy;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator*() const -> const Node& {
+    return *it;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator->() const
+    -> const Node* {
+    return it.operator->();
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator!=(
+    const const_iterator& rhs
+  ) const -> bool {
+    return not(*this == rhs);
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::const_iterator::operator==(
+    const const_iterator& rhs
+  ) const -> bool {
+    return bucket == rhs.bucket and it == rhs.it;
+  }
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::RadixMap():
+      directory{}, occupied{}, count{0}, shift{0}, base{0} {}
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::RadixMap(const RadixMap& rhs):
+      directory{},
+      occupied{rhs.occupied},
+      count{rhs.count},
+      shift{rhs.shift},
+      base{rhs.base} {
+    directory.reserve(rhs.directory.size());
+
+    for (const std::unique_ptr<Bucket>& bucket : rhs.directory) {
+      directory.emplace_back(bucket ? new Bucket{*bucket} : nullptr);
+    }
+  }
+
+  template<typename K, typename V, usize Bits>
+  RadixMap<K, V, Bits>::RadixMap(RadixMap&& from):
+      directory{std::move(from.directory)},
+      occupied{std::exchange(from.occupied, {})},
+      count{std::exchange(from.count, 0)},
+      shift{std::exchange(from.shift, 0)},
+      base{std::exchange(from.base, 0)} {
+    from.directory.clear();
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::operator=(const RadixMap& rhs) -> RadixMap& {
+    if (&rhs != this) {
+      *this = RadixMap{rhs};
+    }
+
+    return *this;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::operator=(RadixMap&& from) -> RadixMap& {
+    if (&from == this) {
+      return *this;
+    }
+
+    directory = std::move(from.directory);
+    from.directory.clear();
+    occupied = std::exchange(from.occupied, {});
+    count = std::exchange(from.count, 0);
+    shift = std::exchange(from.shift, 0);
+    base = std::exchange(from.base, 0);
+
+    return *this;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::size() const -> usize {
+    return count;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::empty() const -> bool {
+    return count == 0;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::operator[](const K& key) -> V& {
+    // an empty map starts over at the narrowest buckets around the key
+    if (count == 0) {
+      shift = 0;
+      base = high(ordered(key));
+    } else if (not covers(key)) {
+      widen(key);
+    }
+
+    if (directory.empty()) {
+      directory.resize(BUCKETS);
+    }
+
+    const usize i = bucket_of(key);
+    std::unique_ptr<Bucket>& bucket = directory[i];
+
+    if (bucket == nullptr) {
+      bucket.reset(new Bucket{});
+    }
+
+    const usize before = bucket->size();
+    V& value = (*bucket)[key];
+
+    if (bucket->size() != before) {
+      count++;
+      occupied[i / 64] |= u64{1} << (i % 64);
+    }
+
+    return value;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::begin() -> iterator {
+    const usize i = next_bucket(0);
+    return i == BUCKETS ? end() : iterator{this, i, directory[i]->begin()};
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::end() -> iterator {
+    return iterator{};
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::find(const K& key) -> iterator {
+    // a key outside of the directory range is not in
+    if (count == 0 or not covers(key)) {
+      return end();
+    }
+
+    const usize i = bucket_of(key);
+    Bucket* const bucket = directory[i].get();
+
+    if (bucket == nullptr) {
+      return end();
+    }
+
+    const typename Bucket::iterator it = bucket->find(key);
+    return it == bucket->end() ? end() : iterator{this, i, it};
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::erase(iterator it) -> void {
+    if (it == end()) {
+      return;
+    }
+
+    Bucket& bucket = *directory[it.bucket];
+    bucket.erase(it.it);
+    count--;
+
+    if (bucket.empty()) {
+      occupied[it.bucket / 64] &= ~(u64{1} << (it.bucket % 64));
+    }
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::begin() const -> const_iterator {
+    const usize i = next_bucket(0);
+
+    if (i == BUCKETS) {
+      return end();
+    }
+
+    return const_iterator{
+      this,
+      i,
+      static_cast<const Bucket&>(*directory[i]).begin(),
+    };
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::end() const -> const_iterator {
+    return const_iterator{};
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::find(const K& key) const -> const_iterator {
+    if (count == 0 or not covers(key)) {
+      return end();
+    }
+
+    const usize i = bucket_of(key);
+    const Bucket* const bucket = directory[i].get();
+
+    if (bucket == nullptr) {
+      return end();
+    }
+
+    const typename Bucket::const_iterator it = bucket->find(key);
+    return it == bucket->end() ? end() : const_iterator{this, i, it};
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::bucket_bits() const -> usize {
+    return shift;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::sanityCheck() -> bool {
+    usize n = 0;
+
+    for (usize i = 0; i < directory.size(); i++) {
+      Bucket* const bucket = directory[i].get();
+      const bool used = bucket and not bucket->empty();
+
+      if (used != ((occupied[i / 64] >> (i % 64)) & 1)) {
+        return false;
+      }
+
+      if (not used) {
+        continue;
+      }
+
+      if (not bucket->sanityCheck()) {
+        return false;
+      }
+
+      for (const Node& node : *bucket) {
+        if (not covers(node.Key()) or bucket_of(node.Key()) != i) {
+          return false;
+        }
+      }
+
+      n += bucket->size();
+    }
+
+    return n == count;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::ordered(const K& key) -> Unsigned {
+    constexpr Unsigned sign = std::is_signed<K>::value
+                              ? Unsigned{1} << (DIGITS - 1)
+                              : 0;
+
+    return static_cast<Unsigned>(static_cast<Unsigned>(key) ^ sign);
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::high(Unsigned bits) const -> Unsigned {
+    if (shift + DIRECTORY_BITS >= DIGITS) {
+      return 0;
+    }
+
+    return static_cast<Unsigned>(bits >> (shift + DIRECTORY_BITS));
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::covers(const K& key) const -> bool {
+    return high(ordered(key)) == base;
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::bucket_of(const K& key) const -> usize {
+    return static_cast<usize>(ordered(key) >> shift) & (BUCKETS - 1);
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::widen(const K& key) -> void {
+    // one more bit per bucket halves the high bits, until they agree
+    while (not covers(key)) {
+      shift++;
+      base = static_cast<Unsigned>(base >> 1);
+    }
+
+    std::vector<std::unique_ptr<Bucket>> old = std::move(directory);
+    directory.clear();
+    directory.resize(BUCKETS);
+    occupied = {};
+
+    // buckets that now share one are merged in key order, the first is
+    // taken over whole and the nodes of the others are relinked into it
+    for (std::unique_ptr<Bucket>& bucket : old) {
+      if (bucket == nullptr or bucket->empty()) {
+        continue;
+      }
+
+      const usize i = bucket_of(bucket->begin()->Key());
+      occupied[i / 64] |= u64{1} << (i % 64);
+
+      if (directory[i] == nullptr) {
+        directory[i] = std::move(bucket);
+        continue;
+      }
+
+      while (not bucket->empty()) {
+        directory[i]->insert(bucket->extract(bucket->begin()));
+      }
+    }
+  }
+
+  template<typename K, typename V, usize Bits>
+  auto RadixMap<K, V, Bits>::next_bucket(usize from) const -> usize {
+    for (usize word = from / 64; word < occupied.size(); word++) {
+      u64 bits = occupied[word];
+
+      if (word == from / 64) {
+        bits &= ~u64{0} << (from % 64);
+      }
+
+      if (bits) {
+        return word * 64 + static_cast<usize>(__builtin_ctzll(bits));
+      }
+    }
+
+    return BUCKETS;
+  }
+} // namespace CS280
+
+#endif
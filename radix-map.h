@@ -0,0 +1,363 @@
+#pragma once
+
+#ifndef RADIX_MAP_H
+#define RADIX_MAP_H
+
+#include "avl-map.h"
+
+#include <array>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace CS280 {
+
+  /**
+   * @brief Ordered map for integral keys: a flat directory of 2^Bits
+   * buckets, indexed by the key bits just below the bits all keys share,
+   * each bucket an AVLmap of its keys. A lookup indexes the directory and
+   * searches one bucket of about n / 2^Bits keys instead of the whole tree.
+   *
+   * The directory starts out covering 2^Bits consecutive keys. Inserting a
+   * key outside of the range covered doubles the keys per bucket until it
+   * fits, merging neighbouring buckets (at most once per key bit, so dense
+   * keys settle at about n / 2^Bits per bucket). This invalidates iterators,
+   * entries keep their addresses. Buckets and the directory are allocated
+   * on first use, iteration is in key order across buckets.
+   *
+   * @tparam K Key (integral)
+   * @tparam V Value
+   * @tparam Bits Directory bits (at most the bits of K)
+   */
+  template<typename K, typename V, usize Bits = 12>
+  class RadixMap {
+    static_assert(std::is_integral<K>::value, "RadixMap keys are integers");
+
+  public:
+
+    /**
+     * @brief Map of the keys of one bucket
+     */
+    using Bucket = AVLmap<K, V>;
+
+    /**
+     * @brief Entry, as in AVLmap
+     */
+    using Node = typename Bucket::Node;
+
+    /**
+     * @class iterator
+     * @brief Iterator over the buckets in key order
+     */
+    class iterator {
+    public:
+
+      /**
+       * @brief Default constructor, the end
+       */
+      iterator();
+
+      /**
+       * @brief Pre-increment, move to the next
+       */
+      auto operator++() -> iterator&;
+
+      /**
+       * @brief Post-increment, returns the current and after move to the next
+       */
+      auto operator++(int) -> iterator;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator*() const -> Node&;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator->() const -> Node*;
+
+      /**
+       * @brief Checks if this and another iterator are not equal
+       */
+      [[nodiscard]] auto operator!=(const iterator& rhs) const -> bool;
+
+      /**
+       * @brief Checks if this and another iterator are equal
+       */
+      [[nodiscard]] auto operator==(const iterator& rhs) const -> bool;
+
+      friend class RadixMap;
+
+    private:
+
+      /**
+       * @brief Entry in bucket of map
+       */
+      iterator(RadixMap* map, usize bucket, typename Bucket::iterator it);
+
+      /**
+       * @brief Map iterated, null at the end
+       */
+      RadixMap* map;
+
+      /**
+       * @brief Bucket of the entry, BUCKETS at the end
+       */
+      usize bucket;
+
+      /**
+       * @brief Entry within the bucket
+       */
+      typename Bucket::iterator it;
+    };
+
+    /**
+     * @class const_iterator
+     * @brief Iterator over the buckets of a const map in key order
+     */
+    class const_iterator {
+    public:
+
+      /**
+       * @brief Default constructor, the end
+       */
+      const_iterator();
+
+      /**
+       * @brief Pre-increment
+       */
+      auto operator++() -> const_iterator&;
+
+      /**
+       * @brief Post-increment
+       */
+      auto operator++(int) -> const_iterator;
+
+      /**
+       * @brief Gets a reference to the inner node
+       */
+      [[nodiscard]] auto operator*() const -> const Node&;
+
+      /**
+       * @brief Gets the inner node
+       */
+      [[nodiscard]] auto operator->() const -> const Node*;
+
+      /**
+       * @brief Checks if this and another iter is not equal
+       */
+      [[nodiscard]] auto operator!=(const const_iterator& rhs) const -> bool;
+
+      /**
+       * @brief Checks if this and another iter is equal
+       */
+      [[nodiscard]] auto operator==(const const_iterator& rhs) const -> bool;
+
+      friend class RadixMap;
+
+    private:
+
+      /**
+       * @brief Entry in bucket of map
+       */
+      const_iterator(
+        const RadixMap* map,
+        usize bucket,
+        typename Bucket::const_iterator it
+      );
+
+      /**
+       * @brief Map iterated, null at the end
+       */
+      const RadixMap* map;
+
+      /**
+       * @brief Bucket of the entry, BUCKETS at the end
+       */
+      usize bucket;
+
+      /**
+       * @brief Entry within the bucket
+       */
+      typename Bucket::const_iterator it;
+    };
+
+    /**
+     * @brief Default constructor, allocates nothing
+     */
+    RadixMap();
+
+    /**
+     * @brief Copy constructor, copies every bucket
+     */
+    RadixMap(const RadixMap& rhs);
+
+    /**
+     * @brief Move constructor, leaves from empty
+     */
+    RadixMap(RadixMap&& from);
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const RadixMap& rhs) -> RadixMap&;
+
+    /**
+     * @brief Move assignment, leaves from empty
+     */
+    auto operator=(RadixMap&& from) -> RadixMap&;
+
+    /**
+     * @brief Destructor
+     */
+    ~RadixMap() = default;
+
+    /**
+     * @brief Number of entries
+     */
+    [[nodiscard]] auto size() const -> usize;
+
+    /**
+     * @brief Is the map empty
+     */
+    [[nodiscard]] auto empty() const -> bool;
+
+    /**
+     * @brief Value of the key, inserted (value initialised) if missing
+     */
+    auto operator[](const K& key) -> V&;
+
+    /**
+     * @brief First entry
+     */
+    auto begin() -> iterator;
+
+    /**
+     * @brief Past the last entry
+     */
+    auto end() -> iterator;
+
+    /**
+     * @brief Entry of the key, end() if missing
+     */
+    auto find(const K& key) -> iterator;
+
+    /**
+     * @brief Erases an entry (nothing for end())
+     */
+    auto erase(iterator it) -> void;
+
+    /**
+     * @brief First entry (const)
+     */
+    auto begin() const -> const_iterator;
+
+    /**
+     * @brief Past the last entry (const)
+     */
+    auto end() const -> const_iterator;
+
+    /**
+     * @brief Entry of the key, end() if missing (const)
+     */
+    auto find(const K& key) const -> const_iterator;
+
+    /**
+     * @brief Keys per bucket the directory is at, as a power of 2
+     */
+    [[nodiscard]] auto bucket_bits() const -> usize;
+
+    /**
+     * @brief Checks every bucket, that its keys belong in it and that the
+     * directory knows which buckets are in use
+     */
+    auto sanityCheck() -> bool;
+
+  private:
+
+    /**
+     * @brief Key bits
+     */
+    using Unsigned = std::make_unsigned_t<K>;
+
+    /**
+     * @brief Number of key bits
+     */
+    static constexpr usize DIGITS = std::numeric_limits<Unsigned>::digits;
+
+    /**
+     * @brief Bits indexing the directory
+     */
+    static constexpr usize DIRECTORY_BITS = Bits < DIGITS ? Bits : DIGITS;
+
+    /**
+     * @brief Directory size
+     */
+    static constexpr usize BUCKETS = usize{1} << DIRECTORY_BITS;
+
+    /**
+     * @brief Key bits ordered like the keys (the sign bit flipped)
+     */
+    [[nodiscard]] static auto ordered(const K& key) -> Unsigned;
+
+    /**
+     * @brief Bits of a key above the ones indexing the directory
+     */
+    [[nodiscard]] auto high(Unsigned bits) const -> Unsigned;
+
+    /**
+     * @brief Is the key in the range the directory covers
+     */
+    [[nodiscard]] auto covers(const K& key) const -> bool;
+
+    /**
+     * @brief Bucket of a covered key
+     */
+    [[nodiscard]] auto bucket_of(const K& key) const -> usize;
+
+    /**
+     * @brief Widens the buckets until the directory covers the key, merging
+     * the ones that now share a bucket
+     */
+    auto widen(const K& key) -> void;
+
+    /**
+     * @brief First bucket in use from index from, BUCKETS if none
+     */
+    [[nodiscard]] auto next_bucket(usize from) const -> usize;
+
+    /**
+     * @brief Buckets by index, empty until the first insert, a bucket is
+     * null until a key goes in it
+     */
+    std::vector<std::unique_ptr<Bucket>> directory;
+
+    /**
+     * @brief Bit i is set while bucket i has entries
+     */
+    std::array<u64, (BUCKETS + 63) / 64> occupied;
+
+    /**
+     * @brief Number of entries
+     */
+    usize count;
+
+    /**
+     * @brief Key bits below the ones indexing the directory, log2 of the
+     * keys per bucket
+     */
+    usize shift;
+
+    /**
+     * @brief The high bits all keys share
+     */
+    Unsigned base;
+  };
+} // namespace CS280
+
+#ifndef RADIX_MAP_CPP
+#include "radix-map.cpp"
+#endif
+#endif
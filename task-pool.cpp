@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <system_error>
+#include <utility>
+
+#ifndef TASK_POOL_H
+#include "task-pool.h"
+#endif
+
+#ifndef TASK_POOL_CPP
+#define TASK_POOL_CPP
+
+namespace CS280 {
+
+  inline auto TaskPool::instance() -> TaskPool& {
+    static TaskPool pool;
+    return pool;
+  }
+
+  inline TaskPool::TaskPool():
+      batches{}, stopping{false}, lock{}, wake{}, done{}, workers{} {}
+
+  inline TaskPool::~TaskPool() {
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  inline auto TaskPool::run(usize threads, const std::function<void(usize)>& work)
+    -> void {
+    Batch batch{work, 1, std::max<usize>(threads, 1), 0, nullptr};
+    std::unique_lock<std::mutex> guard{lock};
+
+    if (batch.parts > 1) {
+      grow(batch.parts - 1);
+      batches.push_back(&batch);
+      wake.notify_all();
+    }
+    batch.running++;
+    run_part(batch, 0, guard);
+
+    // the parts still queued run here rather than wait for a free thread
+    while (batch.next < batch.parts) {
+      const usize part = batch.next++;
+      if (batch.next == batch.parts) {
+        batches.erase(std::find(batches.begin(), batches.end(), &batch));
+      }
+      batch.running++;
+      run_part(batch, part, guard);
+    }
+    done.wait(guard, [&batch] { return batch.running == 0; });
+
+    if (batch.error) {
+      std::rethrow_exception(batch.error);
+    }
+  }
+
+  inline auto TaskPool::size() -> usize {
+    std::lock_guard<std::mutex> guard{lock};
+    return workers.size();
+  }
+
+  inline auto TaskPool::grow(usize wanted) -> void {
+    while (workers.size() < wanted) {
+      try {
+        workers.emplace_back(&TaskPool::serve, this);
+      } catch (const std::system_error&) {
+        return;
+      }
+    }
+  }
+
+  inline auto TaskPool::run_part(
+    Batch& batch,
+    usize part,
+    std::unique_lock<std::mutex>& guard
+  ) -> void {
+    guard.unlock();
+    std::exception_ptr error{};
+    try {
+      batch.work(part);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    guard.lock();
+
+    if (error and not batch.error) {
+      batch.error = error;
+    }
+    if (--batch.running == 0) {
+      done.notify_all();
+    }
+  }
+
+  inline auto TaskPool::serve() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+
+    for (;;) {
+      wake.wait(guard, [this] { return stopping or not batches.empty(); });
+
+      if (batches.empty()) {
+        return;
+      }
+
+      Batch& batch = *batches.front();
+      const usize part = batch.next++;
+      if (batch.next == batch.parts) {
+        batches.pop_front();
+      }
+      batch.running++;
+      run_part(batch, part, guard);
+    }
+  }
+} // namespace CS280
+
+#endif
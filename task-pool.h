@@ -0,0 +1,155 @@
+#pragma once
+
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include "int-types.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CS280 {
+
+  /**
+   * @brief Threads kept waiting for the parallel copies and exports of
+   * AVLmap (see AVLmap::parallel_copies), so a copy does not pay for
+   * starting and joining threads. Started on first use, grown to the most
+   * threads a call asked for, stopped when the program exits
+   */
+  class TaskPool {
+
+  public:
+
+    /**
+     * @brief The process wide instance
+     */
+    [[nodiscard]] static inline auto instance() -> TaskPool&;
+
+    /**
+     * @brief Copy constructor
+     */
+    TaskPool(const TaskPool&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const TaskPool&) -> TaskPool& = delete;
+
+    /**
+     * @brief Destructor, stops the threads once the queued work has run
+     */
+    inline ~TaskPool();
+
+    /**
+     * @brief Runs work(thread) on the calling thread (thread 0) and
+     * work(1) to work(threads - 1) on the pool, returns once all are done.
+     * Parts no pool thread took by then run on the calling thread, so the
+     * call never waits on other callers. The first exception thrown by a
+     * part is rethrown here
+     */
+    inline auto run(usize threads, const std::function<void(usize)>& work)
+      -> void;
+
+    /**
+     * @brief Threads started so far
+     */
+    [[nodiscard]] inline auto size() -> usize;
+
+  private:
+
+    /**
+     * @brief The parts of one call of run
+     */
+    struct Batch {
+      /**
+       * @brief What each part runs
+       */
+      const std::function<void(usize)>& work;
+
+      /**
+       * @brief Next part to hand out
+       */
+      usize next;
+
+      /**
+       * @brief Parts in all, thread 0 included
+       */
+      usize parts;
+
+      /**
+       * @brief Parts handed out and not done yet
+       */
+      usize running;
+
+      /**
+       * @brief First exception a part threw
+       */
+      std::exception_ptr error;
+    };
+
+    /**
+     * @brief Starts no thread yet
+     */
+    inline TaskPool();
+
+    /**
+     * @brief Starts threads until there are at least wanted, as far as the
+     * system lets it. Called with lock held
+     */
+    inline auto grow(usize wanted) -> void;
+
+    /**
+     * @brief Runs the given part of batch unlocked, and counts it done
+     */
+    inline auto run_part(
+      Batch& batch,
+      usize part,
+      std::unique_lock<std::mutex>& guard
+    ) -> void;
+
+    /**
+     * @brief Body of the threads
+     */
+    inline auto serve() -> void;
+
+    /**
+     * @brief Batches with parts not handed out yet
+     */
+    std::deque<Batch*> batches;
+
+    /**
+     * @brief Tells the threads to exit
+     */
+    bool stopping;
+
+    /**
+     * @brief Guards batches, the batches and stopping
+     */
+    std::mutex lock;
+
+    /**
+     * @brief Wakes the threads
+     */
+    std::condition_variable wake;
+
+    /**
+     * @brief Wakes callers when a part is done
+     */
+    std::condition_variable done;
+
+    /**
+     * @brief The threads
+     */
+    std::vector<std::thread> workers;
+  };
+} // namespace CS280
+
+#ifndef TASK_POOL_CPP
+#include "task-pool.cpp"
+#endif
+#endif
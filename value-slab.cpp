@@ -0,0 +1,76 @@
+#pragma once
+
+#include <new>
+#include <utility>
+
+#ifndef VALUE_SLAB_H
+#include "value-slab.h"
+#endif
+
+#ifndef VALUE_SLAB_CPP
+#define VALUE_SLAB_CPP
+
+namespace CS280 {
+
+  template<typename V>
+  ValueSlab<V>::ValueSlab(): chunks{}, free_slots{nullptr}, fresh{0} {}
+
+  template<typename V>
+  ValueSlab<V>::ValueSlab(ValueSlab&& from):
+      chunks{std::move(from.chunks)},
+      free_slots{std::exchange(from.free_slots, nullptr)},
+      fresh{std::exchange(from.fresh, 0)} {
+    from.chunks.clear();
+  }
+
+  template<typename V>
+  auto ValueSlab<V>::operator=(ValueSlab&& from) -> ValueSlab& {
+    if (&from == this) {
+      return *this;
+    }
+
+    chunks = std::move(from.chunks);
+    from.chunks.clear();
+    free_slots = std::exchange(from.free_slots, nullptr);
+    fresh = std::exchange(from.fresh, 0);
+
+    return *this;
+  }
+
+  template<typename V>
+  template<typename... Args>
+  auto ValueSlab<V>::make(Args&&... args) -> V* {
+    Slot* slot = free_slots;
+
+    if (slot) {
+      free_slots = slot->next;
+    } else {
+      if (fresh == 0) {
+        chunks.emplace_back(new Slot[CHUNK]);
+        fresh = CHUNK;
+      }
+
+      slot = &chunks.back()[CHUNK - fresh--];
+    }
+
+    return new (slot->bytes) V(std::forward<Args>(args)...);
+  }
+
+  template<typename V>
+  auto ValueSlab<V>::free(V* value) -> void {
+    value->~V();
+
+    // the value sits at the start of its slot
+    Slot* const slot = reinterpret_cast<Slot*>(value);
+    slot->next = free_slots;
+    free_slots = slot;
+  }
+
+  template<typename V>
+  auto ValueSlab<V>::bytes() const -> usize {
+    return chunks.size() * CHUNK * sizeof(Slot)
+         + chunks.capacity() * sizeof(std::unique_ptr<Slot[]>);
+  }
+} // namespace CS280
+
+#endif
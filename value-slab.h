@@ -0,0 +1,107 @@
+#pragma once
+
+#ifndef VALUE_SLAB_H
+#define VALUE_SLAB_H
+
+#include <memory>
+#include <vector>
+
+#include "int-types.h"
+
+namespace CS280 {
+
+  /**
+   * @brief Pool of values of one type in chunks of about a page. A value
+   * never moves until it is freed, freed slots are reused first (last freed,
+   * first reused). Chunks are only given back when the slab is destroyed
+   */
+  template<typename V>
+  class ValueSlab {
+
+  public:
+
+    /**
+     * @brief Empty slab, allocates nothing until the first make
+     */
+    ValueSlab();
+
+    /**
+     * @brief Copy constructor, values are owned by whoever made them
+     */
+    ValueSlab(const ValueSlab&) = delete;
+
+    /**
+     * @brief Move constructor, the values keep their addresses
+     */
+    ValueSlab(ValueSlab&& from);
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const ValueSlab&) -> ValueSlab& = delete;
+
+    /**
+     * @brief Move assignment, every value of this slab must have been freed
+     */
+    auto operator=(ValueSlab&& from) -> ValueSlab&;
+
+    /**
+     * @brief Destructor, every value must have been freed
+     */
+    ~ValueSlab() = default;
+
+    /**
+     * @brief Constructs a value in a free slot
+     */
+    template<typename... Args>
+    [[nodiscard]] auto make(Args&&... args) -> V*;
+
+    /**
+     * @brief Destroys a value made by this slab, its slot is reused next
+     */
+    auto free(V* value) -> void;
+
+    /**
+     * @brief Memory held by the chunks
+     */
+    [[nodiscard]] auto bytes() const -> usize;
+
+  private:
+
+    /**
+     * @brief Room for a value, or the link to the next free slot
+     */
+    union Slot {
+      Slot* next;
+
+      alignas(V) unsigned char bytes[sizeof(V)];
+    };
+
+    /**
+     * @brief Slots per chunk
+     */
+    static constexpr usize CHUNK = sizeof(Slot) < 4096
+                                         ? 4096 / sizeof(Slot)
+                                         : 1;
+
+    /**
+     * @brief All chunks, the last one may still have unused slots
+     */
+    std::vector<std::unique_ptr<Slot[]>> chunks;
+
+    /**
+     * @brief Freed slots
+     */
+    Slot* free_slots;
+
+    /**
+     * @brief Slots of the last chunk that were never used
+     */
+    usize fresh;
+  };
+} // namespace CS280
+
+#ifndef VALUE_SLAB_CPP
+#include "value-slab.cpp"
+#endif
+#endif
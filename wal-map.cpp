@@ -0,0 +1,350 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef WALMAP_H
+#include "wal-map.h"
+#endif
+
+#ifndef WALMAP_CPP
+#define WALMAP_CPP
+
+namespace CS280 {
+
+  template<typename K, typename V>
+  WALmap<K, V>::WALmap():
+      data{},
+      path{},
+      fd{-1},
+      interval{},
+      checkpoint_bytes{0},
+      log_bytes{0},
+      pending{},
+      writing{},
+      appended{0},
+      durable{0},
+      commit_count{0},
+      committing{false},
+      stopping{false},
+      failed{false},
+      lock{},
+      wake{},
+      committed{},
+      committer{} {
+    static_assert(
+      std::is_trivially_copyable<K>::value
+        and std::is_trivially_copyable<V>::value,
+      "Records store raw key and value bytes"
+    );
+  }
+
+  template<typename K, typename V>
+  WALmap<K, V>::~WALmap() {
+    close();
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::open(
+    const std::string& prefix,
+    std::chrono::microseconds commit_interval,
+    usize checkpoint_size
+  ) -> bool {
+    close();
+
+    path = prefix;
+    interval = commit_interval;
+    checkpoint_bytes = checkpoint_size;
+
+    const std::string snapshot_path = path + ".snapshot";
+    const std::string log_path = path + ".wal";
+
+    bool loaded = false;
+    data = AVLmap<K, V>::load_mmap(snapshot_path.c_str(), &loaded);
+
+    // a missing snapshot is an empty map, a malformed one is an error
+    if (not loaded and ::access(snapshot_path.c_str(), F_OK) == 0) {
+      return false;
+    }
+
+    replay(log_path);
+
+    fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+      return false;
+    }
+
+    // drop a torn tail so new records follow the last good one
+    if (::ftruncate(fd, static_cast<off_t>(log_bytes)) != 0) {
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+
+    stopping = false;
+    committer = std::thread{&WALmap::run, this};
+
+    return true;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::close() -> void {
+    if (committer.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard{lock};
+        stopping = true;
+      }
+      wake.notify_one();
+      committer.join();
+    }
+
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::set(const K& key, const V& value) -> lsn {
+    data[key] = value;
+
+    Record record{};
+    record.op = SET;
+    record.key = key;
+    record.value = value;
+
+    return append(record);
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::erase(const K& key) -> lsn {
+    data.erase(data.find(key));
+
+    Record record{};
+    record.op = ERASE;
+    record.key = key;
+
+    return append(record);
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::wait_durable(lsn sequence) -> bool {
+    std::unique_lock<std::mutex> guard{lock};
+    committed.wait(guard, [&] {
+      return durable >= sequence or failed or fd < 0;
+    });
+    return durable >= sequence;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::flush() -> bool {
+    lsn last = 0;
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      last = appended;
+    }
+    return wait_durable(last);
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::checkpoint() -> bool {
+    // a failed log is left behind, the snapshot makes up for it
+    static_cast<void>(flush());
+
+    const std::string snapshot_path = path + ".snapshot";
+    const std::string temporary_path = snapshot_path + ".tmp";
+
+    // the rename is atomic, a crash leaves either snapshot intact
+    if (not data.save(temporary_path.c_str())) {
+      return false;
+    }
+
+    const int snapshot = ::open(temporary_path.c_str(), O_RDONLY);
+    const bool synced = snapshot >= 0 and ::fsync(snapshot) == 0;
+    if (snapshot >= 0) {
+      ::close(snapshot);
+    }
+
+    if (not synced
+        or std::rename(temporary_path.c_str(), snapshot_path.c_str()) != 0) {
+      return false;
+    }
+
+    // the rename is only durable once its directory is, a crash could
+    // otherwise keep the truncated log and lose the new snapshot
+    const usize slash = path.rfind('/');
+    std::string directory = ".";
+    if (slash != std::string::npos) {
+      directory = slash == 0 ? "/" : path.substr(0, slash);
+    }
+    const int parent = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    const bool renamed = parent >= 0 and ::fsync(parent) == 0;
+    if (parent >= 0) {
+      ::close(parent);
+    }
+
+    if (not renamed) {
+      return false;
+    }
+
+    std::unique_lock<std::mutex> guard{lock};
+    committed.wait(guard, [&] { return not committing; });
+
+    if (::ftruncate(fd, 0) != 0) {
+      return false;
+    }
+    log_bytes = 0;
+
+    // mutations are only made on this thread, so the snapshot has every
+    // one appended, the ones the failed log never got included
+    if (failed) {
+      pending.clear();
+      durable = appended;
+      failed = false;
+      committed.notify_all();
+    }
+
+    return true;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::map() const -> const AVLmap<K, V>& {
+    return data;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::commits() const -> u64 {
+    std::lock_guard<std::mutex> guard{lock};
+    return commit_count;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::checksum(const Record& record) -> u32 {
+    // FNV-1a over the key and value bytes, padding is not hashed
+    u32 hash = 2166136261u ^ record.op;
+
+    const auto* key = reinterpret_cast<const unsigned char*>(&record.key);
+    for (usize i = 0; i < sizeof(K); i++) {
+      hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    const auto* value = reinterpret_cast<const unsigned char*>(&record.value);
+    for (usize i = 0; i < sizeof(V); i++) {
+      hash = (hash ^ value[i]) * 16777619u;
+    }
+
+    return hash;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::append(const Record& record) -> lsn {
+    lsn sequence = 0;
+    bool full = false;
+
+    {
+      std::lock_guard<std::mutex> guard{lock};
+      pending.push_back(record);
+      pending.back().checksum = checksum(record);
+      sequence = ++appended;
+      full = log_bytes + pending.size() * sizeof(Record) >= checkpoint_bytes;
+    }
+
+    if (full) {
+      checkpoint();
+    }
+
+    return sequence;
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::replay(const std::string& log_path) -> void {
+    log_bytes = 0;
+
+    std::FILE* log = std::fopen(log_path.c_str(), "rb");
+    if (log == nullptr) {
+      return;
+    }
+
+    Record record{};
+    while (std::fread(&record, sizeof(record), 1, log) == 1
+           and record.checksum == checksum(record)) {
+      if (record.op == SET) {
+        data[record.key] = record.value;
+      } else if (record.op == ERASE) {
+        data.erase(data.find(record.key));
+      } else {
+        break;
+      }
+
+      log_bytes += sizeof(record);
+    }
+
+    std::fclose(log);
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::commit(std::unique_lock<std::mutex>& guard) -> void {
+    if (pending.empty() or failed) {
+      return;
+    }
+
+    writing.swap(pending);
+    const lsn batch_end = appended;
+    committing = true;
+
+    // writers keep appending to pending while the batch is written
+    guard.unlock();
+
+    const char* bytes = reinterpret_cast<const char*>(writing.data());
+    usize remaining = writing.size() * sizeof(Record);
+    usize written = 0;
+
+    while (remaining > 0) {
+      const ssize_t chunk = ::write(fd, bytes + written, remaining);
+      if (chunk < 0 and errno == EINTR) {
+        continue;
+      }
+      if (chunk <= 0) {
+        break;
+      }
+      written += static_cast<usize>(chunk);
+      remaining -= static_cast<usize>(chunk);
+    }
+
+    const bool synced = remaining == 0 and ::fdatasync(fd) == 0;
+
+    guard.lock();
+
+    log_bytes += written;
+    writing.clear();
+    if (synced) {
+      durable = batch_end;
+      commit_count++;
+    } else {
+      failed = true;
+    }
+    committing = false;
+
+    committed.notify_all();
+  }
+
+  template<typename K, typename V>
+  auto WALmap<K, V>::run() -> void {
+    std::unique_lock<std::mutex> guard{lock};
+
+    while (not stopping) {
+      wake.wait_for(guard, interval);
+      commit(guard);
+    }
+
+    // commit whatever was logged before close
+    commit(guard);
+    committed.notify_all();
+  }
+} // namespace CS280
+
+#endif
@@ -0,0 +1,279 @@
+#pragma once
+
+#ifndef WALMAP_H
+#define WALMAP_H
+
+#include "avl-map.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace CS280 {
+
+  /**
+   * @brief Crash durable AVLmap. Every mutation is applied to the in memory
+   * map and appended to a write-ahead log buffer, a background thread writes
+   * and fsyncs the buffer in group commits every commit interval, so many
+   * mutations share one fsync. Once the log grows past the checkpoint size
+   * the map is written to a snapshot (AVLmap::save) and the log is truncated.
+   * Opening replays the log on top of the last snapshot.
+   *
+   * Mutations are made from one thread, only the log buffer is shared with
+   * the commit thread. Keys and values must be trivially copyable.
+   *
+   * @tparam K Key
+   * @tparam V Value
+   */
+  template<typename K, typename V>
+  class WALmap {
+
+  public:
+
+    /**
+     * @brief Log sequence number, identifies a mutation
+     */
+    using lsn = u64;
+
+    /**
+     * @brief Default constructor, nothing is open
+     */
+    WALmap();
+
+    /**
+     * @brief Copy constructor
+     */
+    WALmap(const WALmap&) = delete;
+
+    /**
+     * @brief Copy assignment
+     */
+    auto operator=(const WALmap&) -> WALmap& = delete;
+
+    /**
+     * @brief Destructor, commits everything logged so far and closes
+     */
+    ~WALmap();
+
+    /**
+     * @brief Recovers the map from "<path>.snapshot" and "<path>.wal" (both
+     * may be missing) and starts the commit thread. Returns false if the
+     * snapshot is malformed or the log cannot be opened
+     */
+    auto open(
+      const std::string& path,
+      std::chrono::microseconds commit_interval = std::chrono::milliseconds{1},
+      usize checkpoint_bytes = usize{64} << 20
+    ) -> bool;
+
+    /**
+     * @brief Commits everything logged so far, stops the commit thread and
+     * closes the log (no checkpoint is taken)
+     */
+    auto close() -> void;
+
+    /**
+     * @brief Sets the value of a key, returns the sequence number of the
+     * mutation (see wait_durable)
+     */
+    auto set(const K& key, const V& value) -> lsn;
+
+    /**
+     * @brief Erases a key, returns the sequence number of the mutation
+     */
+    auto erase(const K& key) -> lsn;
+
+    /**
+     * @brief Blocks until the mutation with the given sequence number (and
+     * every one before it) is on disk, which takes up to one commit
+     * interval. Returns false if it never will be: a write or sync of the
+     * log failed (or the map was closed) first
+     */
+    auto wait_durable(lsn sequence) -> bool;
+
+    /**
+     * @brief Blocks until every mutation made so far is on disk, false if
+     * the log failed (see wait_durable)
+     */
+    auto flush() -> bool;
+
+    /**
+     * @brief Writes the map to the snapshot, makes the rename durable
+     * (fsync of the directory) and only then truncates the log. After the
+     * log failed this is the way back: the snapshot has every mutation, the
+     * log starts over and the failure is cleared
+     */
+    auto checkpoint() -> bool;
+
+    /**
+     * @brief Read only access to the in memory map
+     */
+    [[nodiscard]] auto map() const -> const AVLmap<K, V>&;
+
+    /**
+     * @brief How many group commits (fsyncs) were made
+     */
+    [[nodiscard]] auto commits() const -> u64;
+
+  private:
+
+    /**
+     * @struct Record
+     * @brief One logged mutation as laid out in the log file
+     */
+    struct Record {
+      /**
+       * @brief SET or ERASE
+       */
+      u32 op;
+
+      /**
+       * @brief Checksum of the rest of the record, detects a torn tail
+       */
+      u32 checksum;
+
+      /**
+       * @brief Key data
+       */
+      K key;
+
+      /**
+       * @brief Value data (unused for erase)
+       */
+      V value;
+    };
+
+    /**
+     * @brief Record operations
+     */
+    static constexpr u32 SET = 1;
+
+    static constexpr u32 ERASE = 2;
+
+    /**
+     * @brief Checksum of a record, not counting the checksum field
+     */
+    [[nodiscard]] static auto checksum(const Record& record) -> u32;
+
+    /**
+     * @brief Appends a record to the log buffer, checkpointing if needed
+     */
+    auto append(const Record& record) -> lsn;
+
+    /**
+     * @brief Applies the records of the log file to the map, stops at the
+     * first torn or corrupt record
+     */
+    auto replay(const std::string& log_path) -> void;
+
+    /**
+     * @brief Writes the buffered records and fsyncs, the commit lock must be
+     * held. Sets failed instead of advancing durable if either fails
+     */
+    auto commit(std::unique_lock<std::mutex>& lock) -> void;
+
+    /**
+     * @brief Body of the commit thread
+     */
+    auto run() -> void;
+
+    /**
+     * @brief In memory map
+     */
+    AVLmap<K, V> data;
+
+    /**
+     * @brief Path prefix of the snapshot and log files
+     */
+    std::string path;
+
+    /**
+     * @brief Log file descriptor
+     */
+    int fd;
+
+    /**
+     * @brief How often the commit thread commits
+     */
+    std::chrono::microseconds interval;
+
+    /**
+     * @brief Log size that triggers a checkpoint
+     */
+    usize checkpoint_bytes;
+
+    /**
+     * @brief Bytes written to the log file
+     */
+    usize log_bytes;
+
+    /**
+     * @brief Records not yet handed to the commit thread
+     */
+    std::vector<Record> pending;
+
+    /**
+     * @brief Records being written by the commit thread
+     */
+    std::vector<Record> writing;
+
+    /**
+     * @brief Sequence number of the last appended record
+     */
+    lsn appended;
+
+    /**
+     * @brief Sequence number of the last record on disk
+     */
+    lsn durable;
+
+    /**
+     * @brief Number of group commits made
+     */
+    u64 commit_count;
+
+    /**
+     * @brief Is a commit in progress (the commit lock is released during I/O)
+     */
+    bool committing;
+
+    /**
+     * @brief Tells the commit thread to exit
+     */
+    bool stopping;
+
+    /**
+     * @brief Did a write or sync of the log fail. Sticky: the log may end
+     * in a torn record, nothing is appended after it until a checkpoint
+     */
+    bool failed;
+
+    /**
+     * @brief Guards the buffers and sequence numbers
+     */
+    mutable std::mutex lock;
+
+    /**
+     * @brief Wakes the commit thread
+     */
+    std::condition_variable wake;
+
+    /**
+     * @brief Signals waiters that durable advanced
+     */
+    std::condition_variable committed;
+
+    /**
+     * @brief Commit thread
+     */
+    std::thread committer;
+  };
+} // namespace CS280
+
+#ifndef WALMAP_CPP
+#include "wal-map.cpp"
+#endif
+#endif